@@ -7,7 +7,9 @@
 
 #include <cmath>
 #include <concepts>
+#include <cstddef>
 #include <iterator>
+#include <limits>
 #include <numeric>
 #include <ranges>
 
@@ -56,4 +58,70 @@ constexpr double coefficient_of_variation(const stat_range auto &input) {
 
   return sigma / mean;
 }
+
+/// Two-sided 95% critical value of Student's t distribution with \p degrees
+/// degrees of freedom. Infinite for 0 degrees.
+inline double student_t_critical_95(size_t degrees) {
+  constexpr double table[] = {
+      12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+      2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+      2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+  constexpr size_t tableSize = sizeof(table) / sizeof(table[0]);
+
+  if (degrees == 0)
+    return std::numeric_limits<double>::infinity();
+  if (degrees <= tableSize)
+    return table[degrees - 1];
+
+  // Cornish-Fisher expansion around the normal quantile.
+  constexpr double z = 1.959964;
+  const double v = static_cast<double>(degrees);
+  return z + (z * z * z + z) / (4.0 * v) +
+         (5.0 * std::pow(z, 5) + 16.0 * z * z * z + 3.0 * z) / (96.0 * v * v);
+}
+
+/// Mean and standard deviation of a stream of values, updated one value at a
+/// time with Welford's algorithm. Matches the functions above on the same
+/// values.
+class running_statistics {
+public:
+  constexpr void push(double value) {
+    mCount++;
+    const double delta = value - mMean;
+    mMean += delta / mCount;
+    mSquares += delta * (value - mMean);
+  }
+
+  constexpr size_t count() const { return mCount; }
+
+  constexpr double mean() const {
+    if (mCount == 0)
+      return std::numeric_limits<double>::quiet_NaN();
+    return mMean;
+  }
+
+  double standard_deviation() const {
+    if (mCount == 0)
+      return std::numeric_limits<double>::quiet_NaN();
+    return std::sqrt(mSquares / mCount);
+  }
+
+  double coefficient_of_variation() const {
+    return standard_deviation() / mean();
+  }
+
+  /// Standard error of the mean, from the sample variance. NaN for less than
+  /// two values.
+  double standard_error() const {
+    if (mCount < 2)
+      return std::numeric_limits<double>::quiet_NaN();
+    return std::sqrt(mSquares / (mCount * (mCount - 1)));
+  }
+
+private:
+  size_t mCount = 0;
+  double mMean = 0.0;
+  /// Sum of squared differences from the mean.
+  double mSquares = 0.0;
+};
 }
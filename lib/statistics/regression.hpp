@@ -0,0 +1,82 @@
+//===--- regression.hpp - Robust linear regression ------------------------===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "cov.hpp"
+#include "robust.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+namespace llvm_ml::stat {
+/// Line y = slope * x + intercept fitted to a set of points.
+struct linear_fit {
+  double slope;
+  double intercept;
+  /// Coefficient of determination, 1 for points that lie on the line, lower
+  /// the worse the line explains them.
+  double r_squared;
+};
+
+/// Fits a line to the points (xs[i], ys[i]) with the Theil-Sen estimator. The
+/// slope is the median of the slopes between all pairs of points with
+/// distinct x, the intercept is the median of y - slope * x. Unlike least
+/// squares, the fit ignores up to 29% of arbitrary outliers. Returns NaNs if
+/// there are no two points with distinct x.
+linear_fit theil_sen(const stat_range auto &xs, const stat_range auto &ys) {
+  const size_t size = std::min(std::ranges::size(xs), std::ranges::size(ys));
+  const auto x = [&](size_t i) {
+    return static_cast<double>(*std::next(xs.begin(), i));
+  };
+  const auto y = [&](size_t i) {
+    return static_cast<double>(*std::next(ys.begin(), i));
+  };
+
+  std::vector<double> slopes;
+  slopes.reserve(size * (size - 1) / 2);
+  for (size_t i = 0; i < size; i++) {
+    for (size_t j = i + 1; j < size; j++) {
+      if (x(i) != x(j))
+        slopes.push_back((y(j) - y(i)) / (x(j) - x(i)));
+    }
+  }
+
+  constexpr double nan = std::numeric_limits<double>::quiet_NaN();
+  if (slopes.empty())
+    return linear_fit{nan, nan, nan};
+
+  linear_fit fit;
+  fit.slope = median(std::move(slopes));
+
+  std::vector<double> intercepts;
+  intercepts.reserve(size);
+  for (size_t i = 0; i < size; i++)
+    intercepts.push_back(y(i) - fit.slope * x(i));
+  fit.intercept = median(std::move(intercepts));
+
+  double meanY = 0.0;
+  for (size_t i = 0; i < size; i++)
+    meanY += y(i);
+  meanY /= size;
+
+  double residuals = 0.0;
+  double total = 0.0;
+  for (size_t i = 0; i < size; i++) {
+    const double residual = y(i) - (fit.slope * x(i) + fit.intercept);
+    residuals += residual * residual;
+    total += (y(i) - meanY) * (y(i) - meanY);
+  }
+
+  // Constant y is explained perfectly by a flat line.
+  fit.r_squared = total == 0.0 ? (residuals == 0.0 ? 1.0 : 0.0)
+                               : 1.0 - residuals / total;
+
+  return fit;
+}
+} // namespace llvm_ml::stat
@@ -0,0 +1,106 @@
+//===--- robust.hpp - Outlier resistant statistics ------------------------===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace llvm_ml::stat {
+/// Median of values. Returns NaN for an empty input.
+inline double median(std::vector<double> values) {
+  if (values.empty())
+    return std::numeric_limits<double>::quiet_NaN();
+
+  const size_t mid = values.size() / 2;
+  std::nth_element(values.begin(), values.begin() + mid, values.end());
+  const double upper = values[mid];
+  if (values.size() % 2 == 1)
+    return upper;
+
+  const double lower = *std::max_element(values.begin(), values.begin() + mid);
+  return (lower + upper) / 2.0;
+}
+
+/// Quantile \p q in [0, 1] of values, linearly interpolated between the
+/// closest ranks. Returns NaN for an empty input.
+inline double quantile(std::vector<double> values, double q) {
+  if (values.empty())
+    return std::numeric_limits<double>::quiet_NaN();
+
+  std::sort(values.begin(), values.end());
+  const double rank = std::clamp(q, 0.0, 1.0) * (values.size() - 1);
+  const size_t lower = static_cast<size_t>(std::floor(rank));
+  const size_t upper = std::min(lower + 1, values.size() - 1);
+  return values[lower] + (rank - lower) * (values[upper] - values[lower]);
+}
+
+/// Median absolute deviation from the median, scaled by 1.4826, so that it
+/// estimates the standard deviation of normally distributed values.
+inline double median_absolute_deviation(const std::vector<double> &values) {
+  const double center = median(values);
+
+  std::vector<double> deviations;
+  deviations.reserve(values.size());
+  for (double value : values)
+    deviations.push_back(std::abs(value - center));
+
+  return 1.4826 * median(std::move(deviations));
+}
+
+/// Mean of values, after dropping \p fraction of the smallest and as many of
+/// the largest values. Returns NaN for an empty input.
+inline double trimmed_mean(std::vector<double> values, double fraction) {
+  if (values.empty())
+    return std::numeric_limits<double>::quiet_NaN();
+
+  std::sort(values.begin(), values.end());
+  size_t trim = static_cast<size_t>(std::clamp(fraction, 0.0, 0.5) *
+                                    static_cast<double>(values.size()));
+  // Keep at least the median.
+  if (2 * trim >= values.size())
+    trim = (values.size() - 1) / 2;
+
+  double sum = 0.0;
+  for (size_t i = trim; i < values.size() - trim; i++)
+    sum += values[i];
+  return sum / static_cast<double>(values.size() - 2 * trim);
+}
+
+/// Percentile bootstrap confidence interval of a statistic. \p statistic is
+/// called with \p resamples vectors of \p size indices drawn with replacement
+/// from [0, size) and returns the statistic of the items at those indices.
+/// The generator is seeded with \p seed, so that intervals are reproducible.
+/// Returns NaNs if there are no items.
+template <typename Statistic>
+std::pair<double, double>
+bootstrap_interval(size_t size, Statistic statistic, double confidence = 0.95,
+                   size_t resamples = 1000, uint64_t seed = 0) {
+  constexpr double nan = std::numeric_limits<double>::quiet_NaN();
+  if (size == 0 || resamples == 0)
+    return {nan, nan};
+
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<size_t> pick(0, size - 1);
+
+  std::vector<size_t> indices(size);
+  std::vector<double> estimates;
+  estimates.reserve(resamples);
+  for (size_t i = 0; i < resamples; i++) {
+    for (size_t &index : indices)
+      index = pick(rng);
+    estimates.push_back(statistic(indices));
+  }
+
+  const double tail = (1.0 - confidence) / 2.0;
+  return {quantile(estimates, tail), quantile(estimates, 1.0 - tail)};
+}
+} // namespace llvm_ml::stat
@@ -15,7 +15,7 @@
 namespace fs = std::filesystem;
 
 void llvm_ml::writeToFile(fs::path path, capnp::MessageBuilder &message) {
-  int fd = open(path.c_str(), O_CREAT | O_RDWR,
+  int fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC,
                 S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
   if (fd < 0) {
     perror("Failed to create output file");
@@ -5,12 +5,18 @@
 
 #pragma once
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/Support/Error.h"
 #include "llvm/TargetParser/Triple.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <optional>
 #include <set>
 #include <string>
+#include <vector>
 
 namespace llvm {
 class MCInst;
@@ -37,10 +43,74 @@ public:
                             llvm::StringRef label) = 0;
   virtual void createLabel(llvm::IRBuilderBase &builder,
                            llvm::StringRef labelName) = 0;
+  /// Pads the code, so that the next instruction starts \p offset bytes past
+  /// an \p alignment boundary. The padding is not meant to be executed, it
+  /// must follow an unconditional branch.
+  virtual void createCodeAlignment(llvm::IRBuilderBase &builder,
+                                   unsigned alignment, unsigned offset) = 0;
+  /// Stores the trip count of the harness loop. Must be emitted after
+  /// createSaveState, that may overwrite the counter.
+  virtual void createLoopCounterInit(llvm::IRBuilderBase &builder,
+                                     llvm::Value *tripCount) = 0;
+  /// Decrements the loop counter and jumps to \p label until it reaches zero.
+  virtual void createLoopLatch(llvm::IRBuilderBase &builder,
+                               llvm::StringRef label) = 0;
 
   virtual ~InlineAsmBuilder() = default;
 };
 
+/// Boundary, that code alignment of the block in harnesses is relative to. A
+/// cache line, that also covers the 32-byte decoded icache windows.
+inline constexpr unsigned kCodeAlignment = 64;
+
+/// Machine code of harness functions. The code is position independent.
+struct EncodedHarness {
+  std::vector<char> code;
+  /// Offset of every function in code.
+  std::map<std::string, size_t> symbols;
+};
+
+/// HarnessEncoder emits harness functions straight to machine code with the
+/// target MCCodeEmitter. It follows the same layout and calling convention as
+/// the InlineAsmBuilder-based harnesses, but skips LLVM IR, codegen and
+/// linking.
+class HarnessEncoder {
+public:
+  /// Appends a function named \p name to \p harness. The function repeats
+  /// \p block \p numRepeat times in straight-line code if \p unrollFactor is
+  /// 0. Otherwise the block is repeated \p unrollFactor times inside of a loop
+  /// with a run time trip count. If \p startOffset is set, the first copy of
+  /// the block starts this many bytes past a kCodeAlignment boundary of
+  /// harness code.
+  virtual llvm::Error
+  encodeFunction(llvm::StringRef name, llvm::ArrayRef<llvm::MCInst> block,
+                 int numRepeat, int unrollFactor,
+                 std::optional<unsigned> startOffset,
+                 EncodedHarness &harness) = 0;
+
+  /// Returns the size of \p block encoded to machine code in bytes.
+  virtual llvm::Expected<size_t>
+  getCodeSize(llvm::ArrayRef<llvm::MCInst> block) = 0;
+
+  virtual ~HarnessEncoder() = default;
+};
+
+/// Way the repeated copies of a block depend on each other.
+enum class DependencyMode {
+  /// Every copy waits for a result of the previous one.
+  Latency,
+  /// Copies do not wait for each other.
+  Throughput,
+};
+
+/// Block rewritten for a DependencyMode.
+struct DependencyVariant {
+  std::vector<llvm::MCInst> instructions;
+  /// Number of copies of the block in instructions, each with registers of
+  /// its own.
+  unsigned numCopies = 1;
+};
+
 class MLTarget {
 public:
   virtual ~MLTarget() = default;
@@ -67,7 +137,30 @@ public:
   virtual bool isVectorReg(unsigned reg) = 0;
   virtual bool isTileReg(unsigned reg) = 0;
 
+  /// Returns the data addresses that explicit memory operands of \p block
+  /// access, given the register values set up by the harness. Operands that
+  /// can not be resolved without running the block are skipped.
+  virtual std::vector<uint64_t>
+  predictDataAddresses(llvm::ArrayRef<llvm::MCInst> block) = 0;
+
+  /// Renames registers of \p block, so that its repeated copies depend on each
+  /// other as \p mode requires. For latency a register read before it is
+  /// written takes the place of one written later in the block. For
+  /// throughput the block is unrolled and registers carried from one copy to
+  /// the next get a free register per copy. A block that already is in the
+  /// required shape is returned as is. Fails if registers can not be renamed.
+  virtual llvm::Expected<DependencyVariant>
+  createDependencyVariant(llvm::ArrayRef<llvm::MCInst> block,
+                          DependencyMode mode,
+                          const llvm::MCRegisterInfo &mcri) = 0;
+
   virtual std::unique_ptr<InlineAsmBuilder> createInlineAsmBuilder() = 0;
+  /// Creates an encoder, that uses \p context for parsing and encoding. The
+  /// context must outlive the encoder.
+  virtual llvm::Expected<std::unique_ptr<HarnessEncoder>>
+  createHarnessEncoder(const llvm::Target *target, llvm::MCContext &context,
+                       const llvm::MCSubtargetInfo &msti,
+                       const llvm::MCTargetOptions &options) = 0;
 };
 
 std::unique_ptr<MLTarget> createMLTarget(const llvm::Triple &triple,
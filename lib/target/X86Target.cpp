@@ -10,13 +10,25 @@
 #include "llvm/IR/IntrinsicsX86.h"
 #include "llvm/IR/Module.h"
 #include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCCodeEmitter.h"
 #include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCFixup.h"
 #include "llvm/MC/MCInstrInfo.h"
 #include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
 
 #include "MCTargetDesc/X86BaseInfo.h"
 
+#include <initializer_list>
+#include <map>
+#include <optional>
+#include <set>
+
 constexpr auto SaveState = R"(
   push %rax
   push %rbx
@@ -118,6 +130,82 @@ constexpr auto Epilogue = R"(
   movq %rax, %rsp
 )";
 
+/// Entry sequence of encoded harnesses. The arguments are kept in
+/// callee-saved registers: the counters context in r12, counters_stop in r13,
+/// counters_start in r14 and the harness arguments in r15. SaveState and
+/// RestoreState preserve r12 and r13 across the workload.
+constexpr auto EncodedEntry = R"(
+  push %rbx
+  push %rbp
+  push %r12
+  push %r13
+  push %r14
+  push %r15
+  sub $$8, %rsp
+
+  movq %rdi, %r12
+  movq %rsi, %r14
+  movq %rdx, %r13
+  movq %rcx, %r15
+)";
+
+constexpr auto EncodedStartCounters = R"(
+  movq %r12, %rdi
+  callq *%r14
+)";
+
+constexpr auto EncodedStopCounters = R"(
+  movq %r12, %rdi
+  callq *%r13
+)";
+
+/// Loads MXCSR through the stack slot reserved by EncodedEntry.
+constexpr auto LoadMXCSR = R"(
+  movl $${0}, (%rsp)
+  ldmxcsr (%rsp)
+)";
+
+/// Stores HarnessArgs::numRepeat / unroll factor, but at least 1, to the loop
+/// counter.
+constexpr auto LoopCounterInit = R"(
+  movq (%r15), %rax
+  xorl %edx, %edx
+  movq $${0}, %rcx
+  divq %rcx
+  cmpq $$1, %rax
+  adcq $$0, %rax
+  movq %rax, {1:x}
+)";
+
+constexpr auto EncodedExit = R"(
+  add $$8, %rsp
+  pop %r15
+  pop %r14
+  pop %r13
+  pop %r12
+  pop %rbp
+  pop %rbx
+  retq
+)";
+
+/// Loop counter of the harness, it shares the page with the saved stack
+/// pointers.
+constexpr uint64_t kLoopCounterAddr = 0x2325020;
+
+/// Value of general purpose registers set by PrologueX64.
+constexpr uint64_t kRegisterInitValue = 0x2324000;
+
+constexpr unsigned kDefaultMXCSR = 0x1f80;
+constexpr unsigned kFlushToZero = 0x8000;
+constexpr unsigned kUnderflowMask = 0x0800;
+constexpr unsigned kOverflowMask = 0x0400;
+constexpr unsigned kDenormalsAreZeros = 0x0040;
+constexpr unsigned kDivideByZeroMask = 0x0200;
+/// MXCSR value while the harness runs.
+constexpr unsigned kHarnessMXCSR = kDefaultMXCSR & kFlushToZero &
+                                   !kUnderflowMask & !kOverflowMask &
+                                   kDenormalsAreZeros & !kDivideByZeroMask;
+
 namespace {
 class X86InlineAsmBuilder : public llvm_ml::InlineAsmBuilder {
 public:
@@ -140,15 +228,7 @@ public:
     llvm::Type *i32ty = llvm::Type::getInt32Ty(builder.getContext());
     llvm::Type *ptr = i32ty->getPointerTo();
     auto alloca = builder.CreateAlloca(ptr);
-    constexpr unsigned defaultValue = 0x1f80;
-    constexpr unsigned flushToZero = 0x8000;
-    constexpr unsigned underflowMask = 0x0800;
-    constexpr unsigned overflowMask = 0x0400;
-    constexpr unsigned denormalsAreZeros = 0x0040;
-    constexpr unsigned divideByZeroMask = 0x0200;
-    auto val = llvm::ConstantInt::get(
-        i32ty, defaultValue & flushToZero & !underflowMask & !overflowMask &
-                   denormalsAreZeros & !divideByZeroMask);
+    auto val = llvm::ConstantInt::get(i32ty, kHarnessMXCSR);
     builder.CreateStore(val, alloca);
 
     builder.CreateIntrinsic(builder.getVoidTy(),
@@ -166,11 +246,10 @@ public:
                                           "~{dirflag},~{fpsr},~{flags}", true);
     builder.CreateCall(asmCallee);
 
-    constexpr unsigned defaultValue = 0x1f80;
     llvm::Type *i32ty = llvm::Type::getInt32Ty(builder.getContext());
     llvm::Type *ptr = i32ty->getPointerTo();
     auto alloca = builder.CreateAlloca(ptr);
-    auto val = llvm::ConstantInt::get(i32ty, defaultValue);
+    auto val = llvm::ConstantInt::get(i32ty, kDefaultMXCSR);
     builder.CreateStore(val, alloca);
 
     builder.CreateIntrinsic(builder.getVoidTy(),
@@ -192,6 +271,539 @@ public:
                                           "", false, true);
     builder.CreateCall(asmCallee);
   }
+
+  void createCodeAlignment(llvm::IRBuilderBase &builder, unsigned alignment,
+                           unsigned offset) override {
+    auto voidFuncTy = llvm::FunctionType::get(builder.getVoidTy(), false);
+    auto asmCallee = llvm::InlineAsm::get(
+        voidFuncTy,
+        llvm::formatv(".p2align {0}\n\t.skip {1}, 0x90",
+                      llvm::Log2_32(alignment), offset)
+            .str(),
+        "", false, true);
+    builder.CreateCall(asmCallee);
+  }
+
+  void createLoopCounterInit(llvm::IRBuilderBase &builder,
+                             llvm::Value *tripCount) override {
+    auto *counter = builder.CreateIntToPtr(
+        builder.getInt64(kLoopCounterAddr),
+        llvm::PointerType::getUnqual(builder.getContext()));
+    builder.CreateStore(tripCount, counter, /*isVolatile=*/true);
+  }
+
+  void createLoopLatch(llvm::IRBuilderBase &builder,
+                       llvm::StringRef label) override {
+    auto voidFuncTy = llvm::FunctionType::get(builder.getVoidTy(), false);
+    auto asmCallee = llvm::InlineAsm::get(
+        voidFuncTy,
+        llvm::formatv("decq {0:x}\n\tjnz {1}", kLoopCounterAddr, label).str(),
+        "~{dirflag},~{fpsr},~{flags}", false, true);
+    builder.CreateCall(asmCallee);
+  }
+};
+
+class X86HarnessEncoder : public llvm_ml::HarnessEncoder {
+public:
+  X86HarnessEncoder(std::unique_ptr<llvm::MCCodeEmitter> emitter,
+                    const llvm::Target *target, llvm::MCContext &context,
+                    const llvm::MCInstrInfo &mcii,
+                    const llvm::MCSubtargetInfo &msti,
+                    const llvm::MCTargetOptions &options)
+      : mEmitter(std::move(emitter)), mTarget(target), mContext(context),
+        mII(mcii), mSTI(msti), mOptions(options) {}
+
+  /// Encodes the fixed parts of the harness.
+  llvm::Error init() {
+    const std::string harnessMXCSR = llvm::formatv(LoadMXCSR, kHarnessMXCSR);
+    const std::string defaultMXCSR = llvm::formatv(LoadMXCSR, kDefaultMXCSR);
+    const std::string loopLatch =
+        llvm::formatv("decq {0:x}", kLoopCounterAddr).str();
+
+    const std::pair<llvm::StringRef, std::vector<char> *> snippets[] = {
+        {EncodedEntry, &mEntry},
+        {harnessMXCSR, &mLoadHarnessMXCSR},
+        {SaveState, &mSaveState},
+        {EncodedStartCounters, &mStartCounters},
+        {PrologueX64, &mSetupEnv},
+        {loopLatch, &mLoopLatch},
+        {Epilogue, &mRestoreEnv},
+        {RestoreState, &mRestoreState},
+        {defaultMXCSR, &mLoadDefaultMXCSR},
+        {EncodedStopCounters, &mStopCounters},
+        {EncodedExit, &mExit},
+    };
+
+    for (auto [snippet, code] : snippets) {
+      if (auto err = encodeSnippet(snippet, *code))
+        return err;
+    }
+
+    return llvm::Error::success();
+  }
+
+  llvm::Error encodeFunction(llvm::StringRef name,
+                             llvm::ArrayRef<llvm::MCInst> block, int numRepeat,
+                             int unrollFactor,
+                             std::optional<unsigned> startOffset,
+                             llvm_ml::EncodedHarness &harness) override {
+    std::vector<char> body;
+    if (auto err = encode(block, body))
+      return err;
+
+    std::vector<char> &code = harness.code;
+    harness.symbols[name.str()] = code.size();
+
+    llvm::append_range(code, mEntry);
+    llvm::append_range(code, mLoadHarnessMXCSR);
+    llvm::append_range(code, mSaveState);
+
+    // xsave may overwrite the loop counter, initialize it afterwards.
+    if (unrollFactor != 0) {
+      if (auto err = encodeSnippet(
+              llvm::formatv(LoopCounterInit, unrollFactor, kLoopCounterAddr)
+                  .str(),
+              code))
+        return err;
+    }
+    llvm::append_range(code, mStartCounters);
+    llvm::append_range(code, mSetupEnv);
+
+    // jmp workload_start, the padding in between is never executed. Code is
+    // loaded at page boundaries, offsets in it keep their alignment.
+    size_t workloadStart = code.size() + 5;
+    if (startOffset)
+      workloadStart += (*startOffset - workloadStart) % llvm_ml::kCodeAlignment;
+    emitBranch({0xE9}, workloadStart, code);
+    code.resize(workloadStart, static_cast<char>(0x90));
+
+    for (int i = 0, e = unrollFactor == 0 ? numRepeat : unrollFactor; i < e;
+         i++)
+      llvm::append_range(code, body);
+
+    if (unrollFactor != 0) {
+      // decq kLoopCounterAddr; jnz workload_start
+      llvm::append_range(code, mLoopLatch);
+      emitBranch({0x0F, 0x85}, workloadStart, code);
+    }
+
+    // jmp workload_end
+    emitBranch({0xE9}, code.size() + 5, code);
+
+    llvm::append_range(code, mRestoreEnv);
+    llvm::append_range(code, mRestoreState);
+    llvm::append_range(code, mLoadDefaultMXCSR);
+    llvm::append_range(code, mStopCounters);
+    llvm::append_range(code, mExit);
+
+    return llvm::Error::success();
+  }
+
+  llvm::Expected<size_t>
+  getCodeSize(llvm::ArrayRef<llvm::MCInst> block) override {
+    std::vector<char> code;
+    if (auto err = encode(block, code))
+      return std::move(err);
+    return code.size();
+  }
+
+private:
+  llvm::Error encode(llvm::ArrayRef<llvm::MCInst> insts,
+                     std::vector<char> &code) {
+    llvm::SmallVector<char, 16> bytes;
+    llvm::SmallVector<llvm::MCFixup> fixups;
+
+    for (const llvm::MCInst &inst : insts) {
+      bytes.clear();
+      mEmitter->encodeInstruction(inst, bytes, fixups, mSTI);
+
+      // There is no linker, the code must not refer to any symbols.
+      if (!fixups.empty())
+        return llvm::createStringError(std::errc::invalid_argument,
+                                       "Instruction requires a relocation");
+
+      llvm::append_range(code, bytes);
+    }
+
+    return llvm::Error::success();
+  }
+
+  /// Parses one of the inline assembly snippets and encodes it.
+  llvm::Error encodeSnippet(llvm::StringRef snippet, std::vector<char> &code) {
+    // Undo the inline assembly escaping of '$'.
+    std::string source = snippet.str();
+    for (size_t pos = 0; pos = source.find("$$", pos), pos != std::string::npos;
+         pos++)
+      source.erase(pos, 1);
+
+    llvm::SourceMgr srcMgr;
+    srcMgr.AddNewSourceBuffer(llvm::MemoryBuffer::getMemBufferCopy(source),
+                              llvm::SMLoc());
+
+    auto insts = llvm_ml::parseAssembly(
+        srcMgr, mII, *mContext.getRegisterInfo(), *mContext.getAsmInfo(), mSTI,
+        mContext, mTarget, mContext.getTargetTriple(), mOptions);
+    if (!insts)
+      return insts.takeError();
+
+    return encode(*insts, code);
+  }
+
+  /// Emits a branch with a 32-bit displacement to \p target.
+  static void emitBranch(std::initializer_list<uint8_t> opcode, size_t target,
+                         std::vector<char> &code) {
+    llvm::append_range(code, opcode);
+    const auto displacement = static_cast<int32_t>(
+        static_cast<int64_t>(target) -
+        static_cast<int64_t>(code.size() + sizeof(int32_t)));
+    char bytes[sizeof(int32_t)];
+    llvm::support::endian::write32le(bytes, displacement);
+    code.insert(code.end(), std::begin(bytes), std::end(bytes));
+  }
+
+  std::unique_ptr<llvm::MCCodeEmitter> mEmitter;
+  const llvm::Target *mTarget;
+  llvm::MCContext &mContext;
+  const llvm::MCInstrInfo &mII;
+  const llvm::MCSubtargetInfo &mSTI;
+  const llvm::MCTargetOptions &mOptions;
+
+  std::vector<char> mEntry;
+  std::vector<char> mLoadHarnessMXCSR;
+  std::vector<char> mSaveState;
+  std::vector<char> mStartCounters;
+  std::vector<char> mSetupEnv;
+  std::vector<char> mLoopLatch;
+  std::vector<char> mRestoreEnv;
+  std::vector<char> mRestoreState;
+  std::vector<char> mLoadDefaultMXCSR;
+  std::vector<char> mStopCounters;
+  std::vector<char> mExit;
+};
+
+/// Returns the 64-bit register that \p reg is a part of, or 0 if \p reg is
+/// not a general purpose register.
+static unsigned getGPR64(unsigned reg) {
+  using namespace llvm::X86;
+  static const unsigned gprs[][5] = {
+      {RAX, EAX, AX, AL, AH},  {RBX, EBX, BX, BL, BH},  {RCX, ECX, CX, CL, CH},
+      {RDX, EDX, DX, DL, DH},  {RSI, ESI, SI, SIL},     {RDI, EDI, DI, DIL},
+      {RBP, EBP, BP, BPL},     {RSP, ESP, SP, SPL},     {R8, R8D, R8W, R8B},
+      {R9, R9D, R9W, R9B},     {R10, R10D, R10W, R10B}, {R11, R11D, R11W, R11B},
+      {R12, R12D, R12W, R12B}, {R13, R13D, R13W, R13B}, {R14, R14D, R14W, R14B},
+      {R15, R15D, R15W, R15B}};
+
+  if (reg == 0)
+    return 0;
+
+  for (const auto &family : gprs) {
+    if (llvm::is_contained(family, reg))
+      return family[0];
+  }
+
+  return 0;
+}
+
+/// Maximum number of copies a throughput variant unrolls the block to. Enough
+/// to hide the latency of most instructions behind their throughput.
+constexpr unsigned kMaxDependencyCopies = 8;
+
+/// Renames registers of a block, so that its repeated copies depend on each
+/// other or do not. Registers are renamed as a family: the 64-bit GPR or the
+/// ZMM register along with all of their sub-registers.
+class DependencyRewriter {
+public:
+  DependencyRewriter(llvm_ml::MLTarget &target, const llvm::MCInstrInfo &mcii,
+                     const llvm::MCRegisterInfo &mcri,
+                     llvm::ArrayRef<llvm::MCInst> block)
+      : mTarget(target), mII(mcii), mRI(mcri), mBlock(block) {
+    analyze();
+  }
+
+  llvm::Expected<llvm_ml::DependencyVariant> createLatencyVariant() {
+    // Some register already carries a dependency to the next copy.
+    if (hasCarriedFamily())
+      return llvm_ml::DependencyVariant{mBlock.vec(), 1};
+
+    // A register that is read but never written does not chain the copies.
+    // Reading one written later in its place makes the next copy wait for
+    // it. Address registers are left alone, the register written may not
+    // point to mapped memory.
+    for (const auto &[from, source] : getFamiliesByFirstRead()) {
+      if (!source->isRenamable || source->isAddress || source->firstWrite >= 0)
+        continue;
+
+      std::optional<unsigned> to;
+      int lastWrite = -1;
+      for (const auto &[root, family] : mFamilies) {
+        if (family.isRenamable && family.isVector == source->isVector &&
+            family.firstWrite >= source->firstRead &&
+            family.lastWrite > lastWrite) {
+          to = root;
+          lastWrite = family.lastWrite;
+        }
+      }
+      if (!to)
+        continue;
+
+      // Writes of the renamed register in between may still cut the chain.
+      std::vector<llvm::MCInst> instructions = mBlock.vec();
+      if (renameAll(instructions, {{from, *to}}) &&
+          DependencyRewriter(mTarget, mII, mRI, instructions)
+              .hasCarriedFamily())
+        return llvm_ml::DependencyVariant{std::move(instructions), 1};
+    }
+
+    return llvm::createStringError(
+        std::errc::invalid_argument,
+        "No register can carry a dependency between copies of the block");
+  }
+
+  llvm::Expected<llvm_ml::DependencyVariant> createThroughputVariant() {
+    llvm::SmallVector<unsigned> carriedGPRs, carriedVectors;
+    for (const auto &[root, family] : mFamilies) {
+      if (!family.isCarried())
+        continue;
+      // A single chain left, e.g. through flags, would serialize the copies
+      // anyway.
+      if (!family.isRenamable)
+        return llvm::createStringError(
+            std::errc::invalid_argument,
+            "Dependencies between copies of the block are not in registers, "
+            "that can be renamed");
+      (family.isVector ? carriedVectors : carriedGPRs).push_back(root);
+    }
+
+    if (carriedGPRs.empty() && carriedVectors.empty())
+      return llvm_ml::DependencyVariant{mBlock.vec(), 1};
+
+    const llvm::SmallVector<unsigned> freeGPRs = getFreeRegisters(false);
+    const llvm::SmallVector<unsigned> freeVectors = getFreeRegisters(true);
+
+    unsigned numCopies = kMaxDependencyCopies;
+    if (!carriedGPRs.empty())
+      numCopies = std::min<unsigned>(
+          numCopies, 1 + freeGPRs.size() / carriedGPRs.size());
+    if (!carriedVectors.empty())
+      numCopies = std::min<unsigned>(
+          numCopies, 1 + freeVectors.size() / carriedVectors.size());
+
+    if (numCopies < 2)
+      return llvm::createStringError(
+          std::errc::invalid_argument,
+          "Not enough free registers to break dependencies of the block");
+
+    // Every copy but the first takes free registers of its own, so that a
+    // copy only waits for the one numCopies copies before it.
+    std::vector<llvm::MCInst> instructions;
+    for (unsigned copy = 0; copy < numCopies; copy++) {
+      std::map<unsigned, unsigned> renames;
+      if (copy != 0) {
+        for (auto gpr : llvm::enumerate(carriedGPRs))
+          renames[gpr.value()] =
+              freeGPRs[(copy - 1) * carriedGPRs.size() + gpr.index()];
+        for (auto vector : llvm::enumerate(carriedVectors))
+          renames[vector.value()] =
+              freeVectors[(copy - 1) * carriedVectors.size() + vector.index()];
+      }
+
+      std::vector<llvm::MCInst> body = mBlock.vec();
+      if (!renameAll(body, renames))
+        return llvm::createStringError(std::errc::invalid_argument,
+                                       "Failed to rename registers");
+      llvm::append_range(instructions, body);
+    }
+
+    return llvm_ml::DependencyVariant{std::move(instructions), numCopies};
+  }
+
+private:
+  /// Accesses of a register family in the block, positions of instructions
+  /// or -1.
+  struct Family {
+    int firstRead = -1;
+    int firstWrite = -1;
+    int lastWrite = -1;
+    bool isVector = false;
+    /// Not accessed implicitly or through a high byte register.
+    bool isRenamable = true;
+    /// Used as a base or index register of a memory operand.
+    bool isAddress = false;
+
+    /// Read before it is written, so that a copy reads the value written by
+    /// the previous one. An instruction reads its operands before it writes.
+    bool isCarried() const {
+      return firstRead >= 0 && firstWrite >= 0 && firstRead <= firstWrite;
+    }
+  };
+
+  bool hasCarriedFamily() const {
+    return llvm::any_of(mFamilies, [](const auto &family) {
+      return family.second.isCarried();
+    });
+  }
+
+  unsigned getRoot(unsigned reg) const {
+    unsigned root = reg;
+    for (llvm::MCSuperRegIterator super(reg, &mRI); super.isValid(); ++super) {
+      if (!llvm::MCSuperRegIterator(*super, &mRI).isValid())
+        root = *super;
+    }
+    return root;
+  }
+
+  static bool isRenamableGPR(unsigned root) {
+    return getGPR64(root) == root && root != llvm::X86::RSP &&
+           root != llvm::X86::RBP;
+  }
+
+  /// Only the registers legacy and VEX encodings can address.
+  static bool isRenamableVector(unsigned root) {
+    return root >= llvm::X86::ZMM0 && root <= llvm::X86::ZMM15;
+  }
+
+  void analyze() {
+    using namespace llvm::X86;
+
+    for (auto inst : llvm::enumerate(mBlock)) {
+      const int pos = inst.index();
+      const llvm::MCInstrDesc &desc = mII.get(inst.value().getOpcode());
+
+      // getReadRegisters takes explicit defs for reads, unless they are also
+      // used, as the tied operands of two-address instructions are.
+      std::set<unsigned> reads = mTarget.getReadRegisters(inst.value());
+      std::set<unsigned> writes = mTarget.getWriteRegisters(inst.value());
+      for (unsigned opIdx = 0; opIdx < desc.getNumDefs(); opIdx++) {
+        const llvm::MCOperand &operand = inst.value().getOperand(opIdx);
+        if (!operand.isReg() || operand.getReg() == 0)
+          continue;
+        writes.insert(operand.getReg());
+        const bool isUsed = llvm::any_of(
+            llvm::drop_begin(inst.value(), desc.getNumDefs()),
+            [&](const llvm::MCOperand &other) {
+              return other.isReg() && other.getReg() == operand.getReg();
+            });
+        if (!isUsed && !llvm::is_contained(desc.implicit_uses(),
+                                           operand.getReg()))
+          reads.erase(operand.getReg());
+      }
+
+      reads.erase(0);
+      writes.erase(0);
+      for (unsigned reg : reads) {
+        Family &family = getFamily(reg);
+        if (family.firstRead < 0)
+          family.firstRead = pos;
+      }
+      for (unsigned reg : writes) {
+        Family &family = getFamily(reg);
+        if (family.firstWrite < 0)
+          family.firstWrite = pos;
+        family.lastWrite = pos;
+      }
+
+      for (unsigned reg : desc.implicit_uses())
+        getFamily(reg).isRenamable = false;
+      for (unsigned reg : desc.implicit_defs())
+        getFamily(reg).isRenamable = false;
+      // High byte registers have no counterparts in other families.
+      static const unsigned highBytes[] = {AH, BH, CH, DH};
+      for (const llvm::MCOperand &operand : inst.value()) {
+        if (operand.isReg() && llvm::is_contained(highBytes, operand.getReg()))
+          getFamily(operand.getReg()).isRenamable = false;
+      }
+
+      int memOpIdx = llvm::X86II::getMemoryOperandNo(desc.TSFlags);
+      if (memOpIdx >= 0) {
+        memOpIdx += llvm::X86II::getOperandBias(desc);
+        for (int regIdx : {AddrBaseReg, AddrIndexReg}) {
+          const llvm::MCOperand &operand =
+              inst.value().getOperand(memOpIdx + regIdx);
+          if (operand.isReg() && operand.getReg() != 0)
+            getFamily(operand.getReg()).isAddress = true;
+        }
+      }
+    }
+  }
+
+  Family &getFamily(unsigned reg) {
+    const unsigned root = getRoot(reg);
+    auto [it, isNew] = mFamilies.try_emplace(root);
+    if (isNew) {
+      it->second.isVector = isRenamableVector(root);
+      it->second.isRenamable = it->second.isVector || isRenamableGPR(root);
+    }
+    return it->second;
+  }
+
+  /// Returns families, that are read, ordered by the first read.
+  std::vector<std::pair<unsigned, const Family *>>
+  getFamiliesByFirstRead() const {
+    std::vector<std::pair<unsigned, const Family *>> families;
+    for (const auto &[root, family] : mFamilies) {
+      if (family.firstRead >= 0)
+        families.emplace_back(root, &family);
+    }
+    llvm::stable_sort(families, [](const auto &lhs, const auto &rhs) {
+      return lhs.second->firstRead < rhs.second->firstRead;
+    });
+    return families;
+  }
+
+  /// Returns registers the block does not access at all.
+  llvm::SmallVector<unsigned> getFreeRegisters(bool isVector) const {
+    using namespace llvm::X86;
+    static const unsigned gprs[] = {RAX, RBX, RCX, RDX, RSI, RDI, R8,
+                                    R9,  R10, R11, R12, R13, R14, R15};
+
+    llvm::SmallVector<unsigned> candidates;
+    if (isVector) {
+      for (unsigned i = 0; i < 16; i++)
+        candidates.push_back(ZMM0 + i);
+    } else {
+      candidates.append(std::begin(gprs), std::end(gprs));
+    }
+
+    llvm::SmallVector<unsigned> registers;
+    for (unsigned reg : candidates) {
+      if (!mFamilies.count(reg))
+        registers.push_back(reg);
+    }
+    return registers;
+  }
+
+  /// Renames every register of the families in \p renames in
+  /// \p instructions. Returns false if a sub-register has no counterpart.
+  bool renameAll(llvm::MutableArrayRef<llvm::MCInst> instructions,
+                 const std::map<unsigned, unsigned> &renames) const {
+    for (llvm::MCInst &inst : instructions) {
+      for (llvm::MCOperand &operand : inst) {
+        if (!operand.isReg() || operand.getReg() == 0)
+          continue;
+
+        const unsigned reg = operand.getReg();
+        auto rename = renames.find(getRoot(reg));
+        if (rename == renames.end())
+          continue;
+
+        const auto [from, to] = *rename;
+        const unsigned subRegIdx =
+            reg == from ? 0 : mRI.getSubRegIndex(from, reg);
+        const unsigned newReg =
+            subRegIdx == 0 ? to : mRI.getSubReg(to, subRegIdx).id();
+        if (newReg == 0)
+          return false;
+        operand.setReg(newReg);
+      }
+    }
+    return true;
+  }
+
+  llvm_ml::MLTarget &mTarget;
+  const llvm::MCInstrInfo &mII;
+  const llvm::MCRegisterInfo &mRI;
+  llvm::ArrayRef<llvm::MCInst> mBlock;
+  std::map<unsigned, Family> mFamilies;
 };
 
 class X86Target : public llvm_ml::MLTarget {
@@ -365,10 +977,98 @@ public:
            opcode == llvm::X86::F2XM1 || opcode == llvm::X86::CPUID;
   }
 
+  std::vector<uint64_t>
+  predictDataAddresses(llvm::ArrayRef<llvm::MCInst> block) override {
+    // The block is repeated, a register written anywhere in it may hold any
+    // value by the time it is used.
+    std::set<unsigned> clobbered;
+    for (const auto &inst : block) {
+      const llvm::MCInstrDesc &desc = mII->get(inst.getOpcode());
+      for (unsigned opIdx = 0; opIdx < desc.getNumDefs(); opIdx++) {
+        if (inst.getOperand(opIdx).isReg())
+          clobbered.insert(getGPR64(inst.getOperand(opIdx).getReg()));
+      }
+      for (auto reg : desc.implicit_defs())
+        clobbered.insert(getGPR64(reg));
+    }
+
+    const auto getRegValue = [&](unsigned reg) -> std::optional<uint64_t> {
+      if (reg == 0)
+        return 0;
+      // The stack is mapped anyway, rip-relative operands point to code.
+      const unsigned gpr = getGPR64(reg);
+      if (gpr == 0 || gpr == llvm::X86::RSP || gpr == llvm::X86::RBP ||
+          clobbered.count(gpr))
+        return std::nullopt;
+      return kRegisterInitValue;
+    };
+
+    std::set<uint64_t> addresses;
+    for (const auto &inst : block) {
+      const llvm::MCInstrDesc &desc = mII->get(inst.getOpcode());
+      // Neither LEA nor NOP access their memory operand.
+      if (!desc.mayLoad() && !desc.mayStore())
+        continue;
+
+      int memOpIdx = llvm::X86II::getMemoryOperandNo(desc.TSFlags);
+      if (memOpIdx < 0)
+        continue;
+      memOpIdx += llvm::X86II::getOperandBias(desc);
+
+      const llvm::MCOperand &scale =
+          inst.getOperand(memOpIdx + llvm::X86::AddrScaleAmt);
+      const llvm::MCOperand &disp =
+          inst.getOperand(memOpIdx + llvm::X86::AddrDisp);
+      const llvm::MCOperand &segment =
+          inst.getOperand(memOpIdx + llvm::X86::AddrSegmentReg);
+      if (!scale.isImm() || !disp.isImm() || segment.getReg() != 0)
+        continue;
+
+      auto base = getRegValue(
+          inst.getOperand(memOpIdx + llvm::X86::AddrBaseReg).getReg());
+      auto index = getRegValue(
+          inst.getOperand(memOpIdx + llvm::X86::AddrIndexReg).getReg());
+      if (!base || !index)
+        continue;
+
+      addresses.insert(*base + *index * scale.getImm() + disp.getImm());
+    }
+
+    return std::vector<uint64_t>(addresses.begin(), addresses.end());
+  }
+
+  llvm::Expected<llvm_ml::DependencyVariant>
+  createDependencyVariant(llvm::ArrayRef<llvm::MCInst> block,
+                          llvm_ml::DependencyMode mode,
+                          const llvm::MCRegisterInfo &mcri) override {
+    DependencyRewriter rewriter(*this, *mII, mcri, block);
+    if (mode == llvm_ml::DependencyMode::Latency)
+      return rewriter.createLatencyVariant();
+    return rewriter.createThroughputVariant();
+  }
+
   std::unique_ptr<llvm_ml::InlineAsmBuilder> createInlineAsmBuilder() override {
     return std::make_unique<X86InlineAsmBuilder>();
   }
 
+  llvm::Expected<std::unique_ptr<llvm_ml::HarnessEncoder>>
+  createHarnessEncoder(const llvm::Target *target, llvm::MCContext &context,
+                       const llvm::MCSubtargetInfo &msti,
+                       const llvm::MCTargetOptions &options) override {
+    std::unique_ptr<llvm::MCCodeEmitter> emitter(
+        target->createMCCodeEmitter(*mII, context));
+    if (!emitter)
+      return llvm::createStringError(std::errc::not_supported,
+                                     "Failed to create code emitter");
+
+    auto encoder = std::make_unique<X86HarnessEncoder>(
+        std::move(emitter), target, context, *mII, msti, options);
+    if (auto err = encoder->init())
+      return std::move(err);
+
+    return encoder;
+  }
+
 private:
   llvm::MCInstrInfo *mII;
 };
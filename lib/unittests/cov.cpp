@@ -7,6 +7,7 @@
 
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
+#include <cmath>
 #include <vector>
 #include <iostream>
 
@@ -34,3 +35,59 @@ TEST_CASE("Coefficient of variation", "[statistics/cov.hpp]") {
 
   REQUIRE_THAT(cov, Catch::Matchers::WithinAbs(0.4714, 0.01));
 }
+
+TEST_CASE("Running statistics match batch ones", "[statistics/cov.hpp]") {
+  std::vector<double> values = {102.0, 98.0, 101.0, 99.5, 100.5, 250.0};
+
+  llvm_ml::stat::running_statistics stats;
+  for (double value : values)
+    stats.push(value);
+
+  double mean = llvm_ml::stat::mean(values);
+
+  REQUIRE(stats.count() == values.size());
+  REQUIRE_THAT(stats.mean(), Catch::Matchers::WithinAbs(mean, 1e-9));
+  REQUIRE_THAT(stats.standard_deviation(),
+               Catch::Matchers::WithinAbs(
+                   llvm_ml::stat::standard_deviation(values, mean), 1e-9));
+  REQUIRE_THAT(stats.coefficient_of_variation(),
+               Catch::Matchers::WithinAbs(
+                   llvm_ml::stat::coefficient_of_variation(values), 1e-9));
+}
+
+TEST_CASE("Running statistics of constant values", "[statistics/cov.hpp]") {
+  llvm_ml::stat::running_statistics stats;
+
+  REQUIRE(std::isnan(stats.mean()));
+
+  for (int i = 0; i < 10; i++)
+    stats.push(42.0);
+
+  REQUIRE_THAT(stats.mean(), Catch::Matchers::WithinAbs(42.0, 1e-9));
+  REQUIRE_THAT(stats.coefficient_of_variation(),
+               Catch::Matchers::WithinAbs(0.0, 1e-9));
+}
+
+TEST_CASE("Standard error of running statistics", "[statistics/cov.hpp]") {
+  llvm_ml::stat::running_statistics stats;
+  stats.push(1.0);
+
+  REQUIRE(std::isnan(stats.standard_error()));
+
+  for (double value : {2.0, 3.0, 4.0, 5.0})
+    stats.push(value);
+
+  // Sample variance of 1..5 is 2.5.
+  REQUIRE_THAT(stats.standard_error(),
+               Catch::Matchers::WithinAbs(std::sqrt(2.5 / 5), 1e-9));
+}
+
+TEST_CASE("Student t critical values", "[statistics/cov.hpp]") {
+  REQUIRE(std::isinf(llvm_ml::stat::student_t_critical_95(0)));
+  REQUIRE_THAT(llvm_ml::stat::student_t_critical_95(9),
+               Catch::Matchers::WithinAbs(2.262, 1e-3));
+  REQUIRE_THAT(llvm_ml::stat::student_t_critical_95(31),
+               Catch::Matchers::WithinAbs(2.040, 1e-3));
+  REQUIRE_THAT(llvm_ml::stat::student_t_critical_95(1000000),
+               Catch::Matchers::WithinAbs(1.960, 1e-3));
+}
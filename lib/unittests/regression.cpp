@@ -0,0 +1,56 @@
+//===--- regression.cpp - Robust regression tests -------------------------===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#include "llvm-ml/statistics/regression.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+#include <cmath>
+#include <vector>
+
+TEST_CASE("Theil-Sen fits a line exactly", "[statistics/regression.hpp]") {
+  std::vector<double> xs = {10, 20, 40, 80, 120};
+  std::vector<double> ys;
+  for (double x : xs)
+    ys.push_back(2.5 * x + 100.0);
+
+  auto fit = llvm_ml::stat::theil_sen(xs, ys);
+
+  REQUIRE_THAT(fit.slope, Catch::Matchers::WithinAbs(2.5, 1e-9));
+  REQUIRE_THAT(fit.intercept, Catch::Matchers::WithinAbs(100.0, 1e-9));
+  REQUIRE_THAT(fit.r_squared, Catch::Matchers::WithinAbs(1.0, 1e-9));
+}
+
+TEST_CASE("Theil-Sen ignores outliers", "[statistics/regression.hpp]") {
+  std::vector<int> xs = {10, 10, 10, 60, 60, 60, 120, 120, 120};
+  std::vector<int> ys = {130, 130, 900, 280, 280, 281, 460, 460, 461};
+
+  auto fit = llvm_ml::stat::theil_sen(xs, ys);
+
+  REQUIRE_THAT(fit.slope, Catch::Matchers::WithinAbs(3.0, 0.01));
+  REQUIRE_THAT(fit.intercept, Catch::Matchers::WithinAbs(100.0, 1.0));
+  REQUIRE(fit.r_squared < 0.9);
+}
+
+TEST_CASE("Theil-Sen needs distinct x", "[statistics/regression.hpp]") {
+  std::vector<double> xs = {10, 10, 10};
+  std::vector<double> ys = {1, 2, 3};
+
+  auto fit = llvm_ml::stat::theil_sen(xs, ys);
+
+  REQUIRE(std::isnan(fit.slope));
+  REQUIRE(std::isnan(fit.intercept));
+}
+
+TEST_CASE("Theil-Sen flags nonlinear points", "[statistics/regression.hpp]") {
+  std::vector<double> xs = {1, 2, 3, 4, 5, 6, 7, 8};
+  std::vector<double> ys;
+  for (double x : xs)
+    ys.push_back(x * x * x);
+
+  auto fit = llvm_ml::stat::theil_sen(xs, ys);
+
+  REQUIRE(fit.r_squared < 0.95);
+}
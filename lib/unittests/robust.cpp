@@ -0,0 +1,78 @@
+//===--- robust.cpp - Outlier resistant statistics tests ------------------===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#include "llvm-ml/statistics/robust.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+#include <cmath>
+#include <vector>
+
+TEST_CASE("Median of odd and even counts", "[statistics/robust.hpp]") {
+  REQUIRE_THAT(llvm_ml::stat::median({5.0, 1.0, 3.0}),
+               Catch::Matchers::WithinAbs(3.0, 1e-9));
+  REQUIRE_THAT(llvm_ml::stat::median({4.0, 1.0, 3.0, 2.0}),
+               Catch::Matchers::WithinAbs(2.5, 1e-9));
+  REQUIRE(std::isnan(llvm_ml::stat::median({})));
+}
+
+TEST_CASE("Quantiles interpolate between ranks", "[statistics/robust.hpp]") {
+  std::vector<double> values = {4.0, 1.0, 3.0, 2.0, 5.0};
+
+  REQUIRE_THAT(llvm_ml::stat::quantile(values, 0.0),
+               Catch::Matchers::WithinAbs(1.0, 1e-9));
+  REQUIRE_THAT(llvm_ml::stat::quantile(values, 0.25),
+               Catch::Matchers::WithinAbs(2.0, 1e-9));
+  REQUIRE_THAT(llvm_ml::stat::quantile(values, 0.625),
+               Catch::Matchers::WithinAbs(3.5, 1e-9));
+  REQUIRE_THAT(llvm_ml::stat::quantile(values, 1.0),
+               Catch::Matchers::WithinAbs(5.0, 1e-9));
+}
+
+TEST_CASE("MAD ignores a single outlier", "[statistics/robust.hpp]") {
+  std::vector<double> values = {100, 101, 99, 100, 102, 98, 100, 5000};
+
+  double mad = llvm_ml::stat::median_absolute_deviation(values);
+
+  REQUIRE_THAT(mad, Catch::Matchers::WithinAbs(1.4826, 1e-6));
+}
+
+TEST_CASE("Trimmed mean drops the tails", "[statistics/robust.hpp]") {
+  std::vector<double> values = {1, 10, 10, 10, 10, 10, 10, 10, 10, 1000};
+
+  REQUIRE_THAT(llvm_ml::stat::trimmed_mean(values, 0.1),
+               Catch::Matchers::WithinAbs(10.0, 1e-9));
+  REQUIRE_THAT(llvm_ml::stat::trimmed_mean(values, 0.0),
+               Catch::Matchers::WithinAbs(108.1, 1e-9));
+  // Trimming everything leaves the median.
+  REQUIRE_THAT(llvm_ml::stat::trimmed_mean({1.0, 2.0, 30.0}, 0.5),
+               Catch::Matchers::WithinAbs(2.0, 1e-9));
+}
+
+TEST_CASE("Bootstrap interval covers the median", "[statistics/robust.hpp]") {
+  std::vector<double> values;
+  for (int i = 0; i < 50; i++)
+    values.push_back(100.0 + (i % 7));
+
+  const auto median = [&](const std::vector<size_t> &indices) {
+    std::vector<double> resample;
+    for (size_t index : indices)
+      resample.push_back(values[index]);
+    return llvm_ml::stat::median(std::move(resample));
+  };
+
+  auto [lower, upper] =
+      llvm_ml::stat::bootstrap_interval(values.size(), median);
+
+  REQUIRE(lower <= llvm_ml::stat::median(values));
+  REQUIRE(upper >= llvm_ml::stat::median(values));
+  REQUIRE(lower >= 100.0);
+  REQUIRE(upper <= 106.0);
+
+  // The same seed gives the same interval.
+  auto again = llvm_ml::stat::bootstrap_interval(values.size(), median);
+  REQUIRE(again.first == lower);
+  REQUIRE(again.second == upper);
+}
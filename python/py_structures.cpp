@@ -22,6 +22,10 @@ template <typename Target> struct PyBasicBlock {
   bool hasVirtualRoot;
   float measuredCycles;
   float cov; ///< Coefficient of variation
+  int numMappedPages; ///< Number of data pages the block touches
+  /// Frontend bound, bad speculation, retiring and backend bound fractions,
+  /// zeros if the block was measured without --topdown
+  std::array<float, 4> topdown;
   std::string source;
   std::string id;
   nb::ndarray<Target, int> nodes;
@@ -47,6 +51,10 @@ std::vector<PyBasicBlock<Target>> loadDataset(const std::string &path,
       bb.source = graph.getSource();
       bb.id = piece.getId();
       bb.cov = piece.getCov();
+      bb.numMappedPages = metrics.getMappedAddresses().size();
+      llvm_ml::MCTopdown::Reader topdown = metrics.getTopdown();
+      bb.topdown = {topdown.getFrontendBound(), topdown.getBadSpeculation(),
+                    topdown.getRetiring(), topdown.getBackendBound()};
       bb.hasVirtualRoot = graph.getHasVirtualRoot();
 
       struct Container {
@@ -141,6 +149,8 @@ NB_MODULE(_llvm_ml_impl, m) {
       .def_rw("has_virtual_root", &PyBasicBlock<nb::pytorch>::hasVirtualRoot)
       .def_rw("id", &PyBasicBlock<nb::pytorch>::id)
       .def_rw("cov", &PyBasicBlock<nb::pytorch>::cov)
+      .def_rw("num_mapped_pages", &PyBasicBlock<nb::pytorch>::numMappedPages)
+      .def_rw("topdown", &PyBasicBlock<nb::pytorch>::topdown)
       .def_rw("source", &PyBasicBlock<nb::pytorch>::source);
 
   nb::class_<PyBasicBlock<nb::numpy>>(m, "NumpyBasicBlock")
@@ -152,6 +162,8 @@ NB_MODULE(_llvm_ml_impl, m) {
       .def_rw("has_virtual_root", &PyBasicBlock<nb::numpy>::hasVirtualRoot)
       .def_rw("id", &PyBasicBlock<nb::numpy>::id)
       .def_rw("cov", &PyBasicBlock<nb::numpy>::cov)
+      .def_rw("num_mapped_pages", &PyBasicBlock<nb::numpy>::numMappedPages)
+      .def_rw("topdown", &PyBasicBlock<nb::numpy>::topdown)
       .def_rw("source", &PyBasicBlock<nb::numpy>::source);
 
   m.def("load_pytorch_dataset", &loadDataset<nb::pytorch>, "path"_a,
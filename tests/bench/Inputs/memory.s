@@ -0,0 +1,2 @@
+movq 8(%rbx), %rax
+movq %rcx, 0x1000(%rsi,%rdx,2)
@@ -0,0 +1 @@
+movq %rax, %rbx
@@ -5,3 +5,11 @@
 # RUN: ls -1 %t.out | wc -l | FileCheck %s
 
 # CHECK: 2
+
+# RUN: mkdir -p %t.hk.out
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 --housekeeping-cpus=1 %S/Inputs/x64 --num-repeat 20 -o %t.hk.out
+# RUN: ls -1 %t.hk.out | wc -l | FileCheck %s
+
+# RUN: mkdir -p %t.sentinel.out
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64 --num-repeat 20 --sentinels=%S/Inputs/x64/01.s --sentinel-interval=1 -o %t.sentinel.out
+# RUN: ls -1 %t.sentinel.out | wc -l | FileCheck %s
@@ -0,0 +1,12 @@
+; RUN: %mc-harness-dump --triple x86_64-unknown-unknown %s --unroll-factor 4 | FileCheck %s
+
+imulq    $1374389535, %rax, %rax
+
+; CHECK: @baseline = alias void (ptr, ptr, ptr, ptr), ptr @workload
+; CHECK-LABEL: @workload
+; CHECK: udiv i64 %{{.*}}, 4
+; CHECK: store volatile i64 %{{.*}}, ptr inttoptr (i64 36851744 to ptr)
+; CHECK: call void asm alignstack "workload_start_workload:", ""()
+; CHECK-COUNT-4: call void asm sideeffect "imulq    $$1374389535, %rax, %rax", "~{dirflag},~{fpsr},~{flags}"()
+; CHECK-NEXT: call void asm alignstack "decq 0x2325020\0A\09jnz workload_start_workload", "~{dirflag},~{fpsr},~{flags}"()
+; CHECK: call void asm alignstack "workload_end_workload:", ""()
@@ -3,6 +3,189 @@
 # REQUIRES: x86_64
 # RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 -o %t.cbuf
 # RUN: ls %t.cbuf
+# RUN: echo garbage > %t.stale.cbuf
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/memory.s --num-repeat 20 -o %t.stale.cbuf
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 -o %t.stale.cbuf
+# RUN: ls %t.stale.cbuf
 # RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 -o %t.json --readable-json
 # RUN: ls %t.json
+# RUN: FileCheck %s < %t.json
 
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --jit -o %t.jit.cbuf
+# RUN: ls %t.jit.cbuf
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --target-precision=1 --max-cov=10 -o %t.adaptive.cbuf
+# RUN: ls %t.adaptive.cbuf
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --counters=pmu -o %t.pmu.cbuf
+# RUN: ls %t.pmu.cbuf
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --events=branch_misses,r00c0 --event-slots=1 -o %t.events.json --readable-json
+# RUN: FileCheck %s --check-prefix=EVENTS < %t.events.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --events=branch_misses,r00c0 --event-slots=1 --workers -o %t.events.workers.json --readable-json
+# RUN: FileCheck %s --check-prefix=EVENTS < %t.events.workers.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --topdown -o %t.topdown.json --readable-json
+# RUN: FileCheck %s --check-prefix=TOPDOWN < %t.topdown.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --port-pressure -o %t.ports.json --readable-json
+# RUN: FileCheck %s --check-prefix=PORTS < %t.ports.json
+# RUN: not env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --events=no_such_event -o %t.bad.json 2>&1 | FileCheck %s --check-prefix=BAD-EVENT
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --workers -o %t.workers.cbuf
+# RUN: ls %t.workers.cbuf
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --interleave=alternate -o %t.interleave.cbuf
+# RUN: ls %t.interleave.cbuf
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --interleave=random --workers -o %t.interleave.workers.json --readable-json
+# RUN: FileCheck %s < %t.interleave.workers.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --regression-points=4 -o %t.regression.json --readable-json
+# RUN: FileCheck %s --check-prefix=REGRESSION < %t.regression.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --outliers=mad --max-instruction-deviation=5 --estimator=median -o %t.robust.json --readable-json
+# RUN: FileCheck %s --check-prefix=ROBUST < %t.robust.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --outliers=iqr --estimator=trimmed-mean --interleave=alternate -o %t.robust.paired.json --readable-json
+# RUN: FileCheck %s --check-prefix=ROBUST < %t.robust.paired.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --max-frequency-drift=5 -o %t.frequency.json --readable-json
+# RUN: FileCheck %s --check-prefix=FREQUENCY < %t.frequency.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/02.s --num-repeat 20 --mode=both -o %t.mode.json --readable-json
+# RUN: FileCheck %s --check-prefix=MODE < %t.mode.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/move.s --num-repeat 20 --mode=latency -o %t.rename.json --readable-json
+# RUN: FileCheck %s --check-prefix=RENAME < %t.rename.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/memory.s --num-repeat 20 --cache-state=dram --page-placement=distinct -o %t.cold.json --readable-json
+# RUN: FileCheck %s --check-prefix=COLD < %t.cold.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/memory.s --num-repeat 20 --cache-state=l2 --page-placement=distinct --workers -o %t.cold.workers.json --readable-json
+# RUN: FileCheck %s --check-prefix=COLD-L2 < %t.cold.workers.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --code-alignments=0,16,32,48 -o %t.align.json --readable-json
+# RUN: FileCheck %s --check-prefix=ALIGN < %t.align.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --unroll-factor 4 --mc-encode --code-alignments=0,16,32,48 -o %t.align.mc.json --readable-json
+# RUN: FileCheck %s --check-prefix=ALIGN < %t.align.mc.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --frontend=uop-cache --code-budget=140 -o %t.dsb.json --readable-json
+# RUN: FileCheck %s --check-prefix=UOP-CACHE < %t.dsb.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --frontend=decoders --code-budget=140 -o %t.mite.json --readable-json
+# RUN: FileCheck %s --check-prefix=DECODERS < %t.mite.json
+# RUN: not env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --frontend=uop-cache --code-budget=70 -o %t.bad.budget.json 2>&1 | FileCheck %s --check-prefix=BAD-BUDGET
+# RUN: not env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --code-alignments=64 -o %t.bad.align.json 2>&1 | FileCheck %s --check-prefix=BAD-ALIGN
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --co-runner=@alu --co-runner-cpu=1 -o %t.smt.json --readable-json
+# RUN: FileCheck %s --check-prefix=CO-RUNNER < %t.smt.json
+# RUN: not env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --co-runner=@alu --co-runner-cpu=0 -o %t.same.smt.json 2>&1 | FileCheck %s --check-prefix=SAME-CO-RUNNER
+# RUN: not env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --co-runner=@alu --co-runner-cpu=1 --workers -o %t.bad.smt.json 2>&1 | FileCheck %s --check-prefix=BAD-CO-RUNNER
+# RUN: rm -f %t.calibration.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --calibrate --calibration-cache=%t.calibration.json -o %t.calibrated.json --readable-json
+# RUN: FileCheck %s < %t.calibrated.json
+# RUN: FileCheck %s --check-prefix=CALIBRATION < %t.calibration.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --unroll-factor 4 -o %t.loop.cbuf
+# RUN: ls %t.loop.cbuf
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --unroll-factor 4 --num-repeat-noise 0 --num-repeat 20 -o %t.loop.noise.json --readable-json
+# RUN: FileCheck %s --check-prefix=LOOP-NOISE < %t.loop.noise.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --num-repeat 20 --mc-encode -o %t.mc.cbuf
+# RUN: ls %t.mc.cbuf
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/x64/01.s --unroll-factor 4 --mc-encode --workers -o %t.mc.loop.cbuf
+# RUN: ls %t.mc.loop.cbuf
+
+# CHECK: "cache_state": "l1"
+# CHECK: "code_size": 7
+# CHECK: "frontend_regime": "uop_cache"
+# CHECK: "mapped_addresses":
+# CHECK: "noise_stop_reason":
+# CHECK: "page_placement": "shared"
+# CHECK: "workload_stop_reason":
+
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/memory.s --num-repeat 20 -o %t.mem.json --readable-json
+# RUN: FileCheck %s --check-prefix=MEM < %t.mem.json
+# RUN: env LLVM_ML_BENCH_MOCK=1 %llvm-mc-bench -c 0 %S/Inputs/memory.s --num-repeat 20 --predict-pages=false -o %t.mem.fault.json --readable-json
+# RUN: FileCheck %s --check-prefix=MEM < %t.mem.fault.json
+
+# MEM: "mapped_addresses": [
+# MEM-NEXT: {{[0-9]+}}
+
+# EVENTS: "events": {
+# EVENTS-NEXT: "branch_misses": 5,
+# EVENTS-NEXT: "r00c0": 5
+
+# BAD-EVENT: Unknown event no_such_event
+
+# PORTS: "port_pressure": {
+# PORTS-NEXT: "port_0": 0.0,
+# PORTS-NEXT: "port_1": 0.0,
+# PORTS-NEXT: "port_2_3_10": 0.0,
+# PORTS-NEXT: "port_4_9": 0.0,
+# PORTS-NEXT: "port_5_11": 0.0,
+# PORTS-NEXT: "port_6": 0.0,
+# PORTS-NEXT: "port_7_8": 0.0
+
+# TOPDOWN: "topdown": {
+# TOPDOWN-NEXT: "backend_bound": 0.3,
+# TOPDOWN-NEXT: "bad_speculation": 0.1,
+# TOPDOWN: "frontend_bound": 0.2,
+# TOPDOWN: "level": 2,
+# TOPDOWN: "memory_bound": 0.2,
+# TOPDOWN: "retiring": 0.4
+
+# REGRESSION: "regression": {
+# REGRESSION-NEXT: "intercept":
+# REGRESSION-NEXT: "num_repeats": [
+# REGRESSION-NEXT: 10,
+# REGRESSION-NEXT: 13,
+# REGRESSION-NEXT: 16,
+# REGRESSION-NEXT: 20
+# REGRESSION-NEXT: ],
+# REGRESSION-NEXT: "r_squared":
+# REGRESSION-NEXT: "slope":
+
+# ROBUST: "measured_cycles_interval": {
+# ROBUST-NEXT: "confidence": 0.95
+# ROBUST-NEXT: "lower":
+# ROBUST-NEXT: "upper":
+
+# FREQUENCY: "frequency_ratio": 2.0
+# FREQUENCY: "ref_cycles": 5
+
+# MODE: "latency": {
+# MODE-NEXT: "cycles_per_iteration": 0.0,
+# MODE-NEXT: "num_copies": 1,
+# MODE-NEXT: "source": "\taddq\t%rax, %rbx\n"
+# MODE: "throughput": {
+# MODE-NEXT: "cycles_per_iteration": 0.0,
+# MODE-NEXT: "num_copies": 8,
+
+# RENAME: "latency": {
+# RENAME-NEXT: "cycles_per_iteration": 0.0,
+# RENAME-NEXT: "num_copies": 1,
+# RENAME-NEXT: "source": "\tmovq\t%rbx, %rbx\n"
+
+# COLD: "cache_state": "dram"
+# COLD: "page_placement": "distinct"
+
+# COLD-L2: "cache_state": "l2"
+# COLD-L2: "page_placement": "distinct"
+
+# ALIGN: "alignment_spread": 0.0,
+# ALIGN-NEXT: "alignments": [
+# ALIGN-NEXT: {
+# ALIGN-NEXT: "cycles_per_iteration": 0.0,
+# ALIGN-NEXT: "offset": 0
+# ALIGN: "offset": 16
+# ALIGN: "offset": 32
+# ALIGN: "offset": 48
+
+# BAD-ALIGN: --code-alignments must be less than 64
+
+# UOP-CACHE: "code_size": 7
+# UOP-CACHE: "frontend_regime": "uop_cache"
+
+# DECODERS: "code_size": 7
+# DECODERS: "frontend_regime": "decoders"
+
+# BAD-BUDGET: 11 copies of the block of 7 bytes exceed --code-budget
+
+# CO-RUNNER: "co_runner": {
+# CO-RUNNER-NEXT: "cpu": 1,
+# CO-RUNNER-NEXT: "cycles_per_iteration":
+# CO-RUNNER-NEXT: "num_samples":
+# CO-RUNNER-NEXT: "source": "addq %rax, %rax\n
+
+# SAME-CO-RUNNER: CPU #0 runs the co-runner of CPU #0, it can not be a measurement or a housekeeping core
+
+# BAD-CO-RUNNER: --co-runner does not support --workers
+
+# LOOP-NOISE: "measured_num_runs": 16,
+# LOOP-NOISE: "noise_num_runs": 4,
+# LOOP-NOISE: "workload_num_runs": 20
+
+# CALIBRATION: "entries": {
+# CALIBRATION: "0": {
+# CALIBRATION: "cycles":
+# CALIBRATION: "timestamp":
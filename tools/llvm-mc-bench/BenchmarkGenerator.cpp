@@ -10,14 +10,55 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Module.h"
+#include "llvm/MC/MCInst.h"
 
 using namespace llvm;
 using namespace llvm_ml;
 
+static void createBlockBody(ArrayRef<StringRef> assembly, int numRepeat,
+                            IRBuilderBase &builder) {
+  auto voidFuncTy = llvm::FunctionType::get(builder.getVoidTy(), false);
+
+  for (int i = 0; i < numRepeat; i++) {
+    for (auto line : assembly) {
+      llvm::StringRef trimmed = line.trim();
+      if (trimmed.empty())
+        continue;
+      if (trimmed.startswith(";"))
+        continue;
+      auto asmCallee = llvm::InlineAsm::get(
+          voidFuncTy, trimmed, "~{dirflag},~{fpsr},~{flags}", true);
+      builder.CreateCall(asmCallee);
+    }
+  }
+}
+
+/// Emits the loop trip count, HarnessArgs::numRepeat / unrollFactor, but at
+/// least one iteration.
+static Value *createTripCount(Function *func, int unrollFactor,
+                              IRBuilderBase &builder) {
+  auto *i64Ty = builder.getInt64Ty();
+  auto *argsTy = StructType::get(i64Ty);
+
+  auto *numRepeatPtr =
+      builder.CreateStructGEP(argsTy, func->getArg(kArgHarnessArgs), 0);
+  auto *numRepeat = builder.CreateLoad(i64Ty, numRepeatPtr);
+  auto *tripCount =
+      builder.CreateUDiv(numRepeat, builder.getInt64(unrollFactor));
+  auto *isZero = builder.CreateICmpEQ(tripCount, builder.getInt64(0));
+  return builder.CreateSelect(isZero, builder.getInt64(1), tripCount);
+}
+
+/// Creates a harness function. If \p unrollFactor is 0, the block is
+/// repeated \p numRepeat times in straight-line code. Otherwise it is
+/// repeated \p unrollFactor times inside of a loop with a run time trip count.
+/// \p startOffset places the first copy of the block relative to
+/// kCodeAlignment.
 static void createSingleCPUTestFunction(StringRef functionName,
                                         ArrayRef<StringRef> assembly,
-                                        int numRepeat, Module &module,
-                                        IRBuilderBase &builder,
+                                        int numRepeat, int unrollFactor,
+                                        std::optional<unsigned> startOffset,
+                                        Module &module, IRBuilderBase &builder,
                                         InlineAsmBuilder &inlineAsm) {
   auto &context = module.getContext();
 
@@ -41,27 +82,27 @@ static void createSingleCPUTestFunction(StringRef functionName,
   std::string endName = ("workload_end_" + functionName).str();
 
   inlineAsm.createSaveState(builder);
+
+  // The block may clobber every register, the loop counter lives in memory.
+  if (unrollFactor != 0)
+    inlineAsm.createLoopCounterInit(
+        builder, createTripCount(func, unrollFactor, builder));
+
   builder.CreateCall(countersFuncTy, func->getArg(kArgCountersStart),
                      {func->getArg(kArgCountersCtx)});
 
   inlineAsm.createSetupEnv(builder);
 
   inlineAsm.createBranch(builder, startName);
+  if (startOffset)
+    inlineAsm.createCodeAlignment(builder, kCodeAlignment, *startOffset);
   inlineAsm.createLabel(builder, startName);
 
-  auto voidFuncTy = llvm::FunctionType::get(builder.getVoidTy(), false);
-
-  for (int i = 0; i < numRepeat; i++) {
-    for (auto line : assembly) {
-      llvm::StringRef trimmed = line.trim();
-      if (trimmed.empty())
-        continue;
-      if (trimmed.startswith(";"))
-        continue;
-      auto asmCallee = llvm::InlineAsm::get(
-          voidFuncTy, trimmed, "~{dirflag},~{fpsr},~{flags}", true);
-      builder.CreateCall(asmCallee);
-    }
+  if (unrollFactor == 0) {
+    createBlockBody(assembly, numRepeat, builder);
+  } else {
+    createBlockBody(assembly, unrollFactor, builder);
+    inlineAsm.createLoopLatch(builder, startName);
   }
 
   inlineAsm.createBranch(builder, endName);
@@ -75,20 +116,22 @@ static void createSingleCPUTestFunction(StringRef functionName,
   builder.CreateRetVoid();
 }
 
+static void escapeAsm(std::string &microbenchAsm) {
+  size_t pos = 0;
+
+  while (pos = microbenchAsm.find("$", pos), pos != std::string::npos) {
+    microbenchAsm.insert(pos, "$");
+    pos += 2;
+  }
+}
+
 namespace llvm_ml {
 std::unique_ptr<Module>
 createCPUTestHarness(LLVMContext &context, std::string microbenchAsm,
                      int numRepeatNoise, int numRepeat,
-                     llvm_ml::InlineAsmBuilder &inlineAsm) {
-  // Prepare asm string
-  {
-    size_t pos = 0;
-
-    while (pos = microbenchAsm.find("$", pos), pos != std::string::npos) {
-      microbenchAsm.insert(pos, "$");
-      pos += 2;
-    }
-  }
+                     llvm_ml::InlineAsmBuilder &inlineAsm,
+                     std::optional<unsigned> startOffset) {
+  escapeAsm(microbenchAsm);
 
   auto module = std::make_unique<Module>("test_harness", context);
   IRBuilder builder(context);
@@ -98,11 +141,64 @@ createCPUTestHarness(LLVMContext &context, std::string microbenchAsm,
   basicBlock.split(lines, '\n');
 
   createSingleCPUTestFunction(kBaselineNoiseName, lines, numRepeatNoise,
-                              *module, builder, inlineAsm);
+                              /*unrollFactor=*/0, startOffset, *module, builder,
+                              inlineAsm);
+
+  createSingleCPUTestFunction(kWorkloadName, lines, numRepeat,
+                              /*unrollFactor=*/0, startOffset, *module, builder,
+                              inlineAsm);
+
+  return module;
+}
 
-  createSingleCPUTestFunction(kWorkloadName, lines, numRepeat, *module, builder,
+std::unique_ptr<Module>
+createCPULoopTestHarness(LLVMContext &context, std::string microbenchAsm,
+                         int unrollFactor,
+                         llvm_ml::InlineAsmBuilder &inlineAsm,
+                         std::optional<unsigned> startOffset) {
+  assert(unrollFactor > 0 && "Loop harness needs a positive unroll factor");
+  escapeAsm(microbenchAsm);
+
+  auto module = std::make_unique<Module>("test_harness", context);
+  IRBuilder builder(context);
+
+  StringRef basicBlock = microbenchAsm;
+  SmallVector<StringRef> lines;
+  basicBlock.split(lines, '\n');
+
+  createSingleCPUTestFunction(kWorkloadName, lines, /*numRepeat=*/0,
+                              unrollFactor, startOffset, *module, builder,
                               inlineAsm);
 
+  Function *workload = module->getFunction(kWorkloadName);
+  GlobalAlias::create(kBaselineNoiseName, workload);
+
   return module;
 }
+
+llvm::Expected<EncodedHarness>
+encodeCPUTestHarness(ArrayRef<MCInst> basicBlock, int numRepeatNoise,
+                     int numRepeat, int unrollFactor,
+                     llvm_ml::HarnessEncoder &encoder,
+                     std::optional<unsigned> startOffset) {
+  EncodedHarness harness;
+
+  if (unrollFactor != 0) {
+    if (auto err = encoder.encodeFunction(kWorkloadName, basicBlock, 0,
+                                          unrollFactor, startOffset, harness))
+      return std::move(err);
+    harness.symbols[kBaselineNoiseName] = harness.symbols[kWorkloadName];
+    return harness;
+  }
+
+  if (auto err = encoder.encodeFunction(kBaselineNoiseName, basicBlock,
+                                        numRepeatNoise, 0, startOffset,
+                                        harness))
+    return std::move(err);
+  if (auto err = encoder.encodeFunction(kWorkloadName, basicBlock, numRepeat,
+                                        0, startOffset, harness))
+    return std::move(err);
+
+  return harness;
+}
 } // namespace llvm_ml
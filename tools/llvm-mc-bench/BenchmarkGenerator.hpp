@@ -3,10 +3,14 @@
 // SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
 //===----------------------------------------------------------------------===//
 
+#pragma once
+
 #include "llvm-ml/target/Target.hpp"
 
 #include "llvm/IR/Module.h"
 
+#include <cstdint>
+#include <optional>
 #include <string>
 
 namespace llvm_ml {
@@ -16,18 +20,49 @@ inline constexpr auto kWorkloadName = "workload";
 inline constexpr size_t kArgCountersCtx = 0;
 inline constexpr size_t kArgCountersStart = 1;
 inline constexpr size_t kArgCountersStop = 2;
-inline constexpr size_t kArgBranchAddr = 3;
+inline constexpr size_t kArgHarnessArgs = 3;
+
+/// Runtime arguments of a benchmark harness.
+struct HarnessArgs {
+  /// Number of basic block repetitions. Only loop harnesses read it, the
+  /// value must be a multiple of the unroll factor.
+  uint64_t numRepeat;
+};
 
 /// Signature of a benchmark harness function. The convention is as following:
 /// arg0: counters handle
 /// arg1: pointer to void counters_start(void*)
 /// arg2: pointer to void counters_stop(void*)
-/// arg3: pointer to struct __attribute__((packed)) { void *workloadBegin; void
-/// *workloadEnd; }
+/// arg3: pointer to HarnessArgs
 using BenchmarkFn = void (*)(void *, void *, void *, void *);
 
+/// Creates a harness with the basic block fully unrolled \p numRepeatNoise
+/// times in the baseline function and \p numRepeat times in the workload
+/// function. If \p startOffset is set, the first copy of the block in both
+/// functions starts this many bytes past a kCodeAlignment boundary.
 std::unique_ptr<llvm::Module>
 createCPUTestHarness(llvm::LLVMContext &context, std::string basicBlock,
                      int numRepeatNoise, int numRepeat,
-                     llvm_ml::InlineAsmBuilder &inlineAsm);
+                     llvm_ml::InlineAsmBuilder &inlineAsm,
+                     std::optional<unsigned> startOffset = std::nullopt);
+
+/// Creates a harness, that unrolls the basic block \p unrollFactor times
+/// inside of a loop. The trip count comes from HarnessArgs at run time, so
+/// the same code serves the repeat count estimation, the noise and the
+/// workload measurements. The baseline function is an alias of the workload
+/// function.
+std::unique_ptr<llvm::Module>
+createCPULoopTestHarness(llvm::LLVMContext &context, std::string basicBlock,
+                         int unrollFactor,
+                         llvm_ml::InlineAsmBuilder &inlineAsm,
+                         std::optional<unsigned> startOffset = std::nullopt);
+
+/// Encodes the baseline and workload functions straight to machine code.
+/// Follows createCPUTestHarness if \p unrollFactor is 0 and
+/// createCPULoopTestHarness otherwise.
+llvm::Expected<EncodedHarness>
+encodeCPUTestHarness(llvm::ArrayRef<llvm::MCInst> basicBlock,
+                     int numRepeatNoise, int numRepeat, int unrollFactor,
+                     llvm_ml::HarnessEncoder &encoder,
+                     std::optional<unsigned> startOffset = std::nullopt);
 } // namespace llvm_ml
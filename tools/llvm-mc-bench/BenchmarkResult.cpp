@@ -4,9 +4,11 @@
 //===----------------------------------------------------------------------===//
 
 #include "BenchmarkResult.hpp"
+#include "llvm-ml/statistics/regression.hpp"
 #include "llvm-ml/structures/structures.hpp"
 
 #include <capnp/message.h>
+#include <kj/exception.h>
 #include <nlohmann/json.hpp>
 
 #include <filesystem>
@@ -16,7 +18,9 @@ namespace fs = std::filesystem;
 
 namespace llvm_ml {
 
-static void toCapNProto(const BenchmarkResult &res, MCSample::Builder sample) {
+static void toCapNProto(const BenchmarkResult &res,
+                        llvm::ArrayRef<std::string> eventNames,
+                        MCSample::Builder sample) {
   sample.setFailed(res.hasFailed);
   sample.setCycles(res.numCycles);
   sample.setInstructions(res.numInstructions);
@@ -24,17 +28,155 @@ static void toCapNProto(const BenchmarkResult &res, MCSample::Builder sample) {
   sample.setCacheMisses(res.numCacheMisses);
   sample.setContextSwitches(res.numContextSwitches);
   sample.setNumRepeat(res.numRuns);
+  sample.setRefCycles(res.numRefCycles);
+
+  capnp::List<llvm_ml::MCEvent>::Builder events =
+      sample.initEvents(eventNames.size());
+  for (auto name : llvm::enumerate(eventNames)) {
+    events[name.index()].setName(name.value());
+    events[name.index()].setValue(res.events[name.index()]);
+  }
+}
+
+static void toCapNProto(const Topdown &topdown, MCTopdown::Builder out) {
+  out.setLevel(topdown.level);
+  out.setFrontendBound(topdown.frontendBound);
+  out.setBadSpeculation(topdown.badSpeculation);
+  out.setRetiring(topdown.retiring);
+  out.setBackendBound(topdown.backendBound);
+  out.setFetchLatency(topdown.fetchLatency);
+  out.setFetchBandwidth(topdown.fetchBandwidth);
+  out.setBranchMispredicts(topdown.branchMispredicts);
+  out.setMachineClears(topdown.machineClears);
+  out.setHeavyOperations(topdown.heavyOperations);
+  out.setLightOperations(topdown.lightOperations);
+  out.setMemoryBound(topdown.memoryBound);
+  out.setCoreBound(topdown.coreBound);
+}
+
+static MCStopReason toCapNProto(StopReason reason) {
+  switch (reason) {
+  case StopReason::MaxRuns:
+    return MCStopReason::MAX_RUNS;
+  case StopReason::Converged:
+    return MCStopReason::CONVERGED;
+  case StopReason::Unstable:
+    return MCStopReason::UNSTABLE;
+  }
+  llvm_unreachable("Unknown stop reason");
+}
+
+static MCCacheState toCapNProto(CacheState state) {
+  switch (state) {
+  case CacheState::L1:
+    return MCCacheState::L1;
+  case CacheState::L2:
+    return MCCacheState::L2;
+  case CacheState::LLC:
+    return MCCacheState::LLC;
+  case CacheState::DRAM:
+    return MCCacheState::DRAM;
+  }
+  llvm_unreachable("Unknown cache state");
+}
+
+static MCPagePlacement toCapNProto(PagePlacement placement) {
+  switch (placement) {
+  case PagePlacement::Shared:
+    return MCPagePlacement::SHARED;
+  case PagePlacement::Distinct:
+    return MCPagePlacement::DISTINCT;
+  case PagePlacement::Huge:
+    return MCPagePlacement::HUGE_PAGES;
+  }
+  llvm_unreachable("Unknown page placement");
+}
+
+static MCFrontendRegime toCapNProto(FrontendRegime regime) {
+  switch (regime) {
+  case FrontendRegime::Unknown:
+    return MCFrontendRegime::UNKNOWN;
+  case FrontendRegime::UopCache:
+    return MCFrontendRegime::UOP_CACHE;
+  case FrontendRegime::Decoders:
+    return MCFrontendRegime::DECODERS;
+  }
+  llvm_unreachable("Unknown frontend regime");
 }
 
 llvm::Error
 Measurement::exportBinary(fs::path path, llvm::StringRef source,
                           llvm::ArrayRef<BenchmarkResult> noise,
-                          llvm::ArrayRef<BenchmarkResult> workload) {
+                          llvm::ArrayRef<BenchmarkResult> workload,
+                          llvm::ArrayRef<void *> mappedAddresses) {
   capnp::MallocMessageBuilder message;
   MCMetrics::Builder metrics = message.initRoot<llvm_ml::MCMetrics>();
   metrics.setMeasuredCycles(measuredCycles);
+  metrics.setMeasuredMicroOps(measuredMicroOps);
   metrics.setNumRepeat(measuredNumRuns);
   metrics.setSource(source.str());
+  metrics.setNoiseStopReason(toCapNProto(noiseStopReason));
+  metrics.setWorkloadStopReason(toCapNProto(workloadStopReason));
+  metrics.setFrequencyRatio(frequencyRatio);
+  metrics.setCacheState(toCapNProto(memoryMode.cacheState));
+  metrics.setPagePlacement(toCapNProto(memoryMode.placement));
+  metrics.setCodeSize(codeSize);
+  metrics.setFrontendRegime(toCapNProto(frontendRegime));
+  if (topdown)
+    toCapNProto(*topdown, metrics.initTopdown());
+
+  if (regression) {
+    MCRegression::Builder out = metrics.initRegression();
+    out.setSlope(regression->slope);
+    out.setIntercept(regression->intercept);
+    out.setRSquared(regression->rSquared);
+    capnp::List<uint64_t>::Builder numRepeats =
+        out.initNumRepeats(regression->numRepeats.size());
+    for (auto numRepeat : llvm::enumerate(regression->numRepeats))
+      numRepeats.set(numRepeat.index(), numRepeat.value());
+  }
+
+  if (measuredCyclesInterval) {
+    MCInterval::Builder out = metrics.initMeasuredCyclesInterval();
+    out.setLower(measuredCyclesInterval->lower);
+    out.setUpper(measuredCyclesInterval->upper);
+    out.setConfidence(measuredCyclesInterval->confidence);
+  }
+
+  const auto setVariant = [](MCDependencyVariant::Builder out,
+                             const DependencyVariantCycles &variant) {
+    out.setCyclesPerIteration(variant.cyclesPerIteration);
+    out.setNumCopies(variant.numCopies);
+    out.setSource(variant.source);
+  };
+  if (latency)
+    setVariant(metrics.initLatency(), *latency);
+  if (throughput)
+    setVariant(metrics.initThroughput(), *throughput);
+
+  capnp::List<llvm_ml::MCCodeAlignment>::Builder alignmentsOut =
+      metrics.initAlignments(alignments.size());
+  for (auto alignment : llvm::enumerate(alignments)) {
+    alignmentsOut[alignment.index()].setOffset(alignment.value().offset);
+    alignmentsOut[alignment.index()].setCyclesPerIteration(
+        alignment.value().cyclesPerIteration);
+  }
+  metrics.setAlignmentSpread(alignmentSpread);
+
+  if (coRunner) {
+    MCCoRunner::Builder out = metrics.initCoRunner();
+    out.setCpu(coRunner->cpu);
+    out.setCyclesPerIteration(coRunner->cyclesPerIteration);
+    out.setNumSamples(coRunner->numSamples);
+    out.setSource(coRunner->source);
+  }
+
+  capnp::List<llvm_ml::MCPortUops>::Builder ports =
+      metrics.initPortPressure(portPressure.size());
+  for (auto port : llvm::enumerate(portPressure)) {
+    ports[port.index()].setPort(port.value().port);
+    ports[port.index()].setUops(port.value().uops);
+  }
 
   capnp::List<llvm_ml::MCSample>::Builder noiseSamples =
       metrics.initNoiseSamples(noise.size());
@@ -42,19 +184,76 @@ Measurement::exportBinary(fs::path path, llvm::StringRef source,
       metrics.initWorkloadSamples(workload.size());
 
   const auto converter = [&](capnp::List<llvm_ml::MCSample>::Builder &out) {
-    return
-        [&](auto result) { toCapNProto(result.value(), out[result.index()]); };
+    return [&](auto result) {
+      toCapNProto(result.value(), eventNames, out[result.index()]);
+    };
   };
 
   llvm::for_each(llvm::enumerate(noise), converter(noiseSamples));
   llvm::for_each(llvm::enumerate(workload), converter(workloadSamples));
 
+  capnp::List<uint64_t>::Builder addresses =
+      metrics.initMappedAddresses(mappedAddresses.size());
+  for (auto addr : llvm::enumerate(mappedAddresses))
+    addresses.set(addr.index(), reinterpret_cast<uint64_t>(addr.value()));
+
   llvm_ml::writeToFile(path, message);
 
   return llvm::Error::success();
 }
 
-static json toJSON(const BenchmarkResult &res) {
+static const char *toString(StopReason reason) {
+  switch (reason) {
+  case StopReason::MaxRuns:
+    return "max_runs";
+  case StopReason::Converged:
+    return "converged";
+  case StopReason::Unstable:
+    return "unstable";
+  }
+  llvm_unreachable("Unknown stop reason");
+}
+
+static const char *toString(CacheState state) {
+  switch (state) {
+  case CacheState::L1:
+    return "l1";
+  case CacheState::L2:
+    return "l2";
+  case CacheState::LLC:
+    return "llc";
+  case CacheState::DRAM:
+    return "dram";
+  }
+  llvm_unreachable("Unknown cache state");
+}
+
+static const char *toString(PagePlacement placement) {
+  switch (placement) {
+  case PagePlacement::Shared:
+    return "shared";
+  case PagePlacement::Distinct:
+    return "distinct";
+  case PagePlacement::Huge:
+    return "huge";
+  }
+  llvm_unreachable("Unknown page placement");
+}
+
+static const char *toString(FrontendRegime regime) {
+  switch (regime) {
+  case FrontendRegime::Unknown:
+    return "unknown";
+  case FrontendRegime::UopCache:
+    return "uop_cache";
+  case FrontendRegime::Decoders:
+    return "decoders";
+  }
+  llvm_unreachable("Unknown frontend regime");
+}
+
+static json toJSON(const BenchmarkResult &res,
+                   llvm::ArrayRef<std::string> eventNames) {
   json resJson;
   resJson["failed"] = res.hasFailed;
   resJson["cycles"] = res.numCycles;
@@ -63,16 +262,23 @@ static json toJSON(const BenchmarkResult &res) {
   resJson["uops"] = res.numMicroOps;
   resJson["instructions"] = res.numInstructions;
   resJson["misaligned_loads"] = res.numMisalignedLoads;
+  resJson["ref_cycles"] = res.numRefCycles;
   resJson["num_repeat"] = res.numRuns;
   resJson["wall_time_ns"] = res.wallTime;
 
+  auto events = json::object();
+  for (auto name : llvm::enumerate(eventNames))
+    events[name.value()] = res.events[name.index()];
+  resJson["events"] = events;
+
   return resJson;
 }
 
 llvm::Error Measurement::exportJSON(std::filesystem::path path,
                                     llvm::StringRef source,
                                     llvm::ArrayRef<BenchmarkResult> noise,
-                                    llvm::ArrayRef<BenchmarkResult> workload) {
+                                    llvm::ArrayRef<BenchmarkResult> workload,
+                                    llvm::ArrayRef<void *> mappedAddresses) {
   std::error_code ec;
   llvm::raw_fd_ostream os(path.c_str(), ec);
 
@@ -89,27 +295,267 @@ llvm::Error Measurement::exportJSON(std::filesystem::path path,
   res["workload_context_switches"] = workloadContextSwitches;
   res["workload_num_runs"] = workloadNumRuns;
   res["measured_cycles"] = measuredCycles;
+  res["measured_uops"] = measuredMicroOps;
   res["measured_num_runs"] = measuredNumRuns;
   res["source"] = source;
+  res["noise_stop_reason"] = toString(noiseStopReason);
+  res["workload_stop_reason"] = toString(workloadStopReason);
+  res["cache_state"] = toString(memoryMode.cacheState);
+  res["page_placement"] = toString(memoryMode.placement);
+  res["code_size"] = codeSize;
+  res["frontend_regime"] = toString(frontendRegime);
+
+  if (topdown) {
+    json topdownJson;
+    topdownJson["level"] = topdown->level;
+    topdownJson["frontend_bound"] = topdown->frontendBound;
+    topdownJson["bad_speculation"] = topdown->badSpeculation;
+    topdownJson["retiring"] = topdown->retiring;
+    topdownJson["backend_bound"] = topdown->backendBound;
+    if (topdown->level > 1) {
+      topdownJson["fetch_latency"] = topdown->fetchLatency;
+      topdownJson["fetch_bandwidth"] = topdown->fetchBandwidth;
+      topdownJson["branch_mispredicts"] = topdown->branchMispredicts;
+      topdownJson["machine_clears"] = topdown->machineClears;
+      topdownJson["heavy_operations"] = topdown->heavyOperations;
+      topdownJson["light_operations"] = topdown->lightOperations;
+      topdownJson["memory_bound"] = topdown->memoryBound;
+      topdownJson["core_bound"] = topdown->coreBound;
+    }
+    res["topdown"] = topdownJson;
+  }
+
+  if (!portPressure.empty()) {
+    auto ports = json::object();
+    for (const auto &port : portPressure)
+      ports[port.port] = port.uops;
+    res["port_pressure"] = ports;
+  }
+
+  if (regression) {
+    json regressionJson;
+    regressionJson["slope"] = regression->slope;
+    regressionJson["intercept"] = regression->intercept;
+    regressionJson["r_squared"] = regression->rSquared;
+    auto numRepeats = json::array();
+    for (uint64_t numRepeat : regression->numRepeats)
+      numRepeats.push_back(numRepeat);
+    regressionJson["num_repeats"] = numRepeats;
+    res["regression"] = regressionJson;
+  }
+
+  if (measuredCyclesInterval) {
+    json intervalJson;
+    intervalJson["lower"] = measuredCyclesInterval->lower;
+    intervalJson["upper"] = measuredCyclesInterval->upper;
+    intervalJson["confidence"] = measuredCyclesInterval->confidence;
+    res["measured_cycles_interval"] = intervalJson;
+  }
+
+  if (frequencyRatio != 0.0)
+    res["frequency_ratio"] = frequencyRatio;
+
+  const auto variantJson = [](const DependencyVariantCycles &variant) {
+    json out;
+    out["cycles_per_iteration"] = variant.cyclesPerIteration;
+    out["num_copies"] = variant.numCopies;
+    out["source"] = variant.source;
+    return out;
+  };
+  if (latency)
+    res["latency"] = variantJson(*latency);
+  if (throughput)
+    res["throughput"] = variantJson(*throughput);
+
+  if (!alignments.empty()) {
+    auto alignmentsJson = json::array();
+    for (const auto &alignment : alignments) {
+      json out;
+      out["offset"] = alignment.offset;
+      out["cycles_per_iteration"] = alignment.cyclesPerIteration;
+      alignmentsJson.push_back(out);
+    }
+    res["alignments"] = alignmentsJson;
+    res["alignment_spread"] = alignmentSpread;
+  }
+
+  if (coRunner) {
+    json coRunnerJson;
+    coRunnerJson["cpu"] = coRunner->cpu;
+    coRunnerJson["cycles_per_iteration"] = coRunner->cyclesPerIteration;
+    coRunnerJson["num_samples"] = coRunner->numSamples;
+    coRunnerJson["source"] = coRunner->source;
+    res["co_runner"] = coRunnerJson;
+  }
 
   auto noiseSamples = json::array();
   auto workloadSamples = json::array();
 
   for (auto sample : noise) {
-    noiseSamples.push_back(toJSON(sample));
+    noiseSamples.push_back(toJSON(sample, eventNames));
   }
   for (auto sample : workload) {
-    workloadSamples.push_back(toJSON(sample));
+    workloadSamples.push_back(toJSON(sample, eventNames));
   }
 
   res["noise_samples"] = noiseSamples;
   res["workload_samples"] = workloadSamples;
 
+  auto addresses = json::array();
+  for (auto addr : mappedAddresses)
+    addresses.push_back(reinterpret_cast<uint64_t>(addr));
+  res["mapped_addresses"] = addresses;
+
   os << res.dump(4);
 
   return llvm::Error::success();
 }
 
+llvm::SmallVector<void *> importMappedAddresses(fs::path path,
+                                                llvm::StringRef source) {
+  llvm::SmallVector<void *> mappedAddresses;
+  if (!fs::exists(path))
+    return mappedAddresses;
+
+  // A stale or foreign file only costs the pages it would have predicted.
+  try {
+    readFromFile<MCMetrics>(path, [&](MCMetrics::Reader &metrics) {
+      capnp::Text::Reader stored = metrics.getSource();
+      if (llvm::StringRef(stored.begin(), stored.size()) != source)
+        return;
+      for (uint64_t addr : metrics.getMappedAddresses())
+        mappedAddresses.push_back(reinterpret_cast<void *>(addr));
+    });
+  } catch (const kj::Exception &) {
+    mappedAddresses.clear();
+  }
+
+  return mappedAddresses;
+}
+
+std::optional<Topdown> computeTopdown(const BenchmarkResult &workload,
+                                      const BenchmarkResult &noise,
+                                      llvm::ArrayRef<std::string> eventNames) {
+  // Events of the harness itself cancel out in workload minus noise.
+  const auto delta = [&](llvm::StringRef name) -> std::optional<double> {
+    auto it = llvm::find(eventNames, name);
+    if (it == eventNames.end())
+      return std::nullopt;
+    const size_t index = std::distance(eventNames.begin(), it);
+    if (workload.events[index] < noise.events[index])
+      return 0.0;
+    return workload.events[index] - noise.events[index];
+  };
+  const auto clamp = [](double value) { return std::clamp(value, 0.0, 1.0); };
+
+  Topdown topdown;
+
+  auto retiring = delta("topdown_retiring");
+  auto badSpec = delta("topdown_bad_spec");
+  auto feBound = delta("topdown_fe_bound");
+  auto beBound = delta("topdown_be_bound");
+  if (retiring && badSpec && feBound && beBound) {
+    // Metric counts add up to slots, but subtracting noise breaks the exact
+    // sum, so normalize by the metrics themselves.
+    const double slots = *retiring + *badSpec + *feBound + *beBound;
+    if (slots == 0)
+      return std::nullopt;
+
+    topdown.level = 1;
+    topdown.retiring = *retiring / slots;
+    topdown.badSpeculation = *badSpec / slots;
+    topdown.frontendBound = *feBound / slots;
+    topdown.backendBound = *beBound / slots;
+
+    auto heavyOps = delta("topdown_heavy_ops");
+    auto brMispredict = delta("topdown_br_mispredict");
+    auto fetchLat = delta("topdown_fetch_lat");
+    auto memBound = delta("topdown_mem_bound");
+    if (heavyOps && brMispredict && fetchLat && memBound) {
+      topdown.level = 2;
+      topdown.heavyOperations = clamp(*heavyOps / slots);
+      topdown.lightOperations =
+          clamp(topdown.retiring - topdown.heavyOperations);
+      topdown.branchMispredicts = clamp(*brMispredict / slots);
+      topdown.machineClears =
+          clamp(topdown.badSpeculation - topdown.branchMispredicts);
+      topdown.fetchLatency = clamp(*fetchLat / slots);
+      topdown.fetchBandwidth =
+          clamp(topdown.frontendBound - topdown.fetchLatency);
+      topdown.memoryBound = clamp(*memBound / slots);
+      topdown.coreBound = clamp(topdown.backendBound - topdown.memoryBound);
+    }
+    return topdown;
+  }
+
+  auto notDelivered = delta("idq_uops_not_delivered");
+  auto issued = delta("uops_issued");
+  auto retired = delta("uops");
+  auto recoveryCycles = delta("recovery_cycles");
+  if (!notDelivered || !issued || !retired || !recoveryCycles)
+    return std::nullopt;
+
+  // Level 1 formulas for cores, that issue 4 micro-ops per cycle.
+  constexpr double width = 4;
+  if (workload.numCycles <= noise.numCycles)
+    return std::nullopt;
+  const double slots = width * (workload.numCycles - noise.numCycles);
+
+  topdown.level = 1;
+  topdown.frontendBound = clamp(*notDelivered / slots);
+  topdown.badSpeculation =
+      clamp((*issued - *retired + width * *recoveryCycles) / slots);
+  topdown.retiring = clamp(*retired / slots);
+  topdown.backendBound = clamp(1.0 - topdown.frontendBound -
+                               topdown.badSpeculation - topdown.retiring);
+
+  return topdown;
+}
+
+llvm::SmallVector<PortUops>
+computePortPressure(const BenchmarkResult &workload,
+                    const BenchmarkResult &noise,
+                    llvm::ArrayRef<std::string> eventNames) {
+  llvm::SmallVector<PortUops> ports;
+  if (workload.numRuns <= noise.numRuns)
+    return ports;
+  const double numIterations = workload.numRuns - noise.numRuns;
+
+  for (auto name : llvm::enumerate(eventNames)) {
+    if (!llvm::StringRef(name.value()).startswith("port_"))
+      continue;
+
+    const uint64_t wl = workload.events[name.index()];
+    const uint64_t ns = noise.events[name.index()];
+    ports.push_back(PortUops{.port = name.value(),
+                             .uops = wl > ns ? (wl - ns) / numIterations : 0});
+  }
+
+  return ports;
+}
+
+std::optional<Regression> fitCycles(llvm::ArrayRef<BenchmarkResult> samples) {
+  llvm::SmallVector<uint64_t> numRepeats;
+  llvm::SmallVector<uint64_t> cycles;
+  for (const BenchmarkResult &sample : samples) {
+    numRepeats.push_back(sample.numRuns);
+    cycles.push_back(sample.numCycles);
+  }
+
+  stat::linear_fit fit = stat::theil_sen(numRepeats, cycles);
+  if (std::isnan(fit.slope))
+    return std::nullopt;
+
+  llvm::sort(numRepeats);
+  numRepeats.erase(std::unique(numRepeats.begin(), numRepeats.end()),
+                   numRepeats.end());
+
+  return Regression{.slope = fit.slope,
+                    .intercept = fit.intercept,
+                    .rSquared = fit.r_squared,
+                    .numRepeats = std::move(numRepeats)};
+}
+
 BenchmarkResult avg(llvm::ArrayRef<BenchmarkResult> inputs) {
   const auto minEltPred = [](const auto &lhs, const auto &rhs) {
     return lhs.numCycles < rhs.numCycles;
@@ -136,6 +582,9 @@ BenchmarkResult avg(llvm::ArrayRef<BenchmarkResult> inputs) {
     avg.numMicroOps += res.numMicroOps;
     avg.numInstructions += res.numInstructions;
     avg.numMisalignedLoads += res.numMisalignedLoads;
+    avg.numRefCycles += res.numRefCycles;
+    for (unsigned i = 0; i < MAX_EVENTS; i++)
+      avg.events[i] += res.events[i];
   }
 
   const size_t total = results.size() - numFailed;
@@ -146,6 +595,9 @@ BenchmarkResult avg(llvm::ArrayRef<BenchmarkResult> inputs) {
   avg.numMicroOps /= total;
   avg.numInstructions /= total;
   avg.numMisalignedLoads /= total;
+  avg.numRefCycles /= total;
+  for (auto &event : avg.events)
+    event /= total;
 
   return avg;
 }
@@ -5,21 +5,140 @@
 
 #pragma once
 
+#include "counters.hpp"
+#include "llvm-ml/statistics/cov.hpp"
+
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <filesystem>
+#include <limits>
+#include <optional>
+#include <string>
 
 namespace llvm_ml {
 struct BenchmarkResult;
 
+/// Reason the runner stopped taking samples of a harness.
+enum class StopReason {
+  MaxRuns,   ///< took the maximum number of samples
+  Converged, ///< the mean is known precisely enough
+  Unstable,  ///< samples vary too much to ever meet the CoV threshold
+};
+
+/// Order of baseline and workload runs within a pass.
+enum class InterleaveOrder {
+  None,      ///< baseline and workload are measured in separate passes
+  Alternate, ///< every baseline run is followed by a workload run
+  Random,    ///< every pair runs baseline or workload first at random
+};
+
+/// Cache level the data pages of the harness are in, when a run starts.
+enum class CacheState {
+  L1,   ///< prefetched once, the runs keep them hot
+  L2,   ///< evicted from L1 before every run
+  LLC,  ///< evicted from L1 and L2 before every run
+  DRAM, ///< flushed out of every cache level before every run
+};
+
+/// Physical memory behind the data pages of the harness.
+enum class PagePlacement {
+  Shared,   ///< every mapped range aliases the same physical pages
+  Distinct, ///< every mapped range has physical pages of its own
+  Huge,     ///< like Shared, but backed by huge pages
+};
+
+/// State and placement of the harness data pages.
+struct MemoryMode {
+  CacheState cacheState = CacheState::L1;
+  PagePlacement placement = PagePlacement::Shared;
+
+  bool operator==(const MemoryMode &) const = default;
+};
+
+/// Frontend path, that fed the unrolled workload to the core. Told from the
+/// encoded size of the unrolled code and the --code-budget.
+enum class FrontendRegime {
+  Unknown,  ///< the block could not be encoded
+  UopCache, ///< the unrolled code fits the budget
+  Decoders, ///< the unrolled code exceeds the budget
+};
+
+/// Top-down microarchitecture analysis breakdown. Every value is a fraction of
+/// pipeline slots. Level 2 values split their level 1 parents.
+struct Topdown {
+  unsigned level = 0; ///< deepest level measured, 1 or 2
+  double frontendBound = 0;
+  double badSpeculation = 0;
+  double retiring = 0;
+  double backendBound = 0;
+  double fetchLatency = 0;
+  double fetchBandwidth = 0;
+  double branchMispredicts = 0;
+  double machineClears = 0;
+  double heavyOperations = 0;
+  double lightOperations = 0;
+  double memoryBound = 0;
+  double coreBound = 0;
+};
+
+/// Micro-ops dispatched to an execution port per block iteration.
+struct PortUops {
+  std::string port;
+  double uops;
+};
+
+/// Line fitted to cycles against repeat counts of the samples.
+struct Regression {
+  double slope;     ///< cycles per block iteration
+  double intercept; ///< fixed cycles of the harness
+  double rSquared;  ///< goodness of fit, low values hint at nonlinear scaling
+  /// Distinct repeat counts of the samples.
+  llvm::SmallVector<uint64_t> numRepeats;
+};
+
+/// Confidence interval of measured cycles.
+struct Interval {
+  double lower;
+  double upper;
+  double confidence; ///< e.g. 0.95
+};
+
+/// Cycles of a block rewritten into a chain of dependent copies, or into
+/// independent ones.
+struct DependencyVariantCycles {
+  double cyclesPerIteration; ///< cycles per copy of the original block
+  unsigned numCopies;
+  std::string source;
+};
+
+/// Cycles of a block, whose first instruction starts at an offset from a code
+/// alignment boundary.
+struct CodeAlignmentCycles {
+  unsigned offset; ///< bytes past a kCodeAlignment boundary
+  double cyclesPerIteration;
+};
+
+/// Cycles of the block, that ran on the SMT sibling of the measurement core
+/// while the block was measured.
+struct CoRunnerCycles {
+  int cpu;
+  double cyclesPerIteration; ///< median over the co-runner samples
+  uint64_t numSamples;
+  std::string source;
+};
+
 /// Measurement represents the final result of the benchmark: workload minus
 /// system noise.
 struct Measurement {
   uint64_t measuredCycles;
+  uint64_t measuredMicroOps;
   uint64_t measuredNumRuns;
   uint64_t workloadCycles;
   uint64_t workloadContextSwitches;
@@ -33,13 +152,42 @@ struct Measurement {
   uint64_t noiseMicroOps;
   uint64_t noiseInstructions;
   uint64_t noiseNumRuns;
+  StopReason noiseStopReason = StopReason::MaxRuns;
+  StopReason workloadStopReason = StopReason::MaxRuns;
+  /// Names of the events recorded in BenchmarkResult::events.
+  llvm::SmallVector<std::string> eventNames;
+  std::optional<Topdown> topdown;
+  /// Empty if ports were not measured.
+  llvm::SmallVector<PortUops> portPressure;
+  std::optional<Regression> regression;
+  /// Not set if there were too few accepted samples to resample.
+  std::optional<Interval> measuredCyclesInterval;
+  /// Median cycles per reference cycle of the workload samples, 0 unless
+  /// ref_cycles were counted.
+  double frequencyRatio = 0.0;
+  /// Set if --mode asked for the variant and the block could be rewritten.
+  std::optional<DependencyVariantCycles> latency;
+  std::optional<DependencyVariantCycles> throughput;
+  MemoryMode memoryMode;
+  /// Empty unless --code-alignments were given.
+  llvm::SmallVector<CodeAlignmentCycles> alignments;
+  /// (max - min) / min of cycles per iteration over the alignments, 0 if
+  /// there are less than two of them.
+  double alignmentSpread = 0.0;
+  /// Encoded bytes of one copy of the block, 0 if it could not be encoded.
+  uint64_t codeSize = 0;
+  FrontendRegime frontendRegime = FrontendRegime::Unknown;
+  /// Set if the block was measured along with a --co-runner.
+  std::optional<CoRunnerCycles> coRunner;
 
   llvm::Error exportBinary(std::filesystem::path path, llvm::StringRef source,
                            llvm::ArrayRef<BenchmarkResult> noise,
-                           llvm::ArrayRef<BenchmarkResult> workload);
+                           llvm::ArrayRef<BenchmarkResult> workload,
+                           llvm::ArrayRef<void *> mappedAddresses);
   llvm::Error exportJSON(std::filesystem::path path, llvm::StringRef source,
                          llvm::ArrayRef<BenchmarkResult> noise,
-                         llvm::ArrayRef<BenchmarkResult> workload);
+                         llvm::ArrayRef<BenchmarkResult> workload,
+                         llvm::ArrayRef<void *> mappedAddresses);
 };
 
 /// BenchmarkResult is a result of a single harrness run, whether it is a noise
@@ -55,9 +203,12 @@ struct BenchmarkResult {
       0; ///< number of micro-operations retired, may be 0 on some platforms
   uint64_t numInstructions = 0; ///< number of HW instructions retired
   uint64_t numMisalignedLoads = 0;
+  /// Cycles at the reference frequency, 0 unless ref_cycles were counted.
+  uint64_t numRefCycles = 0;
   uint64_t numRuns = 0; ///< The number of basic block repetitions
   uint64_t wallTime =
       0; ///< The number of nanoseconds it roughly took to execute the harness
+  uint64_t events[MAX_EVENTS] = {}; ///< values of the user-defined events
 };
 
 inline Measurement operator-(const BenchmarkResult &wl,
@@ -70,11 +221,17 @@ inline Measurement operator-(const BenchmarkResult &wl,
     m.measuredCycles = 0;
   }
 
+  if (wl.numMicroOps > noise.numMicroOps) {
+    m.measuredMicroOps = wl.numMicroOps - noise.numMicroOps;
+  } else {
+    m.measuredMicroOps = 0;
+  }
+
   m.workloadCycles = wl.numCycles;
   m.workloadContextSwitches = wl.numContextSwitches;
   m.workloadCacheMisses = wl.numCacheMisses;
   m.workloadMicroOps = wl.numMicroOps;
-  m.workloadInstructions = wl.numMicroOps;
+  m.workloadInstructions = wl.numInstructions;
   m.noiseCycles = noise.numCycles;
   m.noiseContextSwitches = noise.numContextSwitches;
   m.noiseCacheMisses = noise.numCacheMisses;
@@ -87,5 +244,106 @@ inline Measurement operator-(const BenchmarkResult &wl,
   return m;
 }
 
+/// StoppingRule decides when a harness has enough samples. Only samples that
+/// pass the cache miss and context switch limits count.
+struct StoppingRule {
+  /// Number of samples to take before stopping early.
+  size_t minRuns = 0;
+  /// Stop once the half-width of the 95% confidence interval of cycles per
+  /// block iteration is within this fraction of them. 0 never stops early.
+  double maxRelativeError = 0.0;
+  /// Give up once the coefficient of variation is above this value with 95%
+  /// confidence. 0 never gives up.
+  double maxCoV = 0.0;
+  uint64_t maxCacheMisses = std::numeric_limits<uint64_t>::max();
+  uint64_t maxContextSwitches = std::numeric_limits<uint64_t>::max();
+  /// Accepted cycles of the baseline measured before the samples. Cycles per
+  /// iteration are the difference of the means, their interval widens by the
+  /// error of both. Empty for the baseline itself.
+  stat::running_statistics baseline;
+
+  bool accepts(const BenchmarkResult &sample) const {
+    return sample.numCacheMisses <= maxCacheMisses &&
+           sample.numContextSwitches <= maxContextSwitches;
+  }
+
+  /// Returns the reason to stop after the samples summarized by \p cycles,
+  /// std::nullopt if more samples are needed.
+  std::optional<StopReason>
+  check(const stat::running_statistics &cycles) const {
+    if (baseline.count() == 0)
+      return check(cycles, cycles.mean(), cycles.standard_error(),
+                   cycles.count() - 1);
+
+    // A single baseline value, e.g. the harness overhead, is taken as exact.
+    double error = cycles.standard_error();
+    size_t degrees = cycles.count() - 1;
+    if (baseline.count() > 1) {
+      error = std::hypot(error, baseline.standard_error());
+      degrees = std::min(degrees, baseline.count() - 1);
+    }
+    return check(cycles, cycles.mean() - baseline.mean(), error, degrees);
+  }
+
+  /// Same as above, but cycles per iteration are the mean of the workload
+  /// minus baseline \p differences of paired runs.
+  std::optional<StopReason>
+  check(const stat::running_statistics &cycles,
+        const stat::running_statistics &differences) const {
+    return check(cycles, differences.mean(), differences.standard_error(),
+                 differences.count() - 1);
+  }
+
+private:
+  std::optional<StopReason> check(const stat::running_statistics &cycles,
+                                  double estimate, double error,
+                                  size_t degrees) const {
+    const size_t n = cycles.count();
+    if (n < std::max<size_t>(minRuns, 2))
+      return std::nullopt;
+
+    // The repeat count cancels out of the relative error of cycles per
+    // iteration.
+    const double t = stat::student_t_critical_95(degrees);
+    if (maxRelativeError != 0.0 && estimate > 0.0 &&
+        t * error <= maxRelativeError * estimate)
+      return StopReason::Converged;
+
+    // The standard error of the sample CoV is about cov / sqrt(2n).
+    const double cov = cycles.coefficient_of_variation();
+    if (maxCoV != 0.0 &&
+        cov * (1.0 - stat::student_t_critical_95(n - 1) / std::sqrt(2.0 * n)) >
+            maxCoV)
+      return StopReason::Unstable;
+
+    return std::nullopt;
+  }
+};
+
 BenchmarkResult avg(llvm::ArrayRef<BenchmarkResult> results);
+
+/// Fits cycles of \p samples against their repeat counts with Theil-Sen
+/// regression. Samples must be filtered beforehand. Returns std::nullopt if
+/// the samples have less than two distinct repeat counts.
+std::optional<Regression> fitCycles(llvm::ArrayRef<BenchmarkResult> samples);
+
+/// Computes micro-ops per block iteration of every port event, the ones
+/// getPortEvents returns, among \p eventNames.
+llvm::SmallVector<PortUops>
+computePortPressure(const BenchmarkResult &workload,
+                    const BenchmarkResult &noise,
+                    llvm::ArrayRef<std::string> eventNames);
+
+/// Computes the top-down breakdown of the block from the events named
+/// \p eventNames, the ones getTopdownEvents returns. Returns std::nullopt if
+/// the events are missing or the block did not take any slots.
+std::optional<Topdown> computeTopdown(const BenchmarkResult &workload,
+                                      const BenchmarkResult &noise,
+                                      llvm::ArrayRef<std::string> eventNames);
+
+/// Reads the mapped addresses recorded by a previous exportBinary of the block
+/// \p source to \p path. Returns an empty list if there is no such
+/// measurement, or the file can not be read.
+llvm::SmallVector<void *> importMappedAddresses(std::filesystem::path path,
+                                                llvm::StringRef source);
 } // namespace llvm_ml
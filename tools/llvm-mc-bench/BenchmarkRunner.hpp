@@ -3,33 +3,134 @@
 // SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
 //===----------------------------------------------------------------------===//
 
+#pragma once
+
+#include "BenchmarkGenerator.hpp"
+#include "BenchmarkResult.hpp"
+#include "Estimator.hpp"
+#include "counters.hpp"
+
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Error.h"
 
 #include <memory>
+#include <optional>
 
 namespace llvm {
 class Target;
 }
 
 namespace llvm_ml {
-struct BenchmarkResult;
+/// Harness, that keeps the SMT sibling of the measurement core busy, while
+/// the block is measured.
+struct CoRunner {
+  /// Workload function of the co-runner harness.
+  BenchmarkFn fn = nullptr;
+  HarnessArgs args = {};
+  /// SMT sibling of the measurement core, the co-runner is pinned to.
+  int cpu = -1;
+};
+
+/// Options that control how the CPU benchmark runner executes harnesses.
+struct CPUBenchmarkOptions {
+  int pinnedCPU = 0; ///< CPU core to pin measurement processes to
+  int numRuns = 50;  ///< Number of harness runs per measurement
+  /// Materialize harnesses in-process with ORC JIT instead of linking a
+  /// shared library with the system linker.
+  bool useJIT = false;
+  /// Measure in persistent worker processes, one per pinned CPU, instead of
+  /// forking a new process for every pass. Implies useJIT.
+  bool useWorkers = false;
+  /// Decides when to stop before numRuns samples are taken.
+  StoppingRule stoppingRule;
+  /// How harness processes read PMU counters.
+  CountersBackend counters = CountersBackend::RDPMC;
+  /// Events to count in addition to the default counters.
+  llvm::SmallVector<EventSpec> events;
+  /// Number of PMU counters free for events in a single pass. Events that do
+  /// not fit are counted in extra passes.
+  unsigned numEventSlots = 3;
+  /// Decides which samples of an extra pass make up the events it counts.
+  SampleFilter eventFilter;
+  /// Interleave baseline and workload runs in a single pass, instead of
+  /// measuring them in separate passes.
+  InterleaveOrder interleave = InterleaveOrder::None;
+  /// Physical memory behind the harness data pages and the cache level they
+  /// are in, when a run starts.
+  MemoryMode memory;
+  /// Calibrated fixed overhead of the harness on the pinned CPU. If set, it
+  /// is the only noise result and the baseline harness is never run.
+  std::optional<BenchmarkResult> overhead;
+  /// Runs along with every pass, started together with the harness. Not
+  /// supported with useWorkers.
+  std::optional<CoRunner> coRunner;
+};
+
+/// CompiledHarness is an executable form of a harness module. Symbols are
+/// resolved in the parent process, so that forked children inherit the code
+/// via copy-on-write.
+class CompiledHarness {
+public:
+  virtual llvm::Expected<BenchmarkFn> lookup(llvm::StringRef name) = 0;
+
+  virtual ~CompiledHarness() = default;
+};
+
+/// HarnessCompiler turns harness modules into executable code. Compilation
+/// does not depend on the CPU the harness is measured on, so it can run on
+/// any thread, away from the measurement cores.
+class HarnessCompiler {
+public:
+  virtual llvm::Expected<std::unique_ptr<CompiledHarness>>
+  compile(std::unique_ptr<llvm::Module> harness) = 0;
+  /// Copies machine code produced by a HarnessEncoder to executable memory.
+  virtual llvm::Expected<std::unique_ptr<CompiledHarness>>
+  load(const EncodedHarness &harness) = 0;
+
+  virtual ~HarnessCompiler() = default;
+};
 
 class BenchmarkRunner {
 public:
-  virtual llvm::Error run(std::unique_ptr<llvm::Module> harness,
-                          size_t numNoiseRepeat, size_t numRepeat) = 0;
-  virtual llvm::Expected<int> check(std::unique_ptr<llvm::Module> harness,
+  virtual llvm::Error run(CompiledHarness &harness, size_t numNoiseRepeat,
+                          size_t numRepeat) = 0;
+  virtual llvm::Expected<int> check(CompiledHarness &harness,
                                     size_t numNoiseRepeat) = 0;
   virtual llvm::ArrayRef<BenchmarkResult> getNoiseResults() const = 0;
   virtual llvm::ArrayRef<BenchmarkResult> getWorkloadResults() const = 0;
+  /// Samples the co-runner took along with the successful passes, empty if
+  /// there was no co-runner.
+  virtual llvm::ArrayRef<BenchmarkResult> getCoRunnerResults() const = 0;
+  virtual StopReason getNoiseStopReason() const = 0;
+  virtual StopReason getWorkloadStopReason() const = 0;
+  /// Returns true if every noise result was taken along with the workload
+  /// result of the same index, so that they are subtracted in pairs.
+  virtual bool hasPairedResults() const = 0;
+  /// Data addresses that harnesses of this runner have faulted on. They are
+  /// mapped ahead of every following pass.
+  virtual llvm::ArrayRef<void *> getMappedAddresses() const = 0;
+  /// Maps pages of \p addresses ahead of every following pass as well, e.g.
+  /// the ones recorded by a previous measurement of the same block or
+  /// predicted from its code. Addresses, that are already mapped or collide
+  /// with memory of the runner, are skipped.
+  virtual void addMappedAddresses(llvm::ArrayRef<void *> addresses) = 0;
 
   virtual ~BenchmarkRunner() = default;
 };
 
+/// Returns the first SMT sibling of \p cpu, that sysfs topology lists, or
+/// std::nullopt if the core has none.
+std::optional<int> getSMTSibling(int cpu);
+
+/// Creates a compiler for harnesses measured by runners created with the same
+/// \p options.
+std::unique_ptr<HarnessCompiler>
+createHarnessCompiler(const llvm::Target *target, llvm::StringRef tripleName,
+                      const CPUBenchmarkOptions &options);
+
 std::unique_ptr<BenchmarkRunner>
 createCPUBenchmarkRunner(const llvm::Target *target, llvm::StringRef tripleName,
-                         int pinnedCPU, int numRuns);
+                         const CPUBenchmarkOptions &options);
 } // namespace llvm_ml
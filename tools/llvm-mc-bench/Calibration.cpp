@@ -0,0 +1,205 @@
+//===--- Calibration.cpp - Harness overhead calibration -------------------===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#include "Calibration.hpp"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/TargetParser/Host.h"
+
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <sys/utsname.h>
+#include <system_error>
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+/// Version of the cache file layout, files of other versions are ignored.
+constexpr int kCacheVersion = 1;
+
+namespace llvm_ml {
+std::string getHostFingerprint() {
+  std::string model = llvm::sys::getHostCPUName().str();
+  std::string microcode = "unknown";
+
+#if defined(__linux__)
+  // Every processor lists the same model and microcode, the first one is
+  // enough.
+  if (auto buffer = llvm::MemoryBuffer::getFileAsStream("/proc/cpuinfo")) {
+    llvm::SmallVector<llvm::StringRef> lines;
+    (*buffer)->getBuffer().split(lines, '\n');
+    for (llvm::StringRef line : lines) {
+      if (line.trim().empty())
+        break;
+      auto [name, value] = line.split(':');
+      if (name.trim() == "model name")
+        model = value.trim().str();
+      else if (name.trim() == "microcode")
+        microcode = value.trim().str();
+    }
+  }
+#endif
+
+  struct utsname host;
+  const std::string kernel = uname(&host) == 0 ? host.release : "unknown";
+
+  return llvm::formatv("{0}|microcode={1}|kernel={2}", model, microcode,
+                       kernel);
+}
+
+static json toJSON(const BenchmarkResult &res) {
+  json resJson;
+  resJson["cycles"] = res.numCycles;
+  resJson["context_switches"] = res.numContextSwitches;
+  resJson["cache_misses"] = res.numCacheMisses;
+  resJson["uops"] = res.numMicroOps;
+  resJson["instructions"] = res.numInstructions;
+  resJson["misaligned_loads"] = res.numMisalignedLoads;
+  resJson["ref_cycles"] = res.numRefCycles;
+  resJson["wall_time_ns"] = res.wallTime;
+  auto events = json::array();
+  for (uint64_t event : res.events)
+    events.push_back(event);
+  resJson["events"] = events;
+  return resJson;
+}
+
+static std::optional<BenchmarkResult> fromJSON(const json &resJson) {
+  if (!resJson.is_object())
+    return std::nullopt;
+
+  const auto get = [&](const char *name) -> uint64_t {
+    auto it = resJson.find(name);
+    return it != resJson.end() && it->is_number_unsigned()
+               ? it->get<uint64_t>()
+               : 0;
+  };
+
+  BenchmarkResult res;
+  res.numCycles = get("cycles");
+  res.numContextSwitches = get("context_switches");
+  res.numCacheMisses = get("cache_misses");
+  res.numMicroOps = get("uops");
+  res.numInstructions = get("instructions");
+  res.numMisalignedLoads = get("misaligned_loads");
+  res.numRefCycles = get("ref_cycles");
+  res.wallTime = get("wall_time_ns");
+
+  auto events = resJson.find("events");
+  if (events == resJson.end() || !events->is_array() ||
+      events->size() != MAX_EVENTS)
+    return std::nullopt;
+  for (auto event : llvm::enumerate(*events)) {
+    if (!event.value().is_number_unsigned())
+      return std::nullopt;
+    res.events[event.index()] = event.value().get<uint64_t>();
+  }
+
+  return res;
+}
+
+static int64_t now() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+CalibrationCache::CalibrationCache(fs::path path) : mPath(std::move(path)) {
+  std::ifstream in(mPath);
+  if (!in)
+    return;
+
+  json cache = json::parse(in, nullptr, /*allow_exceptions=*/false);
+  if (!cache.is_object() || cache["version"] != kCacheVersion)
+    return;
+
+  auto entries = cache.find("entries");
+  if (entries == cache.end() || !entries->is_object())
+    return;
+
+  for (const auto &[key, cpus] : entries->items()) {
+    if (!cpus.is_object())
+      continue;
+    for (const auto &[cpu, entry] : cpus.items()) {
+      auto overhead = fromJSON(entry);
+      if (!overhead || !entry.contains("timestamp") ||
+          !entry["timestamp"].is_number_integer())
+        continue;
+      mEntries[key][std::atoi(cpu.c_str())] =
+          Entry{*overhead, entry["timestamp"].get<int64_t>()};
+    }
+  }
+}
+
+std::optional<BenchmarkResult>
+CalibrationCache::lookup(llvm::StringRef key, int cpu,
+                         std::chrono::seconds maxAge) const {
+  std::lock_guard lock(mMutex);
+
+  auto cpus = mEntries.find(key.str());
+  if (cpus == mEntries.end())
+    return std::nullopt;
+  auto entry = cpus->second.find(cpu);
+  if (entry == cpus->second.end())
+    return std::nullopt;
+
+  if (now() - entry->second.timestamp > maxAge.count())
+    return std::nullopt;
+
+  return entry->second.overhead;
+}
+
+llvm::Error CalibrationCache::store(llvm::StringRef key, int cpu,
+                                    const BenchmarkResult &overhead) {
+  std::lock_guard lock(mMutex);
+  mEntries[key.str()][cpu] = Entry{overhead, now()};
+  return save();
+}
+
+llvm::Error CalibrationCache::save() const {
+  if (mPath.empty())
+    return llvm::Error::success();
+
+  json entries = json::object();
+  for (const auto &[key, cpus] : mEntries) {
+    for (const auto &[cpu, entry] : cpus) {
+      json entryJson = toJSON(entry.overhead);
+      entryJson["timestamp"] = entry.timestamp;
+      entries[key][std::to_string(cpu)] = std::move(entryJson);
+    }
+  }
+
+  json cache;
+  cache["version"] = kCacheVersion;
+  cache["entries"] = std::move(entries);
+
+  std::error_code ec;
+  if (mPath.has_parent_path())
+    fs::create_directories(mPath.parent_path(), ec);
+  if (ec)
+    return llvm::createStringError(ec, "Failed to create %s",
+                                   mPath.parent_path().c_str());
+
+  // Other instances may read the cache at the same time, replace it at once.
+  fs::path tmpPath = mPath;
+  tmpPath += ".tmp";
+  {
+    std::ofstream out(tmpPath);
+    out << cache.dump(2);
+    if (!out)
+      return llvm::createStringError(std::errc::io_error,
+                                     "Failed to write %s", tmpPath.c_str());
+  }
+
+  fs::rename(tmpPath, mPath, ec);
+  if (ec)
+    return llvm::createStringError(ec, "Failed to write %s", mPath.c_str());
+
+  return llvm::Error::success();
+}
+} // namespace llvm_ml
@@ -0,0 +1,59 @@
+//===--- Calibration.hpp - Harness overhead calibration ---------------C++-===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "BenchmarkResult.hpp"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace llvm_ml {
+/// Returns a string, that identifies the host: CPU model, microcode revision
+/// and kernel release. Overheads measured on a different host do not apply.
+std::string getHostFingerprint();
+
+/// CalibrationCache stores the fixed overhead of a harness on every CPU core:
+/// counters start and stop, state save and restore and the prologue, all but
+/// the block itself. Entries are keyed by the host fingerprint and the harness
+/// configuration and expire, as the overhead drifts with the state of the
+/// machine. The cache is safe to use from multiple threads.
+class CalibrationCache {
+public:
+  /// Loads the cache from \p path. A missing or malformed file gives an empty
+  /// cache, an empty path a cache that is never written.
+  explicit CalibrationCache(std::filesystem::path path);
+
+  /// Returns the overhead of \p cpu stored under \p key, std::nullopt if there
+  /// is none or it is older than \p maxAge.
+  std::optional<BenchmarkResult> lookup(llvm::StringRef key, int cpu,
+                                        std::chrono::seconds maxAge) const;
+
+  /// Stores \p overhead of \p cpu under \p key and writes the cache back.
+  llvm::Error store(llvm::StringRef key, int cpu,
+                    const BenchmarkResult &overhead);
+
+private:
+  struct Entry {
+    BenchmarkResult overhead;
+    /// Seconds since epoch of the calibration.
+    int64_t timestamp;
+  };
+
+  llvm::Error save() const;
+
+  std::filesystem::path mPath;
+  std::map<std::string, std::map<int, Entry>> mEntries;
+  mutable std::mutex mMutex;
+};
+} // namespace llvm_ml
@@ -0,0 +1,270 @@
+//===--- Estimator.cpp - Sample filtering and aggregation -----------------===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#include "Estimator.hpp"
+#include "llvm-ml/statistics/robust.hpp"
+
+#include "llvm/ADT/STLExtras.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace llvm_ml {
+llvm::SmallVector<size_t>
+SampleFilter::apply(llvm::ArrayRef<BenchmarkResult> samples) const {
+  const auto hasDrifted = [&](const BenchmarkResult &res) {
+    if (maxFrequencyDrift == 0.0 || expectedFrequencyRatio == 0.0 ||
+        res.numRefCycles == 0)
+      return false;
+    const double ratio = static_cast<double>(res.numCycles) / res.numRefCycles;
+    return std::abs(ratio / expectedFrequencyRatio - 1.0) > maxFrequencyDrift;
+  };
+
+  llvm::SmallVector<size_t> accepted;
+  for (auto sample : llvm::enumerate(samples)) {
+    const BenchmarkResult &res = sample.value();
+    if (!res.hasFailed && res.numCacheMisses <= maxCacheMisses &&
+        res.numContextSwitches <= maxContextSwitches && !hasDrifted(res))
+      accepted.push_back(sample.index());
+  }
+
+  // Every run executes the same instructions, extra ones come from outside of
+  // the block.
+  if (maxInstructionDeviation > 0.0 && !accepted.empty()) {
+    std::vector<double> instructions;
+    for (size_t index : accepted)
+      instructions.push_back(samples[index].numInstructions);
+    const double expected = stat::median(instructions);
+
+    llvm::erase_if(accepted, [&](size_t index) {
+      const double deviation =
+          std::abs(samples[index].numInstructions - expected);
+      return deviation > maxInstructionDeviation * expected;
+    });
+  }
+
+  // A handful of samples says nothing about their spread.
+  if (outliers == OutlierRule::None || accepted.size() < 3)
+    return accepted;
+
+  std::vector<double> cycles;
+  for (size_t index : accepted)
+    cycles.push_back(samples[index].numCycles);
+
+  double lower, upper;
+  if (outliers == OutlierRule::MAD) {
+    const double threshold = outlierThreshold != 0.0 ? outlierThreshold : 3.5;
+    const double center = stat::median(cycles);
+    const double mad = stat::median_absolute_deviation(cycles);
+    lower = center - threshold * mad;
+    upper = center + threshold * mad;
+  } else {
+    const double threshold = outlierThreshold != 0.0 ? outlierThreshold : 1.5;
+    const double q1 = stat::quantile(cycles, 0.25);
+    const double q3 = stat::quantile(cycles, 0.75);
+    lower = q1 - threshold * (q3 - q1);
+    upper = q3 + threshold * (q3 - q1);
+  }
+
+  // No spread at all, e.g. all but a few samples took the same cycles. The
+  // rest are not told apart from the bulk.
+  if (lower == upper)
+    return accepted;
+
+  llvm::erase_if(accepted, [&](size_t index) {
+    const double value = samples[index].numCycles;
+    return value < lower || value > upper;
+  });
+
+  return accepted;
+}
+
+double getFrequencyRatio(llvm::ArrayRef<BenchmarkResult> samples,
+                         llvm::ArrayRef<size_t> indices) {
+  std::vector<double> ratios;
+  for (size_t index : indices) {
+    const BenchmarkResult &res = samples[index];
+    if (res.numRefCycles != 0)
+      ratios.push_back(static_cast<double>(res.numCycles) / res.numRefCycles);
+  }
+  return ratios.empty() ? 0.0 : stat::median(std::move(ratios));
+}
+
+double getCyclesPerIteration(llvm::ArrayRef<BenchmarkResult> samples) {
+  std::vector<double> cycles;
+  for (const BenchmarkResult &res : samples) {
+    if (!res.hasFailed && res.numRuns != 0)
+      cycles.push_back(static_cast<double>(res.numCycles) / res.numRuns);
+  }
+  return cycles.empty() ? 0.0 : stat::median(std::move(cycles));
+}
+
+/// Returns \p indices of \p samples ordered by cycles.
+static llvm::SmallVector<size_t>
+rankByCycles(llvm::ArrayRef<BenchmarkResult> samples,
+             llvm::ArrayRef<size_t> indices) {
+  llvm::SmallVector<size_t> ranked(indices.begin(), indices.end());
+  std::stable_sort(ranked.begin(), ranked.end(), [&](size_t lhs, size_t rhs) {
+    return samples[lhs].numCycles < samples[rhs].numCycles;
+  });
+  return ranked;
+}
+
+/// Returns the mean of every counter of \p samples at \p indices.
+static BenchmarkResult mean(llvm::ArrayRef<BenchmarkResult> samples,
+                            llvm::ArrayRef<size_t> indices) {
+  BenchmarkResult res;
+  if (indices.empty())
+    return res;
+
+  res.numRuns = samples[indices.front()].numRuns;
+  for (size_t index : indices) {
+    const BenchmarkResult &sample = samples[index];
+    res.numCycles += sample.numCycles;
+    res.numContextSwitches += sample.numContextSwitches;
+    res.numCacheMisses += sample.numCacheMisses;
+    res.numMicroOps += sample.numMicroOps;
+    res.numInstructions += sample.numInstructions;
+    res.numMisalignedLoads += sample.numMisalignedLoads;
+    res.numRefCycles += sample.numRefCycles;
+    res.wallTime += sample.wallTime;
+    for (unsigned i = 0; i < MAX_EVENTS; i++)
+      res.events[i] += sample.events[i];
+  }
+
+  const size_t total = indices.size();
+  res.numCycles /= total;
+  res.numContextSwitches /= total;
+  res.numCacheMisses /= total;
+  res.numMicroOps /= total;
+  res.numInstructions /= total;
+  res.numMisalignedLoads /= total;
+  res.numRefCycles /= total;
+  res.wallTime /= total;
+  for (auto &event : res.events)
+    event /= total;
+
+  return res;
+}
+
+std::pair<size_t, size_t> Estimator::getWindow(size_t size) const {
+  if (size == 0)
+    return {0, 0};
+
+  switch (kind) {
+  case EstimatorKind::Min:
+    return {0, 1};
+  case EstimatorKind::Median:
+    if (size % 2 == 1)
+      return {size / 2, size / 2 + 1};
+    return {size / 2 - 1, size / 2 + 1};
+  case EstimatorKind::TrimmedMean: {
+    size_t trim = static_cast<size_t>(std::clamp(trimFraction, 0.0, 0.5) *
+                                      static_cast<double>(size));
+    // Keep at least the median.
+    if (2 * trim >= size)
+      trim = (size - 1) / 2;
+    return {trim, size - trim};
+  }
+  case EstimatorKind::MinOfK:
+    return {0, std::clamp<size_t>(k, 1, size)};
+  }
+  llvm_unreachable("Unknown estimator");
+}
+
+double Estimator::estimateCycles(std::vector<double> cycles) const {
+  std::sort(cycles.begin(), cycles.end());
+  auto [first, last] = getWindow(cycles.size());
+  if (first == last)
+    return std::nan("");
+
+  double sum = 0.0;
+  for (size_t i = first; i < last; i++)
+    sum += cycles[i];
+  return sum / static_cast<double>(last - first);
+}
+
+Estimate Estimator::estimate(llvm::ArrayRef<BenchmarkResult> noise,
+                             llvm::ArrayRef<size_t> acceptedNoise,
+                             llvm::ArrayRef<BenchmarkResult> workload,
+                             llvm::ArrayRef<size_t> acceptedWorkload) const {
+  assert(!acceptedNoise.empty() && !acceptedWorkload.empty());
+
+  const auto estimateOf = [&](llvm::ArrayRef<BenchmarkResult> samples,
+                              llvm::ArrayRef<size_t> accepted) {
+    llvm::SmallVector<size_t> ranked = rankByCycles(samples, accepted);
+    auto [first, last] = getWindow(ranked.size());
+    return mean(samples,
+                llvm::ArrayRef<size_t>(ranked).slice(first, last - first));
+  };
+
+  Estimate result;
+  result.noise = estimateOf(noise, acceptedNoise);
+  result.workload = estimateOf(workload, acceptedWorkload);
+
+  std::vector<double> noiseCycles, workloadCycles;
+  for (size_t index : acceptedNoise)
+    noiseCycles.push_back(noise[index].numCycles);
+  for (size_t index : acceptedWorkload)
+    workloadCycles.push_back(workload[index].numCycles);
+
+  // Noise is resampled along with the workload, as it has a spread of its
+  // own.
+  std::mt19937_64 rng(0);
+  std::uniform_int_distribution<size_t> pickNoise(0, noiseCycles.size() - 1);
+  const auto difference = [&](const std::vector<size_t> &indices) {
+    std::vector<double> wl, base;
+    for (size_t index : indices)
+      wl.push_back(workloadCycles[index]);
+    for (size_t i = 0; i < noiseCycles.size(); i++)
+      base.push_back(noiseCycles[pickNoise(rng)]);
+    return estimateCycles(std::move(wl)) - estimateCycles(std::move(base));
+  };
+
+  std::tie(result.lowerCycles, result.upperCycles) = stat::bootstrap_interval(
+      workloadCycles.size(), difference, confidence);
+
+  return result;
+}
+
+Estimate
+Estimator::estimatePaired(llvm::ArrayRef<BenchmarkResult> noise,
+                          llvm::ArrayRef<BenchmarkResult> workload,
+                          llvm::ArrayRef<size_t> acceptedPairs) const {
+  assert(!acceptedPairs.empty());
+
+  llvm::SmallVector<size_t> ranked = rankByCycles(workload, acceptedPairs);
+  auto [first, last] = getWindow(ranked.size());
+  llvm::ArrayRef<size_t> window =
+      llvm::ArrayRef<size_t>(ranked).slice(first, last - first);
+
+  Estimate result;
+  result.noise = mean(noise, window);
+  result.workload = mean(workload, window);
+
+  std::vector<std::pair<double, double>> pairs;
+  for (size_t index : acceptedPairs)
+    pairs.emplace_back(workload[index].numCycles, noise[index].numCycles);
+
+  const auto difference = [&](const std::vector<size_t> &indices) {
+    std::vector<std::pair<double, double>> resample;
+    for (size_t index : indices)
+      resample.push_back(pairs[index]);
+    std::sort(resample.begin(), resample.end());
+
+    auto [first, last] = getWindow(resample.size());
+    double sum = 0.0;
+    for (size_t i = first; i < last; i++)
+      sum += resample[i].first - resample[i].second;
+    return sum / static_cast<double>(last - first);
+  };
+
+  std::tie(result.lowerCycles, result.upperCycles) =
+      stat::bootstrap_interval(pairs.size(), difference, confidence);
+
+  return result;
+}
+} // namespace llvm_ml
@@ -0,0 +1,115 @@
+//===--- Estimator.hpp - Sample filtering and aggregation -------------C++-===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "BenchmarkResult.hpp"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace llvm_ml {
+/// Rule that rejects samples, whose cycles are far from the bulk of them.
+enum class OutlierRule {
+  None,
+  MAD, ///< too many median absolute deviations away from the median
+  IQR, ///< too many interquartile ranges outside of the quartiles
+};
+
+/// SampleFilter decides which samples of a harness are fit for estimation.
+struct SampleFilter {
+  uint64_t maxCacheMisses = std::numeric_limits<uint64_t>::max();
+  uint64_t maxContextSwitches = std::numeric_limits<uint64_t>::max();
+  OutlierRule outliers = OutlierRule::None;
+  /// Distance in MADs or IQRs, beyond which a sample is an outlier. 0 picks
+  /// 3.5 for MAD and 1.5 for IQR.
+  double outlierThreshold = 0.0;
+  /// Rejects samples, whose instruction count differs from the median one by
+  /// more than this fraction, e.g. because of microcode assists or SMIs. 0
+  /// disables the check.
+  double maxInstructionDeviation = 0.0;
+  /// Cycles per reference cycle the core is expected to run at, 0 if not
+  /// known yet.
+  double expectedFrequencyRatio = 0.0;
+  /// Rejects samples, whose cycles per reference cycle differ from the
+  /// expected ones by more than this fraction, i.e. the core left its fixed
+  /// frequency. Samples without reference cycles are not checked. 0 disables
+  /// the check.
+  double maxFrequencyDrift = 0.0;
+
+  /// Returns indices of \p samples, that pass the filter. Failed samples
+  /// never do.
+  llvm::SmallVector<size_t>
+  apply(llvm::ArrayRef<BenchmarkResult> samples) const;
+};
+
+/// Returns the median cycles per reference cycle of \p samples at \p indices,
+/// 0 if none of them counted reference cycles.
+double getFrequencyRatio(llvm::ArrayRef<BenchmarkResult> samples,
+                         llvm::ArrayRef<size_t> indices);
+
+/// Returns the median cycles per iteration of the successful \p samples, 0 if
+/// there are none.
+double getCyclesPerIteration(llvm::ArrayRef<BenchmarkResult> samples);
+
+/// Way an Estimator aggregates cycles of the accepted samples.
+enum class EstimatorKind {
+  Min,         ///< the fastest sample
+  Median,      ///< the sample of median cycles
+  TrimmedMean, ///< mean of the samples left after trimming both tails
+  MinOfK,      ///< mean of the k fastest samples
+};
+
+/// Estimate of noise and workload along with the confidence interval of
+/// workload minus noise cycles.
+struct Estimate {
+  /// Mean of every counter of the samples, that make up the estimate.
+  BenchmarkResult noise;
+  BenchmarkResult workload;
+  double lowerCycles;
+  double upperCycles;
+};
+
+/// Estimator turns accepted samples of a harness into a single result. Every
+/// kind averages a window of samples ranked by cycles, so that the other
+/// counters of the result come from the same runs as its cycles.
+struct Estimator {
+  EstimatorKind kind = EstimatorKind::Min;
+  /// Fraction of samples TrimmedMean drops from either tail.
+  double trimFraction = 0.1;
+  /// Number of samples MinOfK averages.
+  unsigned k = 5;
+  /// Confidence level of Estimate intervals.
+  double confidence = 0.95;
+
+  /// Returns the range of ranks, that make up the estimate of \p size
+  /// samples sorted by cycles.
+  std::pair<size_t, size_t> getWindow(size_t size) const;
+
+  /// Estimates cycles of \p cycles.
+  double estimateCycles(std::vector<double> cycles) const;
+
+  /// Estimates independent \p noise and \p workload samples, of which only
+  /// the ones at \p acceptedNoise and \p acceptedWorkload are used. Both
+  /// lists must not be empty.
+  Estimate estimate(llvm::ArrayRef<BenchmarkResult> noise,
+                    llvm::ArrayRef<size_t> acceptedNoise,
+                    llvm::ArrayRef<BenchmarkResult> workload,
+                    llvm::ArrayRef<size_t> acceptedWorkload) const;
+
+  /// Estimates paired samples, noise[i] ran right along with workload[i].
+  /// Pairs are ranked by workload cycles, every workload sample is taken
+  /// with its own noise. \p acceptedPairs must not be empty.
+  Estimate estimatePaired(llvm::ArrayRef<BenchmarkResult> noise,
+                          llvm::ArrayRef<BenchmarkResult> workload,
+                          llvm::ArrayRef<size_t> acceptedPairs) const;
+};
+} // namespace llvm_ml
@@ -0,0 +1,191 @@
+//===--- HarnessProcess.hpp - Harness process environment -------------C++-===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "BenchmarkGenerator.hpp"
+#include "BenchmarkResult.hpp"
+#include "SampleRing.hpp"
+#include "counters.hpp"
+
+#include "llvm/ADT/ArrayRef.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+constexpr unsigned MAX_FAULTS = 30;
+
+namespace llvm_ml {
+enum class ExitReason {
+  Success,
+  Segfault,
+  Unknown,
+};
+
+struct ExitStatus {
+  ExitReason reason;
+  void *memAddr;
+  void *ip;
+};
+
+/// HarnessLog lives in memory shared with the harness process. It holds the
+/// data addresses mapped for the harness, including the ones mapped on demand,
+/// the reason to stop taking samples and describes the fault that ended the
+/// process, if any.
+struct HarnessLog {
+  ExitReason reason;
+  void *faultAddr;
+  void *faultIP;
+  unsigned numAddresses;
+  void *addresses[MAX_FAULTS];
+  /// Bit i is set if the harness mapped the i-th page of the range around the
+  /// address itself. Pages the process uses already are never replaced, and
+  /// must survive the harness.
+  uint8_t mappedPages[MAX_FAULTS];
+  StopReason stopReason;
+
+  /// Starts a new run with \p mapped addresses mapped in advance.
+  void reset(llvm::ArrayRef<void *> mapped) {
+    reason = ExitReason::Unknown;
+    faultAddr = nullptr;
+    faultIP = nullptr;
+    stopReason = StopReason::MaxRuns;
+    numAddresses = std::min<size_t>(mapped.size(), MAX_FAULTS);
+    std::copy_n(mapped.begin(), numAddresses, addresses);
+    std::fill_n(mappedPages, MAX_FAULTS, 0);
+  }
+
+  llvm::ArrayRef<void *> getAddresses() const {
+    return llvm::ArrayRef<void *>(addresses, numAddresses);
+  }
+};
+
+/// SiblingControl lives in memory shared by a harness process, the co-runner
+/// on its SMT sibling and the parent. The processes start together, once both
+/// of them arrived. The co-runner runs until the parent stops it.
+struct SiblingControl {
+  std::atomic<unsigned> numArrived;
+  std::atomic<bool> stopped;
+
+  void reset() {
+    numArrived.store(0);
+    stopped.store(false);
+  }
+
+  /// Waits for the other process to arrive. Returns false if the parent
+  /// stopped the pass before it did.
+  bool arriveAndWait();
+};
+
+/// Signals the eventfd \p fd.
+void notifyEvent(int fd);
+
+/// Blocks until the eventfd \p fd is signaled. Returns false on error.
+bool waitForEvent(int fd);
+
+/// Pins the calling process to \p cpu and raises its scheduling priority.
+/// Returns false if the process could not be pinned.
+bool setupHarnessProcess(int cpu);
+
+/// Memory file, that backs harness data pages.
+struct PhysicalPages {
+  int fd;
+  size_t pageSize;
+  PagePlacement placement;
+};
+
+/// Returns the size of pages, that back harness data pages placed as
+/// \p placement.
+size_t getHarnessPageSize(PagePlacement placement);
+
+/// Creates the memory file that backs harness data pages placed as
+/// \p placement.
+PhysicalPages allocatePhysicalPages(PagePlacement placement);
+
+/// Maps the data pages containing the addresses of \p log in the calling
+/// process, records them in \p log and prefetches them into the cache.
+/// Pages the process already uses are skipped rather than replaced, the same
+/// way the fault handler does.
+void mapHarnessPages(const PhysicalPages &pages, HarnessLog *log);
+
+/// Returns true if the pages mapHarnessPages maps for \p addresses contain
+/// \p addr.
+bool isHarnessPageMapped(size_t pageSize, llvm::ArrayRef<void *> addresses,
+                         void *addr);
+
+/// Returns true if none of the pages mapHarnessPages maps for \p addr are in
+/// use by the calling process, so that mapping them replaces nothing.
+bool canMapHarnessPages(size_t pageSize, void *addr);
+
+/// Returns the instruction pointer of the context \p ucontext a signal
+/// handler interrupted, nullptr on targets it is not known for.
+void *getSignalIP(const void *ucontext);
+
+/// Installs a SIGSEGV handler that maps the data pages the harness faults on
+/// from \p pages and resumes it. Every handled address is appended to
+/// \p log. A fault that can not be handled is recorded in \p log, and the
+/// process exits with code 1. The handler runs on its own stack, as
+/// harnesses move the stack pointer around.
+void installFaultHandler(const PhysicalPages &pages, HarnessLog *log);
+
+/// Removes the mappings \p log records, the ones created by mapHarnessPages
+/// and the fault handler.
+void unmapHarnessPages(size_t pageSize, const HarnessLog &log);
+
+/// CacheWarmer brings the data pages of the harness to the cache state, that
+/// every run starts in.
+class CacheWarmer {
+public:
+  CacheWarmer(CacheState state, size_t pageSize);
+
+  /// Prepares the pages of the addresses in \p log for the next run.
+  void prepare(const HarnessLog &log) const;
+
+private:
+  CacheState mState;
+  size_t mPageSize;
+  /// Walking it evicts the data pages from the inner cache levels.
+  std::vector<char> mEvictionBuffer;
+};
+
+/// Interleaving pairs every run of a pass with a run of the baseline.
+struct Interleaving {
+  InterleaveOrder order = InterleaveOrder::None;
+  BenchmarkFn baseline = nullptr;
+  HarnessArgs baselineArgs = {};
+};
+
+/// Warms up \p fn and runs it up to \p numRuns times, until \p rule tells to
+/// stop. Every run starts after \p cache prepared the data pages and pushes
+/// one sample to \p samples. The reason to stop is recorded in \p log.
+void measureHarness(BenchmarkFn fn, CountersContext *counters,
+                    const CacheWarmer &cache, SampleRing *samples, int numRuns,
+                    HarnessArgs *args, const StoppingRule &rule,
+                    HarnessLog *log);
+
+/// Warms up the baseline of \p interleave and \p fn and runs them in pairs up
+/// to \p numPairs times, until \p rule tells to stop. The rule applies to the
+/// cycles of \p fn minus the cycles of the baseline of every pair. Every pair
+/// pushes the baseline sample followed by the sample of \p fn to \p samples,
+/// whichever of them ran first. \p cache prepares the data pages before every
+/// run.
+void measureInterleaved(BenchmarkFn fn, CountersContext *counters,
+                        const CacheWarmer &cache, SampleRing *samples,
+                        int numPairs, HarnessArgs *args,
+                        const Interleaving &interleave,
+                        const StoppingRule &rule, HarnessLog *log);
+
+/// Warms up \p fn, waits for the harness process at \p control and runs
+/// \p fn over and over, until the parent stops it. Runs push samples to
+/// \p samples, as long as it has room for them.
+void measureCoRunner(BenchmarkFn fn, CountersContext *counters,
+                     SampleRing *samples, HarnessArgs *args,
+                     const HarnessLog &log, SiblingControl *control);
+} // namespace llvm_ml
@@ -0,0 +1,98 @@
+//===--- MeasurementWorker.hpp - Persistent measurement processes -----C++-===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "BenchmarkGenerator.hpp"
+#include "BenchmarkResult.hpp"
+#include "HarnessProcess.hpp"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+
+#include <map>
+#include <mutex>
+#include <sys/types.h>
+
+namespace llvm_ml {
+struct WorkerControl;
+
+/// SharedCodeMapper places JIT allocations in a single memfd-backed region,
+/// that is mapped at the same address in the parent and in every measurement
+/// worker. Code compiled after a worker has been forked is immediately
+/// visible to it.
+class SharedCodeMapper final
+    : public llvm::SectionMemoryManager::MemoryMapper {
+public:
+  static SharedCodeMapper &get();
+
+  llvm::sys::MemoryBlock
+  allocateMappedMemory(llvm::SectionMemoryManager::AllocationPurpose purpose,
+                       size_t numBytes,
+                       const llvm::sys::MemoryBlock *const nearBlock,
+                       unsigned flags, std::error_code &ec) override;
+  std::error_code protectMappedMemory(const llvm::sys::MemoryBlock &block,
+                                      unsigned flags) override;
+  std::error_code releaseMappedMemory(llvm::sys::MemoryBlock &block) override;
+
+  /// Makes the whole region read-only and executable in the calling process.
+  void makeExecutable();
+
+private:
+  SharedCodeMapper();
+
+  std::mutex mMutex;
+  char *mBase = nullptr;
+  size_t mSize = 0;
+  /// Free chunks of the region, offset to size.
+  std::map<size_t, size_t> mFreeChunks;
+};
+
+/// MeasurementWorker is a long-lived process, that stays pinned to a single
+/// CPU and keeps its PMU counters open. The parent hands it harnesses through
+/// shared memory and eventfd notifications. The process is only replaced when
+/// a harness crashes it.
+class MeasurementWorker {
+public:
+  /// Returns the worker for \p cpu. All workers must be created with the same
+  /// counters \p backend.
+  static MeasurementWorker &get(int cpu, CountersBackend backend);
+
+  /// Maps \p addresses and measures up to \p numRuns runs of \p fn, which
+  /// must live in SharedCodeMapper memory, until \p rule tells to stop.
+  /// \p events are counted along with the default counters, data pages are
+  /// backed and prepared as \p memory says. Samples are appended to
+  /// \p samples as the worker takes them. Unless \p interleave says
+  /// otherwise, runs of \p fn are not paired with baseline runs, see
+  /// measureInterleaved.
+  ExitStatus run(BenchmarkFn fn, int numRuns, const HarnessArgs &args,
+                 const Interleaving &interleave, const StoppingRule &rule,
+                 const EventGroup &events,
+                 const MemoryMode &memory, llvm::ArrayRef<void *> addresses,
+                 llvm::SmallVectorImpl<BenchmarkResult> &samples);
+
+  /// Pages mapped and the reason to stop of the last run.
+  const HarnessLog &getLog() const;
+
+  ~MeasurementWorker();
+
+private:
+  MeasurementWorker(int cpu, CountersBackend backend);
+
+  bool spawn();
+  void reap();
+
+  std::mutex mMutex;
+  int mCPU;
+  CountersBackend mBackend;
+  size_t mSharedSize;
+  WorkerControl *mControl;
+  SampleRing *mRing;
+  pid_t mPid = -1;
+  int mPidFD = -1;
+  int mRequestFD = -1;
+  int mResponseFD = -1;
+};
+} // namespace llvm_ml
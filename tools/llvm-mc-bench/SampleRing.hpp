@@ -0,0 +1,117 @@
+//===--- SampleRing.hpp - Shared memory queue of samples --------------C++-===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "BenchmarkResult.hpp"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace llvm_ml {
+/// Number of samples a ring holds. The parent drains the ring every
+/// kSampleRingDrainMS milliseconds, so it only has to cover the runs in
+/// between.
+constexpr size_t kSampleRingCapacity = 64;
+constexpr int kSampleRingDrainMS = 1;
+
+/// SampleRing is a single-producer single-consumer queue of samples, that
+/// lives in memory shared between the harness process and the parent. The
+/// harness writes fixed-layout records in place, the parent drains them, while
+/// the harness is still running. Neither side allocates or takes locks, so the
+/// number of samples is not bound by the size of the ring.
+class SampleRing {
+public:
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "ring indices are shared between processes");
+
+  /// Returns the number of bytes a ring of \p capacity samples takes.
+  static size_t getAllocationSize(size_t capacity) {
+    return sizeof(SampleRing) + capacity * sizeof(BenchmarkResult);
+  }
+
+  /// Constructs an empty ring in \p memory of getAllocationSize(capacity)
+  /// bytes. \p capacity must be a power of two.
+  static SampleRing *create(void *memory, size_t capacity) {
+    assert(llvm::isPowerOf2_64(capacity) && "capacity must be a power of two");
+    return new (memory) SampleRing(capacity);
+  }
+
+  /// Returns the slot for the \p index-th sample after the last committed
+  /// one, spinning while the ring has no room for it. The sample is only
+  /// visible to the consumer after commit().
+  BenchmarkResult &claim(unsigned index = 0) {
+    assert(index < mCapacity && "claimed past the end of the ring");
+    const uint64_t head = mHead.load(std::memory_order_relaxed) + index;
+    while (head - mTail.load(std::memory_order_acquire) >= mCapacity)
+      relax();
+
+    BenchmarkResult &slot = getSlots()[head & (mCapacity - 1)];
+    slot = BenchmarkResult{};
+    return slot;
+  }
+
+  /// Returns true if the ring has no room for another sample, so that
+  /// claim() would spin.
+  bool isFull() const {
+    return mHead.load(std::memory_order_relaxed) -
+               mTail.load(std::memory_order_acquire) >=
+           mCapacity;
+  }
+
+  /// Publishes \p count claimed samples.
+  void commit(unsigned count = 1) {
+    mHead.store(mHead.load(std::memory_order_relaxed) + count,
+                std::memory_order_release);
+  }
+
+  /// Appends all published samples to \p samples. Returns the number of
+  /// samples taken.
+  size_t drain(llvm::SmallVectorImpl<BenchmarkResult> &samples) {
+    const uint64_t tail = mTail.load(std::memory_order_relaxed);
+    const uint64_t head = mHead.load(std::memory_order_acquire);
+
+    for (uint64_t i = tail; i != head; i++)
+      samples.push_back(getSlots()[i & (mCapacity - 1)]);
+
+    mTail.store(head, std::memory_order_release);
+    return head - tail;
+  }
+
+  /// Drops unread samples. Must not race with a producer.
+  void reset() {
+    mHead.store(0, std::memory_order_relaxed);
+    mTail.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  explicit SampleRing(size_t capacity) : mCapacity(capacity) {}
+
+  BenchmarkResult *getSlots() {
+    return reinterpret_cast<BenchmarkResult *>(this + 1);
+  }
+
+  /// Tells the core, that the thread spins.
+  static void relax() {
+#if defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  /// Indices only grow, the slot is the index modulo capacity. Producer and
+  /// consumer indices live on separate cache lines.
+  alignas(64) std::atomic<uint64_t> mHead{0};
+  alignas(64) std::atomic<uint64_t> mTail{0};
+  alignas(64) const uint64_t mCapacity;
+};
+} // namespace llvm_ml
@@ -0,0 +1,96 @@
+//===--- Scheduler.hpp - Measurement task scheduling ------------------C++-===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace llvm_ml {
+/// WorkStealingQueue keeps a dedicated queue of tasks for every measurement
+/// core. A core takes tasks from the front of its own queue and, once that
+/// runs dry, steals from the back of the longest queue of the other cores, so
+/// that a single slow task never leaves the remaining cores idle.
+///
+/// The queue holds at most \p capacity tasks in total. Producers block until
+/// the cores free up a slot, which bounds the memory held by tasks that are
+/// prepared ahead of time.
+template <typename T> class WorkStealingQueue {
+public:
+  explicit WorkStealingQueue(
+      size_t numQueues, size_t capacity = std::numeric_limits<size_t>::max())
+      : mQueues(numQueues), mCapacity(capacity) {}
+
+  /// Adds \p task to the queue of core \p queue. Blocks while the queue is
+  /// full.
+  void push(size_t queue, T task) {
+    {
+      std::unique_lock lock(mMutex);
+      mNotFull.wait(lock, [this] { return mSize < mCapacity; });
+      mQueues[queue].push_back(std::move(task));
+      mSize++;
+    }
+    mCondVar.notify_all();
+  }
+
+  /// Signals that no more tasks will be pushed.
+  void close() {
+    {
+      std::lock_guard lock(mMutex);
+      mClosed = true;
+    }
+    mCondVar.notify_all();
+  }
+
+  /// Returns the next task for core \p queue, blocking until there is one.
+  /// Returns std::nullopt once the queue is closed and all tasks are taken.
+  std::optional<T> pop(size_t queue) {
+    std::unique_lock lock(mMutex);
+
+    while (true) {
+      if (!mQueues[queue].empty()) {
+        T task = std::move(mQueues[queue].front());
+        mQueues[queue].pop_front();
+        mSize--;
+        mNotFull.notify_one();
+        return task;
+      }
+
+      std::deque<T> *victim = nullptr;
+      for (auto &other : mQueues) {
+        if (!other.empty() && (!victim || other.size() > victim->size()))
+          victim = &other;
+      }
+
+      if (victim) {
+        T task = std::move(victim->back());
+        victim->pop_back();
+        mSize--;
+        mNotFull.notify_one();
+        return task;
+      }
+
+      if (mClosed)
+        return std::nullopt;
+
+      mCondVar.wait(lock);
+    }
+  }
+
+private:
+  std::mutex mMutex;
+  std::condition_variable mCondVar;
+  std::condition_variable mNotFull;
+  std::vector<std::deque<T>> mQueues;
+  size_t mCapacity;
+  size_t mSize = 0;
+  bool mClosed = false;
+};
+} // namespace llvm_ml
@@ -10,20 +10,39 @@
 #include "pmu/pmu.hpp"
 
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/TargetParser/Host.h"
 #include "llvm/Support/raw_ostream.h"
 
-#include <functional>
+#include <algorithm>
 #include <memory>
+#include <optional>
 #include <vector>
 
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#endif
+
+#if defined(__linux__) && defined(__x86_64__)
+#include <cstring>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include "counters.hpp"
+#include "BenchmarkResult.hpp"
 
 namespace llvm_ml {
 class CountersContext {
 public:
   virtual void start() = 0;
   virtual void stop() = 0;
-  virtual void flush() = 0;
+  virtual void flush(BenchmarkResult &result) = 0;
   virtual void prefetch() = 0;
 
   virtual ~CountersContext() = default;
@@ -31,32 +50,56 @@ public:
 
 class DummyCounters : public CountersContext {
 public:
-  DummyCounters(CountersCb cb) : mCB(cb) {}
+  DummyCounters(const EventGroup &events) : mEvents(events) {}
 
   void start() override {}
   void stop() override {}
 
-  void flush() override {
-    llvm::SmallVector<CounterValue> counters;
-    counters.push_back(CounterValue{.type = Counter::Cycles, .value = 10});
-    counters.push_back(
-        CounterValue{.type = Counter::Instructions, .value = 20});
-    counters.push_back(CounterValue{.type = Counter::CacheMisses, .value = 0});
-    counters.push_back(
-        CounterValue{.type = Counter::ContextSwitches, .value = 0});
-
-    mCB(counters);
+  void flush(BenchmarkResult &result) override {
+    result.numCycles = 10;
+    result.numInstructions = 20;
+    result.numCacheMisses = 0;
+    result.numContextSwitches = 0;
+    for (unsigned i = 0; i < mEvents.numEvents; i++) {
+      const Event &event = mEvents.events[i];
+      result.events[mEvents.first + i] =
+          event.isTopdown ? getTopdownSlots(event.config) * result.numRuns : 5;
+    }
   }
 
   void prefetch() override {}
 
 private:
-  CountersCb mCB;
+  /// Slots per block iteration of the events getTopdownEvents returns, so
+  /// that the workload takes more of them than the baseline.
+  static uint64_t getTopdownSlots(uint64_t config) {
+    switch (config) {
+    case 0x0400: // slots
+      return 10;
+    case 0x8000: // retiring
+      return 4;
+    case 0x8100: // bad speculation
+      return 1;
+    case 0x8200: // frontend bound
+      return 2;
+    case 0x8300: // backend bound
+      return 3;
+    case 0x8400: // heavy operations
+    case 0x8500: // branch mispredicts
+    case 0x8600: // fetch latency
+      return 1;
+    case 0x8700: // memory bound
+      return 2;
+    }
+    return 0;
+  }
+
+  EventGroup mEvents;
 };
 
 class PMUCountersContext : public CountersContext {
 public:
-  PMUCountersContext(CountersCb cb) : mCB(cb) {
+  PMUCountersContext() {
     pmu::Builder builder;
     builder.add_counter(pmu::CounterKind::Cycles)
         .add_counter(pmu::CounterKind::Instructions)
@@ -71,30 +114,18 @@ public:
 
   void stop() override { mCounters->stop(); }
 
-  void flush() override {
-    llvm::SmallVector<CounterValue> counters;
-
+  void flush(BenchmarkResult &result) override {
     for (auto value : *mCounters) {
       if (value.name.starts_with("cycles")) {
-        counters.push_back(
-            CounterValue{.type = Counter::Cycles,
-                         .value = static_cast<size_t>(value.value)});
+        result.numCycles = value.value;
       } else if (value.name.starts_with("instructions")) {
-        counters.push_back(
-            CounterValue{.type = Counter::Instructions,
-                         .value = static_cast<size_t>(value.value)});
+        result.numInstructions = value.value;
       } else if (value.name.starts_with("cache")) {
-        counters.push_back(
-            CounterValue{.type = Counter::CacheMisses,
-                         .value = static_cast<size_t>(value.value)});
+        result.numCacheMisses = value.value;
       } else if (value.name.starts_with("SW:context_switches")) {
-        counters.push_back(
-            CounterValue{.type = Counter::ContextSwitches,
-                         .value = static_cast<size_t>(value.value)});
+        result.numContextSwitches = value.value;
       }
     }
-
-    mCB(counters);
   }
 
   void prefetch() override {
@@ -103,19 +134,656 @@ public:
   }
 
 private:
-  CountersCb mCB;
   std::unique_ptr<pmu::Counters> mCounters;
 };
 
-void flushCounters(CountersContext *ctx) { ctx->flush(); }
+#if defined(__linux__) && defined(__x86_64__)
+/// Counts events of a single perf event group, that stays enabled for the
+/// lifetime of the context. Start and stop read hardware counters with rdpmc,
+/// so that no system call lands inside of the measured region, or read the
+/// group if the kernel does not allow rdpmc. Top-down events are read with
+/// rdpmc as well, the slots from their fixed counter and the metrics as
+/// fractions of them, as Documentation/arch/x86/topdown.rst describes.
+/// Software events can not be read this way, flush takes them from the group
+/// read, which spans the whole harness run. Top-down events require the slots
+/// event to lead the group, the default events follow it then.
+class RdpmcCountersContext : public CountersContext {
+  struct OpenEvent {
+    /// Field of BenchmarkResult the value goes to, nullptr for events.
+    uint64_t BenchmarkResult::*field;
+    unsigned index;
+    /// Software events are read from the group.
+    bool isGroupRead;
+    /// Slots or one of the metrics, config tells which.
+    bool isTopdown;
+    uint64_t config;
+    int fd;
+    perf_event_mmap_page *page;
+  };
+
+  /// rdpmc indices of the slots fixed counter and of the PERF_METRICS
+  /// register.
+  static constexpr int kRdpmcSlots = (1 << 30) | 3;
+  static constexpr int kRdpmcMetrics = 1 << 29;
+
+  struct DefaultEvent {
+    uint64_t BenchmarkResult::*field;
+    uint32_t perfType;
+    uint64_t config;
+  };
+
+  static constexpr DefaultEvent kDefaultEvents[] = {
+      {&BenchmarkResult::numCycles, PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_CPU_CYCLES},
+      {&BenchmarkResult::numInstructions, PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_INSTRUCTIONS},
+      {&BenchmarkResult::numCacheMisses, PERF_TYPE_HW_CACHE,
+       PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+      {&BenchmarkResult::numContextSwitches, PERF_TYPE_SOFTWARE,
+       PERF_COUNT_SW_CONTEXT_SWITCHES},
+  };
+
+public:
+  /// Returns nullptr if the events can not be opened.
+  static std::unique_ptr<RdpmcCountersContext>
+  create(const EventGroup &events) {
+    std::unique_ptr<RdpmcCountersContext> ctx(new RdpmcCountersContext());
+    if (!ctx->open(events))
+      return nullptr;
+    return ctx;
+  }
+
+  ~RdpmcCountersContext() override {
+    for (const auto &event : mEvents) {
+      if (event.page)
+        munmap(event.page, sysconf(_SC_PAGE_SIZE));
+      close(event.fd);
+    }
+  }
+
+  void start() override { readHardwareCounters(mStart); }
+
+  void stop() override { readHardwareCounters(mStop); }
+
+  void flush(BenchmarkResult &result) override {
+    readGroup(mValues);
+
+    for (size_t i = 0; i < mEvents.size(); i++) {
+      const OpenEvent &event = mEvents[i];
+      // Hardware events keep what start and stop read, either with rdpmc or
+      // from the group.
+      if (event.isGroupRead) {
+        mStart[i] = mLastGroup[i];
+        mStop[i] = mValues[i];
+      }
+      mLastGroup[i] = mValues[i];
+
+      // Metrics are only 8 bits precise, the stop value may fall short.
+      const uint64_t value = mStop[i] > mStart[i] ? mStop[i] - mStart[i] : 0;
+      if (event.field)
+        result.*event.field = value;
+      else
+        result.events[event.index] = value;
+    }
+  }
+
+  void prefetch() override {
+    __builtin_prefetch(this, 0, 3);
+    __builtin_prefetch(mEvents.data(), 0, 3);
+    for (const auto &event : mEvents) {
+      if (event.page)
+        __builtin_prefetch(event.page, 0, 3);
+    }
+  }
+
+private:
+  RdpmcCountersContext() = default;
+
+  bool open(const EventGroup &events) {
+    const auto openEvents = [&](bool isTopdown) {
+      for (unsigned i = 0; i < events.numEvents; i++) {
+        const Event &event = events.events[i];
+        if (event.isTopdown == isTopdown &&
+            !openEvent(nullptr, events.first + i, event.type, event.config,
+                       /*isGroupRead=*/false, isTopdown))
+          return false;
+      }
+      return true;
+    };
+
+    if (!openEvents(/*isTopdown=*/true))
+      return false;
+    for (const auto &event : kDefaultEvents) {
+      if (!openEvent(event.field, 0, event.perfType, event.config,
+                     event.perfType == PERF_TYPE_SOFTWARE,
+                     /*isTopdown=*/false))
+        return false;
+    }
+    if (!openEvents(/*isTopdown=*/false))
+      return false;
+
+    const size_t numEvents = mEvents.size();
+    mStart.resize(numEvents);
+    mStop.resize(numEvents);
+    mLastGroup.resize(numEvents);
+    mValues.resize(numEvents);
+    mGroup.resize(numEvents + 1);
+
+    if (ioctl(mEvents.front().fd, PERF_EVENT_IOC_ENABLE,
+              PERF_IOC_FLAG_GROUP) != 0)
+      return false;
+
+    readGroup(mLastGroup);
+    return true;
+  }
+
+  bool openEvent(uint64_t BenchmarkResult::*field, unsigned index,
+                 uint32_t perfType, uint64_t config, bool isGroupRead,
+                 bool isTopdown) {
+    const bool isLeader = mEvents.empty();
+
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perfType;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = isLeader;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    const int fd = syscall(SYS_perf_event_open, &attr, 0, -1,
+                           isLeader ? -1 : mEvents.front().fd, 0);
+    if (fd < 0) {
+      llvm::errs() << "Failed to open perf event " << perfType << ":"
+                   << llvm::format_hex(config, 0) << ": " << strerror(errno)
+                   << "\n";
+      return false;
+    }
+
+    mEvents.push_back(OpenEvent{.field = field,
+                                .index = index,
+                                .isGroupRead = isGroupRead,
+                                .isTopdown = isTopdown,
+                                .config = config,
+                                .fd = fd,
+                                .page = nullptr});
+    mHasTopdown |= isTopdown;
+    if (isGroupRead)
+      return true;
+
+    void *page =
+        mmap(nullptr, sysconf(_SC_PAGE_SIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+      llvm::errs() << "Failed to map perf event page: " << strerror(errno)
+                   << "\n";
+      return false;
+    }
+    mEvents.back().page = static_cast<perf_event_mmap_page *>(page);
+    mUseRdpmc &= mEvents.back().page->cap_user_rdpmc;
+
+    return true;
+  }
+
+  void readGroup(llvm::MutableArrayRef<uint64_t> values) {
+    const ssize_t size = mGroup.size() * sizeof(uint64_t);
+    if (read(mEvents.front().fd, mGroup.data(), size) != size) {
+      std::fill(values.begin(), values.end(), 0);
+      return;
+    }
+    // The first value is the number of events in the group.
+    std::copy(mGroup.begin() + 1, mGroup.end(), values.begin());
+  }
+
+  /// Reads a counter without leaving user space, following the protocol
+  /// described in linux/perf_event.h.
+  static uint64_t readPMC(const perf_event_mmap_page *page) {
+    uint32_t seq;
+    uint64_t count;
+    do {
+      seq = page->lock;
+      __atomic_signal_fence(__ATOMIC_SEQ_CST);
+      const uint32_t index = page->index;
+      count = page->offset;
+      if (index != 0) {
+        const unsigned shift = 64 - page->pmc_width;
+        int64_t pmc = __builtin_ia32_rdpmc(index - 1);
+        count += static_cast<uint64_t>((pmc << shift) >> shift);
+      }
+      __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    } while (page->lock != seq);
+
+    return count;
+  }
+
+  /// Returns the slots of the top-down event of \p config out of \p slots
+  /// and the fractions of them in \p metrics, a byte per metric.
+  static uint64_t getTopdownValue(uint64_t config, uint64_t slots,
+                                  uint64_t metrics) {
+    if (config == 0x0400)
+      return slots;
+    const unsigned byte = ((config >> 8) & 0xff) - 0x80;
+    return slots * ((metrics >> (8 * byte)) & 0xff) / 0xff;
+  }
+
+  void readHardwareCounters(llvm::MutableArrayRef<uint64_t> values) {
+    if (!mUseRdpmc) {
+      readGroup(values);
+      return;
+    }
+
+    // Both count from the last time the kernel reset them, on the group read
+    // of every flush, so metrics of start and stop are fractions of different
+    // slots.
+    uint64_t slots = 0;
+    uint64_t metrics = 0;
+    if (mHasTopdown) {
+      slots = __builtin_ia32_rdpmc(kRdpmcSlots);
+      metrics = __builtin_ia32_rdpmc(kRdpmcMetrics);
+    }
+
+    for (size_t i = 0; i < mEvents.size(); i++) {
+      const OpenEvent &event = mEvents[i];
+      if (event.isTopdown)
+        values[i] = getTopdownValue(event.config, slots, metrics);
+      else if (event.page)
+        values[i] = readPMC(event.page);
+    }
+  }
+
+  /// The group leader goes first.
+  llvm::SmallVector<OpenEvent, 12> mEvents;
+  /// rdpmc is allowed for all hardware events.
+  bool mUseRdpmc = true;
+  bool mHasTopdown = false;
+  llvm::SmallVector<uint64_t, 12> mStart;
+  llvm::SmallVector<uint64_t, 12> mStop;
+  llvm::SmallVector<uint64_t, 12> mLastGroup;
+  llvm::SmallVector<uint64_t, 12> mValues;
+  /// Buffer of PERF_FORMAT_GROUP reads.
+  llvm::SmallVector<uint64_t, 13> mGroup;
+};
+#endif
+
+CPUVendor getHostCPUVendor() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_is("intel"))
+    return CPUVendor::Intel;
+  if (__builtin_cpu_is("amd"))
+    return CPUVendor::AMD;
+#endif
+  return CPUVendor::Unknown;
+}
+
+#if defined(__linux__)
+/// Returns the raw event code of a vendor-specific event, std::nullopt if the
+/// vendor has no such event.
+static std::optional<Event> getVendorEvent(llvm::StringRef name,
+                                           CPUVendor vendor) {
+  if (name == "uops") {
+    // UOPS_RETIRED.RETIRE_SLOTS, Retired Uops.
+    if (vendor == CPUVendor::Intel)
+      return Event{PERF_TYPE_RAW, 0x02c2};
+    if (vendor == CPUVendor::AMD)
+      return Event{PERF_TYPE_RAW, 0xc1};
+  } else if (name == "misaligned_loads") {
+    // Misaligned Loads, Intel dropped MISALIGN_MEM_REF after Ivy Bridge.
+    if (vendor == CPUVendor::AMD)
+      return Event{PERF_TYPE_RAW, 0x47};
+  }
+  return std::nullopt;
+}
+
+static llvm::Error parseEvent(llvm::StringRef name, CPUVendor vendor,
+                              llvm::SmallVectorImpl<EventSpec> &events) {
+  if (name.consume_front("@")) {
+    CPUVendor presetVendor = llvm::StringSwitch<CPUVendor>(name)
+                                 .Case("auto", getHostCPUVendor())
+                                 .Case("intel", CPUVendor::Intel)
+                                 .Case("amd", CPUVendor::AMD)
+                                 .Default(CPUVendor::Unknown);
+    if (presetVendor == CPUVendor::Unknown && name != "auto")
+      return llvm::createStringError(std::errc::invalid_argument,
+                                     "Unknown event preset @%s",
+                                     name.str().c_str());
+
+    llvm::SmallVector<llvm::StringRef> preset = {"branch_misses"};
+    if (presetVendor == CPUVendor::Intel)
+      preset = {"uops", "branch_misses"};
+    else if (presetVendor == CPUVendor::AMD)
+      preset = {"uops", "misaligned_loads", "branch_misses"};
+
+    for (auto presetName : preset) {
+      if (auto err = parseEvent(presetName, presetVendor, events))
+        return err;
+    }
+    return llvm::Error::success();
+  }
+
+  uint64_t code;
+  if (name.startswith("r") && !name.drop_front().getAsInteger(16, code)) {
+    events.push_back(EventSpec{.name = name.str(),
+                               .counter = Counter::Event,
+                               .event = Event{PERF_TYPE_RAW, code}});
+    return llvm::Error::success();
+  }
+
+  std::optional<Event> event =
+      llvm::StringSwitch<std::optional<Event>>(name)
+          .Case("branch_misses",
+                Event{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES})
+          .Case("llc_misses",
+                Event{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES})
+          .Case("ref_cycles",
+                Event{PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES})
+          .Default(getVendorEvent(name, vendor));
+  if (!event)
+    return llvm::createStringError(std::errc::invalid_argument,
+                                   "Unknown event %s for this CPU",
+                                   name.str().c_str());
+
+  const Counter counter =
+      llvm::StringSwitch<Counter>(name)
+          .Case("uops", Counter::MicroOps)
+          .Case("misaligned_loads", Counter::MisalignedLoads)
+          .Case("ref_cycles", Counter::RefCycles)
+          .Default(Counter::Event);
+  events.push_back(
+      EventSpec{.name = name.str(), .counter = counter, .event = *event});
+  return llvm::Error::success();
+}
+#endif
+
+llvm::Expected<llvm::SmallVector<EventSpec>> parseEvents(llvm::StringRef spec,
+                                                        CPUVendor vendor) {
+  llvm::SmallVector<EventSpec> events;
+  llvm::SmallVector<llvm::StringRef> names;
+  spec.split(names, ',', -1, false);
+
+#if defined(__linux__)
+  for (auto name : names) {
+    if (auto err = parseEvent(name.trim(), vendor, events))
+      return std::move(err);
+  }
+#else
+  if (!names.empty())
+    return llvm::createStringError(std::errc::not_supported,
+                                   "Events are only supported on Linux");
+#endif
+
+  if (events.size() > MAX_EVENTS)
+    return llvm::createStringError(std::errc::invalid_argument,
+                                   "At most %u events are supported",
+                                   MAX_EVENTS);
+
+  return events;
+}
+
+#if defined(__linux__)
+/// Returns the sysfs directory of the PMU with core events, cpu_core on
+/// hybrid CPUs.
+static std::string getCorePMUPath() {
+  const std::string hybrid = "/sys/bus/event_source/devices/cpu_core";
+  if (llvm::sys::fs::exists(hybrid))
+    return hybrid;
+  return "/sys/bus/event_source/devices/cpu";
+}
+#endif
+
+llvm::SmallVector<EventSpec> getTopdownEvents() {
+  llvm::SmallVector<EventSpec> events;
+
+#if defined(__linux__)
+  const std::string pmuPath = getCorePMUPath();
+  const bool isMock = std::getenv("LLVM_ML_BENCH_MOCK") != nullptr;
+
+  if (isMock || llvm::sys::fs::exists(pmuPath + "/events/topdown-retiring")) {
+    uint32_t type = PERF_TYPE_RAW;
+    if (auto buffer = llvm::MemoryBuffer::getFile(pmuPath + "/type"))
+      (void)(*buffer)->getBuffer().trim().getAsInteger(10, type);
+
+    const auto add = [&](llvm::StringRef name, uint64_t config) {
+      events.push_back(EventSpec{.name = name.str(),
+                                 .counter = Counter::Event,
+                                 .event = Event{type, config, true}});
+    };
+
+    add("slots", 0x0400);
+    add("topdown_retiring", 0x8000);
+    add("topdown_bad_spec", 0x8100);
+    add("topdown_fe_bound", 0x8200);
+    add("topdown_be_bound", 0x8300);
+    if (isMock ||
+        llvm::sys::fs::exists(pmuPath + "/events/topdown-heavy-ops")) {
+      add("topdown_heavy_ops", 0x8400);
+      add("topdown_br_mispredict", 0x8500);
+      add("topdown_fetch_lat", 0x8600);
+      add("topdown_mem_bound", 0x8700);
+    }
+    return events;
+  }
+
+  // INT_MISC.RECOVERY_CYCLES, the only one of the level 1 events, whose
+  // encoding differs between the cores below. Atom cores and other vendors
+  // have none of them.
+  const std::optional<uint64_t> recoveryCycles =
+      llvm::StringSwitch<std::optional<uint64_t>>(llvm::sys::getHostCPUName())
+          .Cases("sandybridge", "ivybridge", "haswell", "broadwell",
+                 0x0100030d)
+          .Cases("skylake", "skylake-avx512", "cascadelake", "cooperlake",
+                 0x010d)
+          .Default(std::nullopt);
+  if (getHostCPUVendor() == CPUVendor::Intel && recoveryCycles) {
+    // IDQ_UOPS_NOT_DELIVERED.CORE, UOPS_ISSUED.ANY and
+    // UOPS_RETIRED.RETIRE_SLOTS.
+    events.push_back(EventSpec{.name = "idq_uops_not_delivered",
+                               .counter = Counter::Event,
+                               .event = Event{PERF_TYPE_RAW, 0x019c}});
+    events.push_back(EventSpec{.name = "uops_issued",
+                               .counter = Counter::Event,
+                               .event = Event{PERF_TYPE_RAW, 0x010e}});
+    events.push_back(EventSpec{.name = "uops",
+                               .counter = Counter::MicroOps,
+                               .event = Event{PERF_TYPE_RAW, 0x02c2}});
+    events.push_back(EventSpec{.name = "recovery_cycles",
+                               .counter = Counter::Event,
+                               .event = Event{PERF_TYPE_RAW, *recoveryCycles}});
+  }
+#endif
+
+  return events;
+}
+
+#if defined(__linux__) && defined(__x86_64__)
+/// Returns true if every CPU of \p cpus has the events of the core PMU. On
+/// hybrid CPUs, the efficient cores have a PMU of their own.
+static bool hasCorePMU(llvm::ArrayRef<int> cpus) {
+  auto buffer = llvm::MemoryBuffer::getFile(getCorePMUPath() + "/cpus");
+  if (!buffer)
+    return true;
+
+  // Lists look like 0-15 or 0,2,4-7.
+  llvm::SmallVector<llvm::StringRef> ranges;
+  (*buffer)->getBuffer().trim().split(ranges, ',');
+  return llvm::all_of(cpus, [&](int cpu) {
+    return llvm::any_of(ranges, [&](llvm::StringRef range) {
+      auto [first, last] = range.split('-');
+      int begin, end;
+      if (first.getAsInteger(10, begin))
+        return false;
+      end = begin;
+      if (!last.empty() && last.getAsInteger(10, end))
+        return false;
+      return cpu >= begin && cpu <= end;
+    });
+  });
+}
+
+/// Returns true if the kernel accepts \p event for the calling process.
+static bool canOpenEvent(const Event &event) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0)
+    return false;
+  close(fd);
+  return true;
+}
+#endif
+
+llvm::SmallVector<EventSpec> getPortEvents(llvm::ArrayRef<int> cpus) {
+  llvm::SmallVector<EventSpec> events;
+
+#if defined(__linux__) && defined(__x86_64__)
+  struct PortEvent {
+    const char *name;
+    uint8_t umask;
+  };
+
+  // UOPS_DISPATCHED_PORT on Haswell through Cascade Lake.
+  static constexpr PortEvent kSkylakePorts[] = {
+      {"port_0", 0x01}, {"port_1", 0x02}, {"port_2", 0x04}, {"port_3", 0x08},
+      {"port_4", 0x10}, {"port_5", 0x20}, {"port_6", 0x40}, {"port_7", 0x80},
+  };
+  // UOPS_DISPATCHED on Ice Lake through Rocket Lake, that share some
+  // counters between ports.
+  static constexpr PortEvent kIcelakePorts[] = {
+      {"port_0", 0x01},   {"port_1", 0x02}, {"port_2_3", 0x04},
+      {"port_4_9", 0x10}, {"port_5", 0x20}, {"port_6", 0x40},
+      {"port_7_8", 0x80},
+  };
+  // UOPS_DISPATCHED on Golden Cove and later, with the ports added to the
+  // shared counters.
+  static constexpr PortEvent kGoldenCovePorts[] = {
+      {"port_0", 0x01},   {"port_1", 0x02},    {"port_2_3_10", 0x04},
+      {"port_4_9", 0x10}, {"port_5_11", 0x20}, {"port_6", 0x40},
+      {"port_7_8", 0x80},
+  };
+
+  // Mock counters pretend to run on a Golden Cove core.
+  const bool isMock = std::getenv("LLVM_ML_BENCH_MOCK") != nullptr;
+
+  enum class Layout { None, Skylake, Icelake, GoldenCove };
+  const Layout layout =
+      isMock ? Layout::GoldenCove
+             : llvm::StringSwitch<Layout>(llvm::sys::getHostCPUName())
+                   .Cases("haswell", "broadwell", "skylake", "skylake-avx512",
+                          "cascadelake", "cooperlake", Layout::Skylake)
+                   .Cases("icelake-client", "icelake-server", "tigerlake",
+                          "rocketlake", Layout::Icelake)
+                   .Cases("alderlake", "raptorlake", "sapphirerapids",
+                          "emeraldrapids", Layout::GoldenCove)
+                   .Default(Layout::None);
+
+  llvm::ArrayRef<PortEvent> ports;
+  if (layout == Layout::Skylake)
+    ports = kSkylakePorts;
+  else if (layout == Layout::Icelake)
+    ports = kIcelakePorts;
+  else if (layout == Layout::GoldenCove)
+    ports = kGoldenCovePorts;
+  const uint8_t eventCode = layout == Layout::GoldenCove ? 0xb2 : 0xa1;
+
+  for (const auto &port : ports) {
+    events.push_back(EventSpec{
+        .name = port.name,
+        .counter = Counter::Event,
+        .event = Event{PERF_TYPE_RAW,
+                       static_cast<uint64_t>(port.umask) << 8 | eventCode}});
+  }
+
+  // The model name does not tell whether the kernel exposes the events, nor
+  // which cores of a hybrid CPU have them.
+  if (!isMock && (!hasCorePMU(cpus) ||
+                  !llvm::all_of(events, [](const EventSpec &spec) {
+                    return canOpenEvent(spec.event);
+                  })))
+    events.clear();
+#endif
+
+  return events;
+}
+
+std::vector<EventGroup> scheduleEvents(llvm::ArrayRef<EventSpec> events,
+                                       unsigned numSlots) {
+  assert(numSlots > 0 && "at least one counter slot is required");
+
+  std::vector<EventGroup> groups(1);
+  unsigned usedSlots = 0;
+  for (unsigned i = 0; i < events.size(); i++) {
+    const bool isTopdown = events[i].event.isTopdown;
+    assert((!isTopdown || groups.size() == 1) &&
+           "top-down events must go first");
+
+    if (!isTopdown && usedSlots == numSlots) {
+      groups.emplace_back();
+      groups.back().first = i;
+      usedSlots = 0;
+    }
+    EventGroup &group = groups.back();
+    group.events[group.numEvents++] = events[i].event;
+    if (!isTopdown)
+      usedSlots++;
+  }
+
+  return groups;
+}
+
+void flushCounters(CountersContext *ctx, BenchmarkResult &result) {
+  ctx->flush(result);
+}
 
 void prefetchCounters(CountersContext *ctx) { ctx->prefetch(); }
 
-std::shared_ptr<CountersContext> createCounters(CountersCb cb) {
+llvm::Expected<CountersBackend>
+probeCounters(CountersBackend backend, llvm::ArrayRef<EventGroup> groups) {
+  if (backend != CountersBackend::RDPMC ||
+      std::getenv("LLVM_ML_BENCH_MOCK") != nullptr)
+    return backend;
+
+  const bool hasEvents = llvm::any_of(
+      groups, [](const EventGroup &group) { return group.numEvents != 0; });
+
+#if defined(__linux__) && defined(__x86_64__)
+  const bool canOpen = llvm::all_of(groups, [](const EventGroup &group) {
+    return RdpmcCountersContext::create(group) != nullptr;
+  });
+  if (canOpen)
+    return backend;
+#endif
+
+  // libpmu would silently count 0 for every event.
+  if (hasEvents)
+    return llvm::createStringError(
+        std::errc::not_supported,
+        "Failed to open the perf event group of the requested events");
+
+  llvm::errs() << "Falling back to libpmu counters\n";
+  return CountersBackend::PMU;
+}
+
+std::shared_ptr<CountersContext> createCounters(CountersBackend backend,
+                                                const EventGroup &events) {
   if (std::getenv("LLVM_ML_BENCH_MOCK") != nullptr)
-    return std::make_shared<DummyCounters>(std::move(cb));
+    return std::make_shared<DummyCounters>(events);
+
+#if defined(__linux__) && defined(__x86_64__)
+  // probeCounters has checked that the group opens.
+  if (backend == CountersBackend::RDPMC) {
+    if (auto ctx = RdpmcCountersContext::create(events))
+      return ctx;
+  }
+#endif
 
-  return std::make_shared<PMUCountersContext>(std::move(cb));
+  return std::make_shared<PMUCountersContext>();
 }
 
 } // namespace llvm_ml
@@ -5,10 +5,17 @@
 #pragma once
 
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
 
 #include <cstdint>
-#include <functional>
 #include <memory>
+#include <string>
+#include <vector>
+
+/// Maximum number of events counted in addition to the default counters.
+constexpr unsigned MAX_EVENTS = 20;
 
 namespace llvm_ml {
 enum class Counter {
@@ -18,20 +25,110 @@ enum class Counter {
   ContextSwitches,
   CacheMisses,
   MisalignedLoads,
+  RefCycles,
+  /// Event of the user-defined event list.
+  Event,
+};
+
+enum class CPUVendor {
+  Unknown,
+  Intel,
+  AMD,
+};
+
+CPUVendor getHostCPUVendor();
+
+/// Hardware event in terms of perf_event_attr type and config.
+struct Event {
+  uint32_t type;
+  uint64_t config;
+  /// Slots or a PERF_METRICS event. These only count in a group led by the
+  /// slots event and can not be read with rdpmc.
+  bool isTopdown = false;
+
+  bool operator==(const Event &other) const {
+    return type == other.type && config == other.config &&
+           isTopdown == other.isTopdown;
+  }
 };
 
-struct CounterValue {
-  Counter type;
-  size_t value;
+/// EventSpec is an event of the event list requested by the user.
+struct EventSpec {
+  std::string name;
+  /// Default counter the event is also reported as, Counter::Event if none.
+  Counter counter;
+  Event event;
 };
 
-using CountersCb = std::function<void(llvm::ArrayRef<CounterValue>)>;
+/// Events counted together during a single pass. EventGroup is copied to
+/// harness processes, so it only holds plain data.
+struct EventGroup {
+  /// Index of the first event of the group in the event list.
+  unsigned first = 0;
+  unsigned numEvents = 0;
+  Event events[MAX_EVENTS] = {};
+
+  bool operator==(const EventGroup &other) const {
+    return first == other.first &&
+           llvm::ArrayRef(events, numEvents) ==
+               llvm::ArrayRef(other.events, other.numEvents);
+  }
+};
+
+/// Parses a comma-separated list of events. Every entry is either a named
+/// event (uops, misaligned_loads, branch_misses, llc_misses, ref_cycles), a
+/// raw event code in the form of r<hex>, or a preset of events for a CPU
+/// vendor: @intel, @amd or @auto for the host CPU. Vendor-specific events are
+/// resolved for \p vendor, or for the vendor of the preset.
+llvm::Expected<llvm::SmallVector<EventSpec>>
+parseEvents(llvm::StringRef spec, CPUVendor vendor = getHostCPUVendor());
+
+/// Returns the events top-down analysis needs on the host CPU: the slots and
+/// PERF_METRICS events if the PMU has them, or the events of the level 1
+/// formulas on Intel cores known to have them. The slots event goes first.
+/// Returns an empty list if the CPU has neither.
+llvm::SmallVector<EventSpec> getTopdownEvents();
+
+/// Returns the events, that count micro-ops dispatched to every execution port
+/// of the host CPU, named port_<ports>. Returns an empty list if the CPU model
+/// is not known to have them, some of \p cpus lack them, or the kernel does
+/// not open them.
+llvm::SmallVector<EventSpec> getPortEvents(llvm::ArrayRef<int> cpus);
+
+/// Splits \p events into groups of at most \p numSlots events, one group per
+/// pass. The first group is counted along with the default counters and is
+/// always present, even if there are no events. Top-down events do not take
+/// counter slots, they must go first and all land in the first group.
+std::vector<EventGroup> scheduleEvents(llvm::ArrayRef<EventSpec> events,
+                                       unsigned numSlots);
+
+/// Way the harness reads PMU counters.
+enum class CountersBackend {
+  /// libpmu counters, started and stopped with system calls.
+  PMU,
+  /// A perf event group, that is read with rdpmc from user space.
+  RDPMC,
+};
 
+struct BenchmarkResult;
 class CountersContext;
 
 void prefetchCounters(CountersContext *ctx);
-void flushCounters(CountersContext *ctx);
-std::shared_ptr<CountersContext> createCounters(CountersCb cb);
+/// Stores counter values of the last run in \p result, without allocating.
+/// Values of events go to BenchmarkResult::events, other fields are left
+/// untouched.
+void flushCounters(CountersContext *ctx, BenchmarkResult &result);
+/// Checks once, before any harness runs, that \p backend can count every
+/// group of \p groups. Returns the backend to create counters with, PMU if
+/// rdpmc is not available and no events are requested, or an error if they
+/// are.
+llvm::Expected<CountersBackend>
+probeCounters(CountersBackend backend, llvm::ArrayRef<EventGroup> groups);
+/// Creates counters for the default events and \p events. The PMU backend
+/// only counts the default events.
+std::shared_ptr<CountersContext>
+createCounters(CountersBackend backend = CountersBackend::PMU,
+               const EventGroup &events = {});
 } // namespace llvm_ml
 
 extern "C" {
@@ -6,50 +6,200 @@
 #include "BenchmarkGenerator.hpp"
 #include "BenchmarkResult.hpp"
 #include "BenchmarkRunner.hpp"
+#include "HarnessProcess.hpp"
+#include "MeasurementWorker.hpp"
 #include "counters.hpp"
+#include "llvm-ml/statistics/robust.hpp"
 
 #include "llvm/ADT/ScopeExit.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 
-#include <bit>
-#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
 #include <dlfcn.h>
 #include <fcntl.h>
+#include <cstring>
+#include <fstream>
 #include <functional>
-#include <linux/memfd.h>
-#include <linux/mman.h>
+#include <map>
+#include <optional>
 #include <string>
 #include <sys/mman.h>
-#include <sys/ptrace.h>
 #include <sys/resource.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/user.h>
 #include <sys/wait.h>
-#include <thread>
+#include <unistd.h>
 #include <utility>
+#include <vector>
 
-constexpr unsigned MAX_FAULTS = 30;
 constexpr uint64_t kTimeSliceNS = 1'000'000;
 
 using namespace llvm_ml;
 
+/// Size of the pages shared with harness processes, PAGE_SIZE is only defined
+/// on some targets.
+static const size_t kPageSize = sysconf(_SC_PAGE_SIZE);
+
+static void *allocateSharedMemory(size_t size = kPageSize) {
+  constexpr int protection = PROT_READ | PROT_WRITE;
+  constexpr int visibility = MAP_SHARED | MAP_ANONYMOUS;
+
+  return mmap(nullptr, size, protection, visibility, -1, 0);
+}
+
 namespace {
+/// Harness linked into a shared library by the system linker.
+class SharedObjectHarness final : public CompiledHarness {
+public:
+  SharedObjectHarness(std::string libPath, void *handle)
+      : mLibPath(std::move(libPath)), mHandle(handle) {}
+
+  ~SharedObjectHarness() override {
+    dlclose(mHandle);
+    llvm::sys::fs::remove(mLibPath);
+  }
+
+  llvm::Expected<BenchmarkFn> lookup(llvm::StringRef name) override {
+    void *sym = dlsym(mHandle, name.str().c_str());
+    if (!sym)
+      return llvm::createStringError(std::errc::invalid_argument,
+                                     "Symbol %s not found in harness library",
+                                     name.str().c_str());
+    return reinterpret_cast<BenchmarkFn>(sym);
+  }
+
+private:
+  std::string mLibPath;
+  void *mHandle;
+};
+
+/// Harness materialized in memory by ORC JIT. No linker process or temporary
+/// files are involved.
+class JITHarness final : public CompiledHarness {
+public:
+  JITHarness(std::unique_ptr<llvm::orc::LLJIT> jit) : mJIT(std::move(jit)) {}
+
+  llvm::Expected<BenchmarkFn> lookup(llvm::StringRef name) override {
+    auto addr = mJIT->lookup(name);
+    if (!addr)
+      return addr.takeError();
+    return addr->toPtr<BenchmarkFn>();
+  }
+
+private:
+  std::unique_ptr<llvm::orc::LLJIT> mJIT;
+};
+
+/// Harness encoded by a HarnessEncoder and copied to executable memory.
+class EncodedCodeHarness final : public CompiledHarness {
+public:
+  EncodedCodeHarness(llvm::sys::MemoryBlock block,
+                     std::map<std::string, size_t> symbols,
+                     SharedCodeMapper *mapper)
+      : mBlock(block), mSymbols(std::move(symbols)), mMapper(mapper) {}
+
+  ~EncodedCodeHarness() override {
+    if (mMapper)
+      mMapper->releaseMappedMemory(mBlock);
+    else
+      llvm::sys::Memory::releaseMappedMemory(mBlock);
+  }
+
+  llvm::Expected<BenchmarkFn> lookup(llvm::StringRef name) override {
+    auto it = mSymbols.find(name.str());
+    if (it == mSymbols.end())
+      return llvm::createStringError(std::errc::invalid_argument,
+                                     "Symbol %s not found in harness",
+                                     name.str().c_str());
+    return reinterpret_cast<BenchmarkFn>(static_cast<char *>(mBlock.base()) +
+                                         it->second);
+  }
+
+private:
+  llvm::sys::MemoryBlock mBlock;
+  std::map<std::string, size_t> mSymbols;
+  /// Owner of the memory, nullptr if it is mapped privately.
+  SharedCodeMapper *mMapper;
+};
+
+class CPUHarnessCompiler : public HarnessCompiler {
+public:
+  CPUHarnessCompiler(const llvm::Target *target, llvm::StringRef tripleName,
+                     const CPUBenchmarkOptions &options)
+      : mTarget(target), mTripleName(tripleName), mUseJIT(options.useJIT),
+        mUseWorkers(options.useWorkers) {}
+
+  llvm::Expected<std::unique_ptr<CompiledHarness>>
+  compile(std::unique_ptr<llvm::Module> harness) override;
+  llvm::Expected<std::unique_ptr<CompiledHarness>>
+  load(const EncodedHarness &harness) override;
+
+private:
+  llvm::Error emitObject(std::unique_ptr<llvm::Module> harness,
+                         llvm::SmallVectorImpl<char> &object);
+  llvm::Expected<std::unique_ptr<CompiledHarness>>
+  linkSharedObject(llvm::ArrayRef<char> object);
+  llvm::Expected<std::unique_ptr<CompiledHarness>>
+  materializeJIT(llvm::ArrayRef<char> object);
+
+  const llvm::Target *mTarget;
+  std::string mTripleName;
+  bool mUseJIT;
+  bool mUseWorkers;
+};
+
 class CPUBenchmarkRunner : public BenchmarkRunner {
 public:
   CPUBenchmarkRunner(const llvm::Target *target, llvm::StringRef tripleName,
-                     int pinnedCPU, int numRuns)
-      : mTarget(target), mTripleName(tripleName), mPinnedCPU(pinnedCPU),
-        mNumRuns(numRuns) {}
+                     const CPUBenchmarkOptions &options)
+      : mPinnedCPU(options.pinnedCPU), mNumRuns(options.numRuns),
+        mUseWorkers(options.useWorkers), mRule(options.stoppingRule),
+        mCounters(options.counters), mEvents(options.events),
+        mEventGroups(scheduleEvents(options.events, options.numEventSlots)),
+        mEventFilter(options.eventFilter),
+        mInterleave(options.interleave), mMemory(options.memory),
+        mOverhead(options.overhead), mCoRunner(options.coRunner) {
+    assert(!(mUseWorkers && mCoRunner) && "Workers do not run co-runners");
+    mRingSize = llvm::alignTo(
+        SampleRing::getAllocationSize(kSampleRingCapacity), kPageSize);
+    mRing = SampleRing::create(allocateSharedMemory(mRingSize),
+                               kSampleRingCapacity);
+    mLog = static_cast<HarnessLog *>(allocateSharedMemory());
+
+    if (mCoRunner) {
+      mCoRing = SampleRing::create(allocateSharedMemory(mRingSize),
+                                   kSampleRingCapacity);
+      mCoLog = static_cast<HarnessLog *>(allocateSharedMemory());
+      mSibling = static_cast<SiblingControl *>(allocateSharedMemory());
+    }
+  }
 
-  llvm::Error run(std::unique_ptr<llvm::Module> harness, size_t numNoiseRepeat,
+  ~CPUBenchmarkRunner() override {
+    munmap(mRing, mRingSize);
+    munmap(mLog, kPageSize);
+    if (mCoRunner) {
+      munmap(mCoRing, mRingSize);
+      munmap(mCoLog, kPageSize);
+      munmap(mSibling, kPageSize);
+    }
+  }
+
+  llvm::Error run(CompiledHarness &harness, size_t numNoiseRepeat,
                   size_t numRepeat) override;
-  llvm::Expected<int> check(std::unique_ptr<llvm::Module> harness,
+  llvm::Expected<int> check(CompiledHarness &harness,
                             size_t numNoiseRepeat) override;
 
   llvm::ArrayRef<llvm_ml::BenchmarkResult> getNoiseResults() const override {
@@ -60,20 +210,95 @@ public:
     return mWorkloadResults;
   }
 
+  llvm::ArrayRef<llvm_ml::BenchmarkResult> getCoRunnerResults() const override {
+    return mCoRunnerResults;
+  }
+
+  StopReason getNoiseStopReason() const override { return mNoiseStopReason; }
+
+  StopReason getWorkloadStopReason() const override {
+    return mWorkloadStopReason;
+  }
+
+  bool hasPairedResults() const override {
+    return mInterleave != InterleaveOrder::None && !mOverhead;
+  }
+
+  llvm::ArrayRef<void *> getMappedAddresses() const override {
+    return mMappedAddresses;
+  }
+
+  void addMappedAddresses(llvm::ArrayRef<void *> addresses) override {
+    const size_t pageSize = getHarnessPageSize(mMemory.placement);
+    for (void *addr : addresses) {
+      if (mMappedAddresses.size() == MAX_FAULTS)
+        break;
+      if (!isHarnessPageMapped(pageSize, mMappedAddresses, addr) &&
+          canMapHarnessPages(pageSize, addr))
+        mMappedAddresses.push_back(addr);
+    }
+  }
+
 private:
-  llvm::Error
-  runSingleBenchmark(const std::string &libPath, const std::string &harnessName,
-                     int numRepeat,
-                     llvm::SmallVectorImpl<void *> &mappedAddresses,
-                     llvm::SmallVectorImpl<llvm_ml::BenchmarkResult> &results);
-  llvm::Expected<std::string> compile(std::unique_ptr<llvm::Module> harness);
+  /// Runs a single pass of \p fn. Samples the co-runner took meanwhile are
+  /// appended to \p coRunnerSamples, if set.
+  ExitStatus
+  runPass(BenchmarkFn fn, int numRuns, int numRepeat, const EventGroup &events,
+          const StoppingRule &rule,
+          llvm::SmallVectorImpl<BenchmarkResult> &samples,
+          const HarnessLog *&log, const Interleaving &interleave = {},
+          llvm::SmallVectorImpl<BenchmarkResult> *coRunnerSamples = nullptr);
+  /// Counts the events of the extra passes of \p fn and stores them in every
+  /// one of \p samples.
+  llvm::Error countEvents(BenchmarkFn fn, int numRepeat,
+                          llvm::MutableArrayRef<BenchmarkResult> samples);
+  /// Describes the data page fault that ended a pass. The harness maps the
+  /// pages it faults on by itself, so only faults it could not recover from
+  /// end the pass.
+  llvm::Error getFaultError(const ExitStatus &status) const;
+  /// Measures \p fn. Samples the co-runner took during the pass of
+  /// \p results are appended to \p coRunnerSamples, if set.
+  llvm::Error runSingleBenchmark(
+      BenchmarkFn fn, int numRepeat, const StoppingRule &rule,
+      llvm::SmallVectorImpl<llvm_ml::BenchmarkResult> &results,
+      StopReason &stopReason,
+      llvm::SmallVectorImpl<BenchmarkResult> *coRunnerSamples = nullptr);
+  /// Measures \p baseline and \p workload in the same passes, a baseline run
+  /// right next to every workload run.
+  llvm::Error runInterleaved(BenchmarkFn baseline, int numNoiseRepeat,
+                             BenchmarkFn workload, int numRepeat);
 
-  const llvm::Target *mTarget;
-  llvm::StringRef mTripleName;
   int mPinnedCPU;
   int mNumRuns;
+  bool mUseWorkers;
+  StoppingRule mRule;
+  CountersBackend mCounters;
+  llvm::SmallVector<EventSpec> mEvents;
+  /// Events of every pass. The first group is counted by the pass, that
+  /// decides the number of samples.
+  std::vector<EventGroup> mEventGroups;
+  SampleFilter mEventFilter;
+  InterleaveOrder mInterleave;
+  MemoryMode mMemory;
+  std::optional<BenchmarkResult> mOverhead;
+  std::optional<CoRunner> mCoRunner;
+  /// Samples of forked harness processes.
+  SampleRing *mRing;
+  size_t mRingSize;
+  /// Pages mapped by forked harness processes.
+  HarnessLog *mLog;
+  /// Samples, fault log and start barrier of the co-runner process, if any.
+  SampleRing *mCoRing = nullptr;
+  HarnessLog *mCoLog = nullptr;
+  SiblingControl *mSibling = nullptr;
   llvm::SmallVector<llvm_ml::BenchmarkResult> mNoiseResults;
   llvm::SmallVector<llvm_ml::BenchmarkResult> mWorkloadResults;
+  llvm::SmallVector<llvm_ml::BenchmarkResult> mCoRunnerResults;
+  StopReason mNoiseStopReason = StopReason::MaxRuns;
+  StopReason mWorkloadStopReason = StopReason::MaxRuns;
+  /// Data addresses the harnesses touch. Baseline and workload access the
+  /// same pages, so faults found by one pass are never rediscovered.
+  llvm::SmallVector<void *> mMappedAddresses;
 };
 } // namespace
 
@@ -92,205 +317,161 @@ ParentResT fork(std::function<void()> forkBody,
   llvm_unreachable("Failed to fork");
 }
 
-static void *allocateSharedMemory() {
-  constexpr int protection = PROT_READ | PROT_WRITE;
-  constexpr int visibility = MAP_SHARED | MAP_ANONYMOUS;
-
-  return mmap(nullptr, PAGE_SIZE, protection, visibility, -1, 0);
-}
-
-static void fake_bench(void *) {}
-
-static std::pair<int, unsigned> allocatePhysicalPage() {
-  int fd = memfd_create("shmem", 0);
-  if (fd == -1) {
-    llvm::errs() << "Failed to allocate physical page\n";
-    abort();
-  }
-  if (ftruncate(fd, 5 * sysconf(_SC_PAGE_SIZE)) != 0) {
-    llvm::errs() << "Failed to truncate shmem file: " << strerror(errno)
-                 << "\n";
-    abort();
-  }
+static void runHarness(llvm_ml::BenchmarkFn fn, int pinnedCPU,
+                       SampleRing *samples, int numRuns, HarnessArgs args,
+                       const Interleaving &interleave,
+                       const StoppingRule &rule, CountersBackend backend,
+                       const EventGroup &events, const MemoryMode &memory,
+                       HarnessLog *log, SiblingControl *sibling) {
+  if (!setupHarnessProcess(pinnedCPU))
+    exit(1);
 
-  return {fd, sysconf(_SC_PAGE_SIZE)};
-}
+  const PhysicalPages pages = allocatePhysicalPages(memory.placement);
+  mapHarnessPages(pages, log);
+  installFaultHandler(pages, log);
+  const CacheWarmer cache(memory.cacheState, pages.pageSize);
 
-static void runHarness(llvm::StringRef libPath, std::string harnessName,
-                       int pinnedCPU, void *out, int numRuns,
-                       llvm::ArrayRef<void *> addresses) {
-  // FIXME(Alex): there must be a better way to wait for parent to become
-  // ready
-  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  auto counters = createCounters(backend, events);
 
-  void *lib = dlopen(libPath.data(), RTLD_NOW);
-  if (!lib)
+  // Samples taken without the co-runner would pass for contended ones.
+  if (sibling && !sibling->arriveAndWait())
     _exit(1);
 
-  auto fn =
-      reinterpret_cast<llvm_ml::BenchmarkFn>(dlsym(lib, harnessName.c_str()));
-  if (!fn)
-    _exit(1);
+  if (interleave.order == InterleaveOrder::None)
+    measureHarness(fn, counters.get(), cache, samples, numRuns, &args, rule,
+                   log);
+  else
+    measureInterleaved(fn, counters.get(), cache, samples, numRuns, &args,
+                       interleave, rule, log);
+
+  _exit(0);
+}
 
-  // Pin process to thread.
-  cpu_set_t cpuSet;
-  CPU_ZERO(&cpuSet);
-  CPU_SET(pinnedCPU, &cpuSet);
-  if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuSet) < 0) {
-    llvm::errs() << "Failed to pin process to CPU #" << pinnedCPU << "\n";
+/// Runs the workload of \p coRunner on its CPU until \p control stops it.
+/// Pages the co-runner faults on are mapped on demand, every pass finds them
+/// again during warm up.
+static void runCoRunner(const CoRunner &coRunner, SampleRing *samples,
+                        CountersBackend backend, const MemoryMode &memory,
+                        HarnessLog *log, SiblingControl *control) {
+  if (!setupHarnessProcess(coRunner.cpu))
     exit(1);
-  }
-  struct sched_param schedParam = {.sched_priority = 90};
-  // Silently ignore return error in non-root mode
-  sched_setscheduler(0, SCHED_FIFO, &schedParam);
 
-  // LLVM installs its own segfault handler. We don't need that.
-  signal(SIGSEGV, SIG_DFL);
+  const PhysicalPages pages = allocatePhysicalPages(memory.placement);
+  installFaultHandler(pages, log);
 
-  auto [shmemFD, pageSize] = allocatePhysicalPage();
+  auto counters = createCounters(backend);
+  HarnessArgs args = coRunner.args;
+  measureCoRunner(coRunner.fn, counters.get(), samples, &args, *log, control);
 
-  constexpr int flags = MAP_PRIVATE | MAP_FIXED;
+  _exit(0);
+}
 
-  for (auto addr : addresses) {
-    void *res = nullptr;
-    size_t shift = reinterpret_cast<size_t>(addr) >> std::bit_width(pageSize);
-    void *pageAddr =
-        reinterpret_cast<void *>(shift << std::bit_width(pageSize));
+/// Co-runner process of a pass and the memory it shares with the parent.
+struct CoRunnerProcess {
+  pid_t pid;
+  SampleRing &ring;
+  SiblingControl &control;
+  llvm::SmallVectorImpl<BenchmarkResult> &samples;
+};
 
-    const auto [numPages, offset] = [&addr]() -> std::pair<size_t, size_t> {
-      if (reinterpret_cast<size_t>(addr) == 0x2323000)
-        return {5, 0};
+/// Stops \p coRunner and drains its samples until it exits. Returns true if
+/// it exited cleanly.
+static bool stopCoRunner(CoRunnerProcess &coRunner) {
+  coRunner.control.stopped.store(true, std::memory_order_release);
 
-      return {4, PAGE_SIZE};
-    }();
+  int status;
+  while (true) {
+    const pid_t pid = waitpid(coRunner.pid, &status, WNOHANG);
+    if (pid == -1 && errno != EINTR)
+      return false;
+    if (pid == coRunner.pid)
+      break;
+    if (coRunner.ring.drain(coRunner.samples) == 0)
+      usleep(kSampleRingDrainMS * 1000);
+  }
+  coRunner.ring.drain(coRunner.samples);
 
-    res = mmap(pageAddr, numPages * pageSize, PROT_READ | PROT_WRITE, flags,
-               shmemFD, offset);
-    if (res != pageAddr) {
-      llvm::errs() << "Requested address " << pageAddr << " got " << res
-                   << " shift " << std::bit_width(pageSize) << "\n";
-      abort();
-    }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
 
-    if (res == nullptr || res == reinterpret_cast<void *>(0xffffffffffffffff)) {
-      llvm::errs() << "Failed to map address: " << strerror(errno) << "\n";
-      abort();
+static ExitStatus runParent(int child, const HarnessLog &log,
+                            SampleRing &ring,
+                            llvm::SmallVectorImpl<BenchmarkResult> &samples,
+                            CoRunnerProcess *coRunner = nullptr) {
+  // Samples are drained while the child runs, so that it never waits for ring
+  // space for long.
+  int status;
+  // The co-runner never exits by itself, unless it failed.
+  bool coRunnerFailed = false;
+  while (true) {
+    const pid_t pid = waitpid(child, &status, WNOHANG);
+    if (pid == -1 && errno != EINTR) {
+      if (coRunner && !coRunnerFailed)
+        stopCoRunner(*coRunner);
+      return ExitStatus{.reason = ExitReason::Unknown, .memAddr = 0, .ip = 0};
     }
-
-// 64 here stands for cache line size
-// FIXME(Alex): find a more portable way
-#pragma unroll
-    for (size_t i = 0; i < numPages * pageSize; i += 64) {
-      __builtin_prefetch(static_cast<char *>(pageAddr) + i, 0, 3);
+    if (pid == child)
+      break;
+
+    size_t numDrained = ring.drain(samples);
+    if (coRunner && !coRunnerFailed) {
+      numDrained += coRunner->ring.drain(coRunner->samples);
+      // Lets the harness out of the start barrier, if it still waits there.
+      if (waitpid(coRunner->pid, nullptr, WNOHANG) == coRunner->pid) {
+        coRunner->control.stopped.store(true, std::memory_order_release);
+        coRunnerFailed = true;
+      }
     }
+    if (numDrained == 0)
+      usleep(kSampleRingDrainMS * 1000);
   }
+  ring.drain(samples);
 
-  size_t runId = 0;
-  auto counters =
-      createCounters([out, &runId](llvm::ArrayRef<CounterValue> values) {
-        BenchmarkResult result{.hasFailed = false};
-        for (const auto &val : values) {
-          if (val.type == Counter::Cycles) {
-            result.numCycles = val.value;
-          } else if (val.type == Counter::CacheMisses) {
-            result.numCacheMisses = val.value;
-          } else if (val.type == Counter::ContextSwitches) {
-            result.numContextSwitches = val.value;
-          } else if (val.type == Counter::Instructions) {
-            result.numInstructions = val.value;
-          } else if (val.type == Counter::MicroOps) {
-            result.numMicroOps = val.value;
-          } else if (val.type == Counter::MisalignedLoads) {
-            result.numMisalignedLoads = val.value;
-          }
-        }
-
-        auto *res = reinterpret_cast<BenchmarkResult *>(out);
-        res[runId++] = result;
-      });
-
-  // Warm-up
-  for (size_t i = 0; i < 5; i++)
-    fn(nullptr, reinterpret_cast<void *>(&fake_bench),
-       reinterpret_cast<void *>(&fake_bench), out);
-
-  prefetchCounters(counters.get());
-  for (int i = 0; i < numRuns; i++) {
-    // Voluntarily give up processor time to get a full CPU slice.
-    std::this_thread::yield();
-    auto start = std::chrono::high_resolution_clock::now();
-    fn(counters.get(), reinterpret_cast<void *>(&counters_start),
-       reinterpret_cast<void *>(&counters_stop), out);
-    auto end = std::chrono::high_resolution_clock::now();
-
-    llvm_ml::flushCounters(counters.get());
-
-    uint64_t duration = std::chrono::nanoseconds(end - start).count();
-    auto *res = reinterpret_cast<BenchmarkResult *>(out);
-    res[i].wallTime = duration;
-  }
-
-  _exit(0);
-}
+  if (coRunner && !coRunnerFailed && !stopCoRunner(*coRunner))
+    coRunnerFailed = true;
+  if (coRunnerFailed)
+    return ExitStatus{.reason = ExitReason::Unknown, .memAddr = 0, .ip = 0};
 
-enum class ExitReason {
-  Success,
-  Segfault,
-  Unknown,
-};
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    return ExitStatus{.reason = ExitReason::Success, .memAddr = 0, .ip = 0};
 
-struct ExitStatus {
-  ExitReason reason;
-  void *memAddr;
-  void *ip;
-};
+  // Recorded by the fault handler of the child.
+  if (log.reason == ExitReason::Segfault) {
+    return ExitStatus{.reason = ExitReason::Segfault,
+                      .memAddr = log.faultAddr,
+                      .ip = log.faultIP};
+  }
 
-static bool isSegfault(int child) {
-  siginfo_t siginfo;
-  ptrace(PTRACE_GETSIGINFO, child, nullptr, &siginfo);
-  return siginfo.si_signo == SIGSEGV || siginfo.si_signo == SIGTRAP;
+  return ExitStatus{.reason = ExitReason::Unknown, .memAddr = 0, .ip = 0};
 }
 
-static std::pair<void *, void *> getSegfaultAddr(int child) {
-  siginfo_t siginfo;
-  ptrace(PTRACE_GETSIGINFO, child, nullptr, &siginfo);
-  struct user_regs_struct regs;
-  ptrace(PTRACE_GETREGS, child, nullptr, &regs);
-
-  void *pageFaultAddress = siginfo.si_addr;
-#if defined(__amd64__)
-  void *signaledInstruction = (void *)regs.rip;
-#else
-#error "Unsupported platform"
-#endif
+llvm::Error
+CPUHarnessCompiler::emitObject(std::unique_ptr<llvm::Module> module,
+                               llvm::SmallVectorImpl<char> &object) {
+  std::unique_ptr<llvm::TargetMachine> tm(mTarget->createTargetMachine(
+      mTripleName, "generic", "", llvm::TargetOptions{}, std::nullopt));
 
-  return std::make_pair(pageFaultAddress, signaledInstruction);
-}
+  auto dl = tm->createDataLayout();
+  module->setDataLayout(dl);
 
-static ExitStatus runParent(int child) {
-  ptrace(PTRACE_SEIZE, child, NULL, NULL);
+  llvm::raw_svector_ostream objOs(object);
 
-  int status;
-  int result = wait(&status);
+  llvm::legacy::PassManager pass;
+  auto fileType = llvm::CGFT_ObjectFile;
 
-  if (WIFEXITED(status) || result == -1) {
-    if (WEXITSTATUS(status) == 0) {
-      return ExitStatus{.reason = ExitReason::Success, .memAddr = 0, .ip = 0};
-    }
+  if (tm->addPassesToEmitFile(pass, objOs, nullptr, fileType)) {
+    return llvm::createStringError(
+        std::errc::not_supported,
+        "TargetMachine can't emit a file of this type");
   }
 
-  if (!isSegfault(child))
-    return ExitStatus{.reason = ExitReason::Unknown, .memAddr = 0, .ip = 0};
-
-  auto [pageFaultAddress, signaledInstruction] = getSegfaultAddr(child);
+  pass.run(*module);
 
-  return ExitStatus{.reason = ExitReason::Segfault,
-                    .memAddr = pageFaultAddress,
-                    .ip = signaledInstruction};
+  return llvm::Error::success();
 }
 
-llvm::Expected<std::string>
-CPUBenchmarkRunner::compile(std::unique_ptr<llvm::Module> module) {
+llvm::Expected<std::unique_ptr<CompiledHarness>>
+CPUHarnessCompiler::linkSharedObject(llvm::ArrayRef<char> object) {
   int objFd = 0;
   llvm::SmallVector<char> objectPathChar;
   llvm::sys::fs::createTemporaryFile("llvm-mc-bench", ".o", objFd,
@@ -299,26 +480,11 @@ CPUBenchmarkRunner::compile(std::unique_ptr<llvm::Module> module) {
 
   auto rmObj = llvm::make_scope_exit([&] { llvm::sys::fs::remove(objPath); });
 
-  llvm::raw_fd_ostream objOs(objFd, true);
-
-  llvm::TargetMachine *tm = mTarget->createTargetMachine(
-      mTripleName, "generic", "", llvm::TargetOptions{}, std::nullopt);
-
-  auto dl = tm->createDataLayout();
-  module->setDataLayout(dl);
-
-  llvm::legacy::PassManager pass;
-  auto fileType = llvm::CGFT_ObjectFile;
-
-  if (tm->addPassesToEmitFile(pass, objOs, nullptr, fileType)) {
-    llvm::errs() << "TargetMachine can't emit a file of this type";
-    std::terminate();
+  {
+    llvm::raw_fd_ostream objOs(objFd, true);
+    objOs.write(object.data(), object.size());
   }
 
-  pass.run(*module);
-  objOs.flush();
-  objOs.close();
-
   llvm::SmallVector<char> libPathChar;
   llvm::sys::fs::createUniquePath("llvm-mc-bench-%%%%%%.so", libPathChar, true);
   std::string libPath{libPathChar.begin(), libPathChar.end()};
@@ -330,89 +496,327 @@ CPUBenchmarkRunner::compile(std::unique_ptr<llvm::Module> module) {
                                    "Failed to link dynamic library");
   }
 
-  return libPath;
+  void *lib = dlopen(libPath.c_str(), RTLD_NOW);
+  if (!lib) {
+    llvm::sys::fs::remove(libPath);
+    return llvm::createStringError(std::errc::invalid_argument,
+                                   "Failed to load dynamic library: %s",
+                                   dlerror());
+  }
+
+  return std::make_unique<SharedObjectHarness>(std::move(libPath), lib);
 }
 
-llvm::Error CPUBenchmarkRunner::runSingleBenchmark(
-    const std::string &libPath, const std::string &harnessName, int numRepeat,
-    llvm::SmallVectorImpl<void *> &mappedAddresses,
-    llvm::SmallVectorImpl<llvm_ml::BenchmarkResult> &results) {
-  void *lastSignaledInstruction = nullptr;
+llvm::Expected<std::unique_ptr<CompiledHarness>>
+CPUHarnessCompiler::materializeJIT(llvm::ArrayRef<char> object) {
+  llvm::orc::LLJITBuilder builder;
+  builder.setJITTargetMachineBuilder(
+      llvm::orc::JITTargetMachineBuilder(llvm::Triple(mTripleName)));
+
+  if (mUseWorkers) {
+    builder.setObjectLinkingLayerCreator(
+        [](llvm::orc::ExecutionSession &es, const llvm::Triple &)
+            -> llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>> {
+          return std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+              es, []() {
+                return std::make_unique<llvm::SectionMemoryManager>(
+                    &SharedCodeMapper::get());
+              });
+        });
+  }
+
+  auto jit = builder.create();
+  if (!jit)
+    return jit.takeError();
+
+  auto buffer = llvm::MemoryBuffer::getMemBufferCopy(
+      llvm::StringRef(object.data(), object.size()), "llvm-mc-bench-harness");
+  if (auto err = (*jit)->addObjectFile(std::move(buffer)))
+    return std::move(err);
+
+  return std::make_unique<JITHarness>(std::move(*jit));
+}
+
+llvm::Expected<std::unique_ptr<CompiledHarness>>
+CPUHarnessCompiler::compile(std::unique_ptr<llvm::Module> module) {
+  llvm::SmallVector<char> object;
+  if (auto err = emitObject(std::move(module), object))
+    return std::move(err);
+
+  // Workers are forked in advance, they only see code in shared memory.
+  if (mUseJIT || mUseWorkers)
+    return materializeJIT(object);
 
-  void *out = allocateSharedMemory();
+  return linkSharedObject(object);
+}
+
+llvm::Expected<std::unique_ptr<CompiledHarness>>
+CPUHarnessCompiler::load(const EncodedHarness &harness) {
+  using llvm::sys::Memory;
+
+  // Workers are forked in advance, they only see code in shared memory.
+  SharedCodeMapper *mapper = mUseWorkers ? &SharedCodeMapper::get() : nullptr;
+
+  std::error_code ec;
+  const size_t size = harness.code.size();
+  llvm::sys::MemoryBlock block =
+      mapper ? mapper->allocateMappedMemory(
+                   llvm::SectionMemoryManager::AllocationPurpose::Code, size,
+                   nullptr, Memory::MF_READ | Memory::MF_WRITE, ec)
+             : Memory::allocateMappedMemory(
+                   size, nullptr, Memory::MF_READ | Memory::MF_WRITE, ec);
+  if (ec)
+    return llvm::createStringError(ec, "Failed to allocate harness memory");
+
+  auto compiled = std::make_unique<EncodedCodeHarness>(block, harness.symbols,
+                                                       mapper);
+
+  std::memcpy(block.base(), harness.code.data(), size);
+
+  const unsigned codeFlags = Memory::MF_READ | Memory::MF_EXEC;
+  ec = mapper ? mapper->protectMappedMemory(block, codeFlags)
+              : Memory::protectMappedMemory(block, codeFlags);
+  if (ec)
+    return llvm::createStringError(ec, "Failed to make harness executable");
+  Memory::InvalidateInstructionCache(block.base(), size);
+
+  return compiled;
+}
 
-  for (unsigned i = 0; i < MAX_FAULTS; i++) {
-    ExitStatus status = fork<ExitStatus>(
+ExitStatus CPUBenchmarkRunner::runPass(
+    BenchmarkFn fn, int numRuns, int numRepeat, const EventGroup &events,
+    const StoppingRule &rule, llvm::SmallVectorImpl<BenchmarkResult> &samples,
+    const HarnessLog *&log, const Interleaving &interleave,
+    llvm::SmallVectorImpl<BenchmarkResult> *coRunnerSamples) {
+  const HarnessArgs args{.numRepeat = static_cast<uint64_t>(numRepeat)};
+  ExitStatus status;
+  samples.clear();
+
+  if (mUseWorkers) {
+    MeasurementWorker &worker = MeasurementWorker::get(mPinnedCPU, mCounters);
+    status = worker.run(fn, numRuns, args, interleave, rule, events, mMemory,
+                        mMappedAddresses, samples);
+    log = &worker.getLog();
+  } else {
+    mLog->reset(mMappedAddresses);
+    mRing->reset();
+
+    // The co-runner is forked first, the harness waits for it to arrive.
+    llvm::SmallVector<BenchmarkResult> coRunnerPassSamples;
+    std::optional<CoRunnerProcess> coRunner;
+    if (mCoRunner) {
+      mCoLog->reset({});
+      mCoRing->reset();
+      mSibling->reset();
+      const pid_t child = fork();
+      if (child == 0)
+        runCoRunner(*mCoRunner, mCoRing, mCounters, mMemory, mCoLog,
+                    mSibling);
+      if (child == -1)
+        return ExitStatus{.reason = ExitReason::Unknown, .memAddr = 0,
+                          .ip = 0};
+      coRunner.emplace(
+          CoRunnerProcess{child, *mCoRing, *mSibling, coRunnerPassSamples});
+    }
+
+    status = fork<ExitStatus>(
         [&]() {
-          runHarness(libPath, harnessName, mPinnedCPU, out, 1, mappedAddresses);
+          runHarness(fn, mPinnedCPU, mRing, numRuns, args, interleave, rule,
+                     mCounters, events, mMemory, mLog,
+                     mCoRunner ? mSibling : nullptr);
         },
-        [](int child) -> ExitStatus { return runParent(child); });
+        [&](int child) -> ExitStatus {
+          return runParent(child, *mLog, *mRing, samples,
+                           coRunner ? &*coRunner : nullptr);
+        });
+    log = mLog;
+
+    if (status.reason == ExitReason::Success && coRunnerSamples) {
+      for (BenchmarkResult &sample : coRunnerPassSamples) {
+        sample.numRuns = mCoRunner->args.numRepeat;
+        coRunnerSamples->push_back(sample);
+      }
+    }
+  }
 
-    if (status.reason == ExitReason::Unknown) {
+  llvm::ArrayRef<void *> mapped = log->getAddresses();
+  mMappedAddresses.assign(mapped.begin(), mapped.end());
+
+  return status;
+}
+
+llvm::Error CPUBenchmarkRunner::getFaultError(const ExitStatus &status) const {
+  if (status.reason == ExitReason::Segfault) {
+    if (status.memAddr == nullptr) {
       return llvm::createStringError(std::errc::executable_format_error,
-                                     "Pre-run failed for unknown reason");
+                                     "Attempt to access nullptr");
     }
 
-    if (status.reason == ExitReason::Segfault) {
-      if (status.ip == lastSignaledInstruction) {
-        llvm::errs() << "Failed IP: " << status.ip << "\n";
-        llvm::errs() << "Failed addr: " << status.memAddr << "\n";
-        return llvm::createStringError(std::errc::executable_format_error,
-                                       "The same instruction segfaulted twice");
-      }
+    if (mMappedAddresses.size() == MAX_FAULTS) {
+      return llvm::createStringError(std::errc::executable_format_error,
+                                     "Harness touches too many pages");
+    }
 
-      if (status.memAddr == nullptr) {
-        return llvm::createStringError(std::errc::executable_format_error,
-                                       "Attempt to access nullptr");
-      }
+    llvm::errs() << "Failed IP: " << status.ip << "\n";
+    llvm::errs() << "Failed addr: " << status.memAddr << "\n";
+    return llvm::createStringError(std::errc::executable_format_error,
+                                   "Failed to map the faulting page");
+  }
+
+  return llvm::Error::success();
+}
 
-      lastSignaledInstruction = status.ip;
+llvm::Error CPUBenchmarkRunner::runSingleBenchmark(
+    BenchmarkFn fn, int numRepeat, const StoppingRule &rule,
+    llvm::SmallVectorImpl<llvm_ml::BenchmarkResult> &results,
+    StopReason &stopReason,
+    llvm::SmallVectorImpl<BenchmarkResult> *coRunnerSamples) {
+  llvm::SmallVector<BenchmarkResult> samples;
+  const HarnessLog *log = nullptr;
+  stopReason = StopReason::MaxRuns;
+
+  // The harness maps the data pages it faults on, later passes map them
+  // upfront.
+  for (size_t i = 0; i < MAX_FAULTS; i++) {
+    ExitStatus status = runPass(fn, mNumRuns, numRepeat, mEventGroups.front(),
+                                rule, samples, log, {}, coRunnerSamples);
 
-      mappedAddresses.push_back(status.memAddr);
+    if (status.reason != ExitReason::Success) {
+      if (auto err = getFaultError(status))
+        return err;
+      results.push_back(BenchmarkResult{.hasFailed = true});
+      continue;
     }
+
+    const size_t firstSample = results.size();
+    for (BenchmarkResult &sample : samples) {
+      sample.numRuns = numRepeat;
+      results.push_back(sample);
+    }
+    stopReason = log->stopReason;
+
+    return countEvents(fn, numRepeat,
+                       llvm::MutableArrayRef(results).drop_front(firstSample));
   }
 
+  return llvm::Error::success();
+}
+
+llvm::Error CPUBenchmarkRunner::runInterleaved(BenchmarkFn baseline,
+                                               int numNoiseRepeat,
+                                               BenchmarkFn workload,
+                                               int numRepeat) {
+  const Interleaving interleave{
+      .order = mInterleave,
+      .baseline = baseline,
+      .baselineArgs = {.numRepeat = static_cast<uint64_t>(numNoiseRepeat)}};
+  llvm::SmallVector<BenchmarkResult> samples;
+  const HarnessLog *log = nullptr;
+
   for (size_t i = 0; i < MAX_FAULTS; i++) {
-    ExitStatus status = fork<ExitStatus>(
-        [&]() {
-          runHarness(libPath, harnessName, mPinnedCPU, out, mNumRuns,
-                     mappedAddresses);
-        },
-        [](int child) -> ExitStatus { return runParent(child); });
+    ExitStatus status =
+        runPass(workload, mNumRuns, numRepeat, mEventGroups.front(), mRule,
+                samples, log, interleave, &mCoRunnerResults);
 
+    // Failures are recorded on both sides to keep the results paired.
     if (status.reason != ExitReason::Success) {
-      results.push_back(BenchmarkResult{.hasFailed = true});
+      if (auto err = getFaultError(status))
+        return err;
+      mNoiseResults.push_back(BenchmarkResult{.hasFailed = true});
+      mWorkloadResults.push_back(BenchmarkResult{.hasFailed = true});
       continue;
     }
 
-    auto *res = reinterpret_cast<BenchmarkResult *>(out);
-    for (int j = 0; j < mNumRuns; j++) {
-      results.push_back(res[j]);
-      results.back().numRuns = numRepeat;
+    const size_t firstSample = mWorkloadResults.size();
+    for (size_t j = 0; j + 1 < samples.size(); j += 2) {
+      samples[j].numRuns = numNoiseRepeat;
+      samples[j + 1].numRuns = numRepeat;
+      mNoiseResults.push_back(samples[j]);
+      mWorkloadResults.push_back(samples[j + 1]);
     }
-    break;
+    mNoiseStopReason = log->stopReason;
+    mWorkloadStopReason = log->stopReason;
+
+    // Extra event passes measure either side on its own.
+    llvm::MutableArrayRef<BenchmarkResult> noiseSamples(mNoiseResults);
+    llvm::MutableArrayRef<BenchmarkResult> workloadSamples(mWorkloadResults);
+    if (auto err = countEvents(baseline, numNoiseRepeat,
+                               noiseSamples.drop_front(firstSample)))
+      return err;
+    return countEvents(workload, numRepeat,
+                       workloadSamples.drop_front(firstSample));
   }
 
   return llvm::Error::success();
 }
 
-llvm::Expected<int>
-CPUBenchmarkRunner::check(std::unique_ptr<llvm::Module> harness,
-                          size_t numNoiseRepeat) {
-  assert(sizeof(BenchmarkResult) * mNumRuns < PAGE_SIZE);
+llvm::Error CPUBenchmarkRunner::countEvents(
+    BenchmarkFn fn, int numRepeat,
+    llvm::MutableArrayRef<BenchmarkResult> samples) {
+  // Every extra pass takes as many samples as the first one.
+  const StoppingRule takeAllSamples;
+
+  // Runs of an extra pass have nothing to do with the runs of the first one
+  // at the same index. Every pass is filtered on its own, and its median
+  // events per iteration stand for all of the samples.
+  for (const EventGroup &group : llvm::drop_begin(mEventGroups)) {
+    llvm::SmallVector<BenchmarkResult> out;
+    const HarnessLog *log = nullptr;
+    ExitStatus status = runPass(fn, samples.size(), numRepeat, group,
+                                takeAllSamples, out, log);
+    if (status.reason != ExitReason::Success) {
+      if (auto err = getFaultError(status))
+        return err;
+      return llvm::createStringError(std::errc::invalid_argument,
+                                     "Failed to count events of an extra pass");
+    }
+
+    llvm::SmallVector<size_t> accepted = mEventFilter.apply(out);
+    if (accepted.empty())
+      return llvm::createStringError(
+          std::errc::invalid_argument,
+          "Neither of event samples is suitable for use");
+
+    for (unsigned i = group.first; i < group.first + group.numEvents; i++) {
+      std::vector<double> perIteration;
+      for (size_t index : accepted) {
+        const BenchmarkResult &res = out[index];
+        perIteration.push_back(static_cast<double>(res.events[i]) /
+                               std::max<uint64_t>(res.numRuns, 1));
+      }
+      const double median = stat::median(std::move(perIteration));
+      for (BenchmarkResult &sample : samples)
+        sample.events[i] =
+            std::llround(median * std::max<uint64_t>(sample.numRuns, 1));
+    }
+  }
+
+  for (auto &sample : samples) {
+    for (auto event : llvm::enumerate(mEvents)) {
+      if (event.value().counter == Counter::MicroOps)
+        sample.numMicroOps = sample.events[event.index()];
+      else if (event.value().counter == Counter::MisalignedLoads)
+        sample.numMisalignedLoads = sample.events[event.index()];
+      else if (event.value().counter == Counter::RefCycles)
+        sample.numRefCycles = sample.events[event.index()];
+    }
+  }
 
-  auto maybeLibPath = compile(std::move(harness));
+  return llvm::Error::success();
+}
 
-  if (!maybeLibPath)
-    return maybeLibPath.takeError();
-  auto rmLib =
-      llvm::make_scope_exit([&] { llvm::sys::fs::remove(*maybeLibPath); });
+llvm::Expected<int>
+CPUBenchmarkRunner::check(CompiledHarness &harness, size_t numNoiseRepeat) {
+  // Materialize the code before forking, so that children inherit it.
+  auto baseline = harness.lookup(llvm_ml::kBaselineNoiseName);
+  if (!baseline)
+    return baseline.takeError();
 
-  llvm::SmallVector<void *> mappedAddresses;
   llvm::SmallVector<llvm_ml::BenchmarkResult> results;
 
-  if (auto err = runSingleBenchmark(*maybeLibPath, llvm_ml::kBaselineNoiseName,
-                                    numNoiseRepeat, mappedAddresses, results))
+  StopReason stopReason;
+  if (auto err = runSingleBenchmark(*baseline, numNoiseRepeat, mRule, results,
+                                    stopReason))
     return err;
 
   const auto minEltPred = [](const auto &lhs, const auto &rhs) {
@@ -432,38 +836,88 @@ CPUBenchmarkRunner::check(std::unique_ptr<llvm::Module> harness,
   return numRepeat;
 }
 
-llvm::Error CPUBenchmarkRunner::run(std::unique_ptr<llvm::Module> harness,
+llvm::Error CPUBenchmarkRunner::run(CompiledHarness &harness,
                                     size_t numNoiseRepeat, size_t numRepeat) {
-  assert(sizeof(BenchmarkResult) * mNumRuns < PAGE_SIZE);
-
-  auto maybeLibPath = compile(std::move(harness));
-
-  if (!maybeLibPath)
-    return maybeLibPath.takeError();
-
-  auto rmLib =
-      llvm::make_scope_exit([&] { llvm::sys::fs::remove(*maybeLibPath); });
+  // Materialize the code before forking, so that children inherit it.
+  auto baseline = harness.lookup(llvm_ml::kBaselineNoiseName);
+  if (!baseline)
+    return baseline.takeError();
+  auto workload = harness.lookup(llvm_ml::kWorkloadName);
+  if (!workload)
+    return workload.takeError();
+
+  // Only the workload pass tells how much the co-runner suffers from it.
+  mCoRunnerResults.clear();
+
+  // The workload converges once cycles per iteration, workload minus baseline,
+  // are known precisely enough.
+  StoppingRule workloadRule = mRule;
+
+  if (mOverhead) {
+    mNoiseResults.push_back(*mOverhead);
+    workloadRule.baseline.push(mOverhead->numCycles);
+    return runSingleBenchmark(*workload, numRepeat, workloadRule,
+                              mWorkloadResults, mWorkloadStopReason,
+                              &mCoRunnerResults);
+  }
 
-  llvm::SmallVector<void *> mappedAddresses;
+  if (mInterleave != InterleaveOrder::None)
+    return runInterleaved(*baseline, numNoiseRepeat, *workload, numRepeat);
 
-  if (auto err =
-          runSingleBenchmark(*maybeLibPath, llvm_ml::kBaselineNoiseName,
-                             numNoiseRepeat, mappedAddresses, mNoiseResults))
+  if (auto err = runSingleBenchmark(*baseline, numNoiseRepeat, mRule,
+                                    mNoiseResults, mNoiseStopReason))
     return err;
-  if (auto err =
-          runSingleBenchmark(*maybeLibPath, llvm_ml::kWorkloadName, numRepeat,
-                             mappedAddresses, mWorkloadResults))
+  for (const BenchmarkResult &sample : mNoiseResults)
+    if (!sample.hasFailed && mRule.accepts(sample))
+      workloadRule.baseline.push(sample.numCycles);
+  if (auto err = runSingleBenchmark(*workload, numRepeat, workloadRule,
+                                    mWorkloadResults, mWorkloadStopReason,
+                                    &mCoRunnerResults))
     return err;
 
   return llvm::Error::success();
 }
 
 namespace llvm_ml {
+std::optional<int> getSMTSibling(int cpu) {
+  std::ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                     "/topology/thread_siblings_list");
+  std::string list;
+  if (!(file >> list))
+    return std::nullopt;
+
+  // Lists look like 0,64 or 0-1.
+  llvm::SmallVector<llvm::StringRef> ranges;
+  llvm::StringRef(list).split(ranges, ',');
+  for (llvm::StringRef range : ranges) {
+    auto [first, last] = range.split('-');
+    int begin, end;
+    if (first.getAsInteger(10, begin))
+      return std::nullopt;
+    end = begin;
+    if (!last.empty() && last.getAsInteger(10, end))
+      return std::nullopt;
+
+    for (int sibling = begin; sibling <= end; sibling++) {
+      if (sibling != cpu)
+        return sibling;
+    }
+  }
+
+  return std::nullopt;
+}
+
+std::unique_ptr<HarnessCompiler>
+createHarnessCompiler(const llvm::Target *target, llvm::StringRef tripleName,
+                      const CPUBenchmarkOptions &options) {
+  assert(target);
+  return std::make_unique<CPUHarnessCompiler>(target, tripleName, options);
+}
+
 std::unique_ptr<BenchmarkRunner>
 createCPUBenchmarkRunner(const llvm::Target *target, llvm::StringRef tripleName,
-                         int pinnedCPU, int numRuns) {
+                         const CPUBenchmarkOptions &options) {
   assert(target);
-  return std::make_unique<CPUBenchmarkRunner>(target, tripleName, pinnedCPU,
-                                              numRuns);
+  return std::make_unique<CPUBenchmarkRunner>(target, tripleName, options);
 }
 } // namespace llvm_ml
@@ -8,11 +8,20 @@
 #include "BenchmarkRunner.hpp"
 
 #include <memory>
+#include <optional>
 
 namespace llvm_ml {
+std::optional<int> getSMTSibling(int cpu) { return std::nullopt; }
+
+std::unique_ptr<HarnessCompiler>
+createHarnessCompiler(const llvm::Target *target, llvm::StringRef tripleName,
+                      const CPUBenchmarkOptions &options) {
+  llvm_unreachable("Not implemented");
+}
+
 std::unique_ptr<BenchmarkRunner>
 createCPUBenchmarkRunner(const llvm::Target *target, llvm::StringRef tripleName,
-                         int pinnedCPU, int numRuns) {
+                         const CPUBenchmarkOptions &options) {
   llvm_unreachable("Not implemented");
 }
 } // namespace llvm_ml
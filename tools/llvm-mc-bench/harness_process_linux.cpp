@@ -0,0 +1,516 @@
+//===--- harness_process_linux.cpp - Harness process environment ----------===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#include "HarnessProcess.hpp"
+#include "counters.hpp"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <linux/memfd.h>
+#include <random>
+#include <string>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+#include <thread>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <ucontext.h>
+#include <unistd.h>
+
+constexpr size_t kAltStackSize = 64 * 1024;
+// FIXME(Alex): find a more portable way
+constexpr size_t kCacheLineSize = 64;
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+/// Pages of the memory file every mapped range takes with distinct placement.
+constexpr size_t kRangePages = 5;
+
+namespace llvm_ml {
+static void fake_bench(void *) {}
+
+bool SiblingControl::arriveAndWait() {
+  numArrived.fetch_add(1);
+  // The siblings may share a core with realtime priority, spinning must not
+  // starve the other one.
+  while (numArrived.load() < 2) {
+    if (stopped.load())
+      return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+void notifyEvent(int fd) {
+  uint64_t one = 1;
+  (void)!write(fd, &one, sizeof(one));
+}
+
+bool waitForEvent(int fd) {
+  uint64_t value;
+  while (read(fd, &value, sizeof(value)) != sizeof(value)) {
+    if (errno != EINTR)
+      return false;
+  }
+  return true;
+}
+
+bool setupHarnessProcess(int cpu) {
+  // Pin process to thread.
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(cpu, &cpuSet);
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuSet) < 0) {
+    llvm::errs() << "Failed to pin process to CPU #" << cpu << "\n";
+    return false;
+  }
+  struct sched_param schedParam = {.sched_priority = 90};
+  // Silently ignore return error in non-root mode
+  sched_setscheduler(0, SCHED_FIFO, &schedParam);
+
+  // LLVM installs its own segfault handler. We don't need that.
+  signal(SIGSEGV, SIG_DFL);
+
+  return true;
+}
+
+size_t getHarnessPageSize(PagePlacement placement) {
+  return placement == PagePlacement::Huge ? kHugePageSize
+                                          : sysconf(_SC_PAGE_SIZE);
+}
+
+PhysicalPages allocatePhysicalPages(PagePlacement placement) {
+  const size_t pageSize = getHarnessPageSize(placement);
+
+  int fd = placement == PagePlacement::Huge
+               ? memfd_create("shmem", MFD_HUGETLB | MFD_HUGE_2MB)
+               : memfd_create("shmem", 0);
+  if (fd == -1) {
+    llvm::errs() << "Failed to allocate physical page: " << strerror(errno)
+                 << "\n";
+    abort();
+  }
+
+  // Every range gets pages of its own, instead of aliasing the first one.
+  const size_t numPages = placement == PagePlacement::Distinct
+                              ? kRangePages * MAX_FAULTS
+                              : kRangePages;
+  if (ftruncate(fd, numPages * pageSize) != 0) {
+    llvm::errs() << "Failed to truncate shmem file: " << strerror(errno)
+                 << "\n";
+    abort();
+  }
+
+  return PhysicalPages{.fd = fd, .pageSize = pageSize, .placement = placement};
+}
+
+static std::pair<void *, size_t> getMappedRange(void *addr, size_t pageSize) {
+  size_t shift = reinterpret_cast<size_t>(addr) >> std::bit_width(pageSize);
+  void *pageAddr = reinterpret_cast<void *>(shift << std::bit_width(pageSize));
+
+  if (reinterpret_cast<size_t>(addr) == 0x2323000)
+    return {pageAddr, 5};
+
+  return {pageAddr, 4};
+}
+
+/// Returns the offset in the memory file of the range of \p numPages pages,
+/// that is mapped for the \p index-th harness address.
+static size_t getRangeOffset(const PhysicalPages &pages, size_t index,
+                             size_t numPages) {
+  // The first page of the file only backs the register area.
+  const size_t firstPage = numPages == 5 ? 0 : 1;
+  if (pages.placement != PagePlacement::Distinct)
+    return firstPage * pages.pageSize;
+  return (index * kRangePages + firstPage) * pages.pageSize;
+}
+
+void mapHarnessPages(const PhysicalPages &pages, HarnessLog *log) {
+  // Workers outlive the harness, pages that are mapped already must stay.
+  constexpr int flags = MAP_PRIVATE | MAP_FIXED_NOREPLACE;
+  const size_t pageSize = pages.pageSize;
+  const llvm::ArrayRef<void *> addresses = log->getAddresses();
+
+  for (auto addr : llvm::enumerate(addresses)) {
+    const auto [pageAddr, numPages] = getMappedRange(addr.value(), pageSize);
+    const size_t offset = getRangeOffset(pages, addr.index(), numPages);
+
+    for (size_t i = 0; i < numPages; i++) {
+      char *page = static_cast<char *>(pageAddr) + i * pageSize;
+      // Ranges of nearby addresses overlap, the earlier one backs the page.
+      if (isHarnessPageMapped(pageSize, addresses.take_front(addr.index()),
+                              page))
+        continue;
+
+      void *res = mmap(page, pageSize, PROT_READ | PROT_WRITE, flags,
+                       pages.fd, offset + i * pageSize);
+      // The fault handler leaves pages in use by the process alone as well,
+      // the harness reads them as they are.
+      if (res == MAP_FAILED && errno == EEXIST)
+        continue;
+      // Huge pages fail here unless enough of them are reserved.
+      if (res == MAP_FAILED) {
+        // Writing to the stream may clobber errno.
+        const char *error = strerror(errno);
+        llvm::errs() << "Failed to map address: " << error << "\n";
+        abort();
+      }
+
+      // Kernels before 4.17 take MAP_FIXED_NOREPLACE for a hint.
+      if (res != page) {
+        llvm::errs() << "Requested address " << static_cast<void *>(page)
+                     << " got " << res << " shift "
+                     << std::bit_width(pageSize) << "\n";
+        abort();
+      }
+      log->mappedPages[addr.index()] |= 1u << i;
+    }
+
+#pragma unroll
+    for (size_t i = 0; i < numPages * pageSize; i += kCacheLineSize) {
+      __builtin_prefetch(static_cast<char *>(pageAddr) + i, 0, 3);
+    }
+  }
+}
+
+bool isHarnessPageMapped(size_t pageSize, llvm::ArrayRef<void *> addresses,
+                         void *addr) {
+  const size_t page = reinterpret_cast<size_t>(addr) & ~(pageSize - 1);
+  return llvm::any_of(addresses, [&](void *mapped) {
+    const auto [pageAddr, numPages] = getMappedRange(mapped, pageSize);
+    const size_t start = reinterpret_cast<size_t>(pageAddr);
+    return page >= start && page < start + numPages * pageSize;
+  });
+}
+
+bool canMapHarnessPages(size_t pageSize, void *addr) {
+  const auto [pageAddr, numPages] = getMappedRange(addr, pageSize);
+  for (size_t i = 0; i < numPages; i++) {
+    // msync fails with ENOMEM on pages that are not mapped.
+    if (msync(static_cast<char *>(pageAddr) + i * pageSize, pageSize,
+              MS_ASYNC) == 0 ||
+        errno != ENOMEM)
+      return false;
+  }
+  return true;
+}
+
+// State of the fault handler. Harness processes are single-threaded.
+static HarnessLog *gHarnessLog = nullptr;
+static PhysicalPages gFaultPages = {};
+static size_t gFaultPageSize = 0;
+
+/// Maps the range around \p addr page by page, leaving pages that an earlier
+/// range already covers intact. The range is backed as the \p index-th one
+/// and the pages mapped are recorded at \p index of the log. Returns true if
+/// the faulting page got mapped.
+static bool mapFaultedRange(void *addr, size_t index) {
+  const auto [pageAddr, numPages] = getMappedRange(addr, gFaultPageSize);
+  const size_t offset = getRangeOffset(gFaultPages, index, numPages);
+  const size_t faultPage =
+      reinterpret_cast<size_t>(addr) & ~(gFaultPageSize - 1);
+
+  bool mappedFaultPage = false;
+  for (size_t i = 0; i < numPages; i++) {
+    char *page = static_cast<char *>(pageAddr) + i * gFaultPageSize;
+    void *res = mmap(page, gFaultPageSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED_NOREPLACE, gFaultPages.fd,
+                     offset + i * gFaultPageSize);
+    if (res == MAP_FAILED)
+      continue;
+    // Kernels before 4.17 take MAP_FIXED_NOREPLACE for a hint.
+    if (res != page) {
+      munmap(res, gFaultPageSize);
+      continue;
+    }
+    gHarnessLog->mappedPages[index] |= 1u << i;
+    if (reinterpret_cast<size_t>(page) == faultPage)
+      mappedFaultPage = true;
+  }
+
+  return mappedFaultPage;
+}
+
+void *getSignalIP(const void *ucontext) {
+  const auto *uc = static_cast<const ucontext_t *>(ucontext);
+#if defined(__x86_64__)
+  return reinterpret_cast<void *>(uc->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__aarch64__)
+  return reinterpret_cast<void *>(uc->uc_mcontext.pc);
+#else
+  (void)uc;
+  return nullptr;
+#endif
+}
+
+static void harnessFaultHandler(int, siginfo_t *info, void *ucontext) {
+  void *addr = info->si_addr;
+
+  // The faulting instruction is restarted once its page is mapped.
+  if (addr != nullptr && gHarnessLog->numAddresses < MAX_FAULTS &&
+      mapFaultedRange(addr, gHarnessLog->numAddresses)) {
+    gHarnessLog->addresses[gHarnessLog->numAddresses++] = addr;
+    return;
+  }
+
+  gHarnessLog->reason = ExitReason::Segfault;
+  gHarnessLog->faultAddr = addr;
+  gHarnessLog->faultIP = getSignalIP(ucontext);
+  _exit(1);
+}
+
+void installFaultHandler(const PhysicalPages &pages, HarnessLog *log) {
+  gHarnessLog = log;
+  gFaultPages = pages;
+  gFaultPageSize = pages.pageSize;
+
+  static char altStack[kAltStackSize];
+  stack_t ss = {.ss_sp = altStack, .ss_flags = 0, .ss_size = sizeof(altStack)};
+  sigaltstack(&ss, nullptr);
+
+  struct sigaction action = {};
+  action.sa_sigaction = harnessFaultHandler;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, nullptr);
+}
+
+void unmapHarnessPages(size_t pageSize, const HarnessLog &log) {
+  for (auto addr : llvm::enumerate(log.getAddresses())) {
+    const auto [pageAddr, numPages] = getMappedRange(addr.value(), pageSize);
+    for (size_t i = 0; i < numPages; i++) {
+      if (log.mappedPages[addr.index()] & (1u << i))
+        munmap(static_cast<char *>(pageAddr) + i * pageSize, pageSize);
+    }
+  }
+}
+
+/// Returns the size of the data or unified cache of \p level of the calling
+/// CPU, or \p fallback if sysfs does not tell.
+static size_t getCacheSize(unsigned level, size_t fallback) {
+  const std::string cpuDir = "/sys/devices/system/cpu/cpu" +
+                             std::to_string(sched_getcpu()) + "/cache/";
+  for (unsigned index = 0;; index++) {
+    const std::string dir = cpuDir + "index" + std::to_string(index) + "/";
+    std::ifstream levelFile(dir + "level");
+    if (!levelFile)
+      return fallback;
+
+    unsigned cacheLevel = 0;
+    std::string type, size;
+    levelFile >> cacheLevel;
+    std::ifstream(dir + "type") >> type;
+    std::ifstream(dir + "size") >> size;
+    if (cacheLevel != level || type == "Instruction" || size.empty())
+      continue;
+
+    // Sizes look like 48K.
+    size_t bytes = std::stoull(size);
+    if (size.back() == 'K')
+      bytes *= 1024;
+    else if (size.back() == 'M')
+      bytes *= 1024 * 1024;
+    return bytes;
+  }
+}
+
+/// Waits for the flushes and loads before it.
+static void fence() {
+#if defined(__x86_64__)
+  _mm_mfence();
+#else
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+}
+
+CacheWarmer::CacheWarmer(CacheState state, size_t pageSize)
+    : mState(state), mPageSize(pageSize) {
+  // Twice the size of a cache level pushes out whatever was in it.
+  if (state == CacheState::L2)
+    mEvictionBuffer.resize(2 * getCacheSize(1, 48 * 1024), 1);
+  else if (state == CacheState::LLC)
+    mEvictionBuffer.resize(2 * getCacheSize(2, 2 * 1024 * 1024), 1);
+}
+
+void CacheWarmer::prepare(const HarnessLog &log) const {
+  // Warm up runs and earlier samples keep the pages hot.
+  if (mState == CacheState::L1)
+    return;
+
+  // Only base pages around the addresses are prepared, huge page ranges are
+  // too large to be walked before every run.
+  const size_t pageSize = std::min<size_t>(mPageSize, sysconf(_SC_PAGE_SIZE));
+  for (auto addr : llvm::enumerate(log.getAddresses())) {
+    const auto [pageAddr, numPages] = getMappedRange(addr.value(), pageSize);
+    char *begin = static_cast<char *>(pageAddr);
+    char *rangeBegin =
+        static_cast<char *>(getMappedRange(addr.value(), mPageSize).first);
+    for (size_t i = 0; i < numPages * pageSize; i += kCacheLineSize) {
+      // Pages of the process itself may be guard pages.
+      const size_t rangePage = (begin + i - rangeBegin) / mPageSize;
+      if (!(log.mappedPages[addr.index()] & (1u << rangePage)))
+        continue;
+#if defined(__x86_64__)
+      // Other targets reject --cache-state=dram.
+      if (mState == CacheState::DRAM)
+        _mm_clflush(begin + i);
+      else
+#endif
+        (void)*static_cast<volatile char *>(begin + i);
+    }
+  }
+
+  if (mState == CacheState::DRAM) {
+    fence();
+    return;
+  }
+
+  // The data lines are the oldest ones in the cache now.
+  for (size_t i = 0; i < mEvictionBuffer.size(); i += kCacheLineSize)
+    (void)*static_cast<const volatile char *>(&mEvictionBuffer[i]);
+  fence();
+}
+
+static void warmUp(BenchmarkFn fn, HarnessArgs *args) {
+  for (size_t i = 0; i < 5; i++)
+    fn(nullptr, reinterpret_cast<void *>(&fake_bench),
+       reinterpret_cast<void *>(&fake_bench), args);
+}
+
+/// Runs \p fn once and stores its counters in \p sample.
+static void takeSample(BenchmarkFn fn, CountersContext *counters,
+                       const CacheWarmer &cache, const HarnessLog &log,
+                       HarnessArgs *args, BenchmarkResult &sample) {
+  // Voluntarily give up processor time to get a full CPU slice.
+  std::this_thread::yield();
+  cache.prepare(log);
+  auto start = std::chrono::high_resolution_clock::now();
+  fn(counters, reinterpret_cast<void *>(&counters_start),
+     reinterpret_cast<void *>(&counters_stop), args);
+  auto end = std::chrono::high_resolution_clock::now();
+
+  // Mock counters scale with the repeat count.
+  sample.numRuns = args->numRepeat;
+  llvm_ml::flushCounters(counters, sample);
+  sample.wallTime = std::chrono::nanoseconds(end - start).count();
+}
+
+void measureHarness(BenchmarkFn fn, CountersContext *counters,
+                    const CacheWarmer &cache, SampleRing *samples, int numRuns,
+                    HarnessArgs *args, const StoppingRule &rule,
+                    HarnessLog *log) {
+  warmUp(fn, args);
+
+  stat::running_statistics cycles;
+  log->stopReason = StopReason::MaxRuns;
+
+  prefetchCounters(counters);
+  for (int i = 0; i < numRuns; i++) {
+    // Waits for the parent if the ring is full, before the clock starts.
+    BenchmarkResult &sample = samples->claim();
+    takeSample(fn, counters, cache, *log, args, sample);
+
+    const bool accepted = rule.accepts(sample);
+    const uint64_t numCycles = sample.numCycles;
+    samples->commit();
+
+    if (!accepted)
+      continue;
+
+    cycles.push(numCycles);
+    if (auto reason = rule.check(cycles)) {
+      log->stopReason = *reason;
+      break;
+    }
+  }
+}
+
+void measureInterleaved(BenchmarkFn fn, CountersContext *counters,
+                        const CacheWarmer &cache, SampleRing *samples,
+                        int numPairs, HarnessArgs *args,
+                        const Interleaving &interleave,
+                        const StoppingRule &rule, HarnessLog *log) {
+  HarnessArgs baselineArgs = interleave.baselineArgs;
+  warmUp(interleave.baseline, &baselineArgs);
+  warmUp(fn, args);
+
+  std::minstd_rand rng(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+
+  stat::running_statistics cycles;
+  stat::running_statistics differences;
+  log->stopReason = StopReason::MaxRuns;
+
+  prefetchCounters(counters);
+  for (int i = 0; i < numPairs; i++) {
+    // Both slots are claimed up front, so that the parent never stalls the
+    // pair in between the runs.
+    BenchmarkResult &baseline = samples->claim(0);
+    BenchmarkResult &workload = samples->claim(1);
+
+    const bool baselineFirst =
+        interleave.order != InterleaveOrder::Random || (rng() & 1) == 0;
+    if (baselineFirst) {
+      takeSample(interleave.baseline, counters, cache, *log, &baselineArgs,
+                 baseline);
+      takeSample(fn, counters, cache, *log, args, workload);
+    } else {
+      takeSample(fn, counters, cache, *log, args, workload);
+      takeSample(interleave.baseline, counters, cache, *log, &baselineArgs,
+                 baseline);
+    }
+
+    const bool accepted = rule.accepts(baseline) && rule.accepts(workload);
+    const uint64_t numCycles = workload.numCycles;
+    const double delta = static_cast<double>(workload.numCycles) -
+                         static_cast<double>(baseline.numCycles);
+    samples->commit(2);
+
+    if (!accepted)
+      continue;
+
+    cycles.push(numCycles);
+    differences.push(delta);
+    if (auto reason = rule.check(cycles, differences)) {
+      log->stopReason = *reason;
+      break;
+    }
+  }
+}
+
+void measureCoRunner(BenchmarkFn fn, CountersContext *counters,
+                     SampleRing *samples, HarnessArgs *args,
+                     const HarnessLog &log, SiblingControl *control) {
+  warmUp(fn, args);
+  if (!control->arriveAndWait())
+    return;
+
+  // The co-runner only keeps the sibling busy, its pages stay hot.
+  const CacheWarmer cache(CacheState::L1, sysconf(_SC_PAGE_SIZE));
+
+  prefetchCounters(counters);
+  while (!control->stopped.load(std::memory_order_acquire)) {
+    // Keeps the sibling busy, rather than waiting for the parent to drain
+    // the ring.
+    if (samples->isFull()) {
+      fn(nullptr, reinterpret_cast<void *>(&fake_bench),
+         reinterpret_cast<void *>(&fake_bench), args);
+      continue;
+    }
+
+    BenchmarkResult &sample = samples->claim();
+    takeSample(fn, counters, cache, log, args, sample);
+    samples->commit();
+  }
+}
+} // namespace llvm_ml
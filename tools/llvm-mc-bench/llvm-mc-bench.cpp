@@ -6,9 +6,15 @@
 #include "BenchmarkGenerator.hpp"
 #include "BenchmarkResult.hpp"
 #include "BenchmarkRunner.hpp"
+#include "Calibration.hpp"
+#include "Estimator.hpp"
+#include "Scheduler.hpp"
 #include "counters.hpp"
 #include "llvm-ml/target/Target.hpp"
 
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/StringSwitch.h"
 #include "llvm/AsmParser/Parser.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
 #include "llvm/IR/IRBuilder.h"
@@ -34,9 +40,12 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Compression.h"
 #include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/FormatVariadic.h"
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetSelect.h"
@@ -44,13 +53,22 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/TargetParser/Host.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <indicators/indicators.hpp>
 #include <iostream>
+#include <limits>
 #include <llvm/Support/Error.h>
-#include <range/v3/algorithm/min_element.hpp>
-#include <range/v3/iterator/operations.hpp>
-#include <range/v3/view/filter.hpp>
+#include <map>
+#include <mutex>
+#include <optional>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <thread>
 
 namespace fs = std::filesystem;
 using namespace llvm;
@@ -94,16 +112,312 @@ static cl::opt<int> MaxFailed(
     cl::desc("maximum percent of failed samples, integer in range 1 to 99"),
     cl::init(10), cl::cat(ToolOptions));
 
+static cl::opt<llvm_ml::OutlierRule> Outliers(
+    "outliers", cl::desc("reject samples, whose cycles are far from the rest"),
+    cl::values(clEnumValN(llvm_ml::OutlierRule::None, "none",
+                          "keep every sample within the limits"),
+               clEnumValN(llvm_ml::OutlierRule::MAD, "mad",
+                          "reject samples more than --outlier-threshold "
+                          "median absolute deviations from the median"),
+               clEnumValN(llvm_ml::OutlierRule::IQR, "iqr",
+                          "reject samples more than --outlier-threshold "
+                          "interquartile ranges outside of the quartiles")),
+    cl::init(llvm_ml::OutlierRule::None), cl::cat(ToolOptions));
+
+static cl::opt<double> OutlierThreshold(
+    "outlier-threshold",
+    cl::desc("distance beyond which a sample is an outlier, 0 picks 3.5 for "
+             "--outliers=mad and 1.5 for --outliers=iqr"),
+    cl::init(0.0), cl::cat(ToolOptions));
+
+static cl::opt<double> MaxInstructionDeviation(
+    "max-instruction-deviation",
+    cl::desc("reject samples, whose retired instructions differ from the "
+             "median by more than this percent, 0 disables the check"),
+    cl::init(0.0), cl::cat(ToolOptions));
+
+static cl::opt<llvm_ml::EstimatorKind> EstimatorOpt(
+    "estimator", cl::desc("how cycles of the accepted samples are aggregated"),
+    cl::values(
+        clEnumValN(llvm_ml::EstimatorKind::Min, "min", "the fastest sample"),
+        clEnumValN(llvm_ml::EstimatorKind::Median, "median",
+                   "the median sample"),
+        clEnumValN(llvm_ml::EstimatorKind::TrimmedMean, "trimmed-mean",
+                   "mean of the samples left after dropping --trim percent "
+                   "from either tail"),
+        clEnumValN(llvm_ml::EstimatorKind::MinOfK, "min-of-k",
+                   "mean of the --min-of-k fastest samples")),
+    cl::init(llvm_ml::EstimatorKind::Min), cl::cat(ToolOptions));
+
+static cl::opt<unsigned>
+    Trim("trim",
+         cl::desc("percent of samples --estimator=trimmed-mean drops from "
+                  "either tail"),
+         cl::init(10), cl::cat(ToolOptions));
+
+static cl::opt<unsigned>
+    MinOfK("min-of-k",
+           cl::desc("number of samples --estimator=min-of-k averages"),
+           cl::init(5), cl::cat(ToolOptions));
+
+static cl::opt<int> MinRuns(
+    "min-runs",
+    cl::desc("minimum number of samples before a measurement may stop early"),
+    cl::init(10), cl::cat(ToolOptions));
+
+static cl::opt<double> TargetPrecision(
+    "target-precision",
+    cl::desc("stop taking samples once the 95% confidence interval of cycles "
+             "per block iteration, workload minus baseline, is within this "
+             "percent of them, 0 (default) always takes -r samples"),
+    cl::init(0.0), cl::cat(ToolOptions));
+
+static cl::opt<unsigned> MaxCoV(
+    "max-cov",
+    cl::desc("give up on blocks whose coefficient of variation is above this "
+             "percent with 95% confidence, same as llvm-mc-dataset --max-cov, "
+             "100 (default) never gives up"),
+    cl::init(100), cl::cat(ToolOptions));
+
 static cl::opt<int> MaxNumRepeat(
     "max-num-repeat",
     cl::desc("maximum number of basic block repititions for benchmark run, "
              "only makes sense when --num-repeat=0"),
     cl::init(120), cl::cat(ToolOptions));
 
+/// Frontend path the unrolled workload is meant to run from.
+enum class FrontendTarget { Any, UopCache, Decoders };
+
+static cl::opt<FrontendTarget> Frontend(
+    "frontend",
+    cl::desc("frontend path the unrolled workload runs from, when the repeat "
+             "count is picked automatically"),
+    cl::values(clEnumValN(FrontendTarget::Any, "any",
+                          "pick the repeat count from run time only"),
+               clEnumValN(FrontendTarget::UopCache, "uop-cache",
+                          "repeat the block at most as many times as fit "
+                          "--code-budget"),
+               clEnumValN(FrontendTarget::Decoders, "decoders",
+                          "repeat the block more times than fit "
+                          "--code-budget, even past --max-num-repeat")),
+    cl::init(FrontendTarget::Any), cl::cat(ToolOptions));
+
+static cl::opt<unsigned> CodeBudget(
+    "code-budget",
+    cl::desc("bytes of unrolled workload code, that the uop cache is assumed "
+             "to hold. Tells the frontend regime recorded for every block"),
+    cl::init(4096), cl::cat(ToolOptions));
+
+static cl::opt<int> UnrollFactor(
+    "unroll-factor",
+    cl::desc("number of basic block copies inside of the harness loop, the "
+             "trip count is set at run time. 0 unrolls all repetitions"),
+    cl::init(0), cl::cat(ToolOptions));
+
+static cl::opt<bool> EncodeMC(
+    "mc-encode",
+    cl::desc("encode harnesses straight to machine code with MCCodeEmitter "
+             "instead of going through LLVM IR, codegen and linking"),
+    cl::init(false), cl::cat(ToolOptions));
+
+static cl::opt<bool> PredictPages(
+    "predict-pages",
+    cl::desc("compute the data pages the block touches from its memory "
+             "operands and map them before the first run, the remaining "
+             "pages are found by running the harness"),
+    cl::init(true), cl::cat(ToolOptions));
+
+static cl::opt<llvm_ml::CountersBackend> Counters(
+    "counters", cl::desc("how harnesses read PMU counters"),
+    cl::values(clEnumValN(llvm_ml::CountersBackend::RDPMC, "rdpmc",
+                          "one perf event group read with rdpmc from user "
+                          "space, falls back to pmu if unavailable and no "
+                          "events are requested"),
+               clEnumValN(llvm_ml::CountersBackend::PMU, "pmu",
+                          "libpmu counters driven by system calls")),
+    cl::init(llvm_ml::CountersBackend::RDPMC), cl::cat(ToolOptions));
+
+static cl::opt<llvm_ml::InterleaveOrder> Interleave(
+    "interleave",
+    cl::desc("interleave baseline and workload runs within a single harness "
+             "process and subtract them in pairs"),
+    cl::values(clEnumValN(llvm_ml::InterleaveOrder::None, "none",
+                          "measure baseline and workload in separate passes"),
+               clEnumValN(llvm_ml::InterleaveOrder::Alternate, "alternate",
+                          "run the baseline right before every workload run"),
+               clEnumValN(llvm_ml::InterleaveOrder::Random, "random",
+                          "run baseline or workload of every pair first at "
+                          "random")),
+    cl::init(llvm_ml::InterleaveOrder::None), cl::cat(ToolOptions));
+
+static cl::opt<llvm_ml::CacheState> CacheStateOpt(
+    "cache-state",
+    cl::desc("cache level the data pages of the block are in, when a run "
+             "starts. Cold states lift --max-cache-misses unless it is given"),
+    cl::values(clEnumValN(llvm_ml::CacheState::L1, "l1",
+                          "keep the pages hot in L1"),
+               clEnumValN(llvm_ml::CacheState::L2, "l2",
+                          "evict the pages from L1 before every run"),
+               clEnumValN(llvm_ml::CacheState::LLC, "llc",
+                          "evict the pages from L1 and L2 before every run"),
+               clEnumValN(llvm_ml::CacheState::DRAM, "dram",
+                          "flush the pages from every cache level before "
+                          "every run, x86-64 only")),
+    cl::init(llvm_ml::CacheState::L1), cl::cat(ToolOptions));
+
+static cl::opt<llvm_ml::PagePlacement> PagePlacementOpt(
+    "page-placement", cl::desc("physical memory behind the data pages"),
+    cl::values(clEnumValN(llvm_ml::PagePlacement::Shared, "shared",
+                          "every page range aliases the same physical pages"),
+               clEnumValN(llvm_ml::PagePlacement::Distinct, "distinct",
+                          "every page range has physical pages of its own, "
+                          "so that ranges do not alias each other"),
+               clEnumValN(llvm_ml::PagePlacement::Huge, "huge",
+                          "2M huge pages, that keep TLB misses out. Needs "
+                          "huge pages reserved in /proc/sys/vm/nr_hugepages")),
+    cl::init(llvm_ml::PagePlacement::Shared), cl::cat(ToolOptions));
+
+static cl::opt<std::string> EventsSpec(
+    "events",
+    cl::desc("comma-separated events to count in addition to cycles, "
+             "instructions, cache misses and context switches: uops, "
+             "misaligned_loads, branch_misses, llc_misses, ref_cycles, raw "
+             "r<hex> codes or @intel, @amd and @auto presets"),
+    cl::init("@auto"), cl::cat(ToolOptions));
+
+static cl::opt<unsigned> EventSlots(
+    "event-slots",
+    cl::desc("number of PMU counters available to events in a single pass, "
+             "the rest of the events are counted in extra passes"),
+    cl::init(3), cl::cat(ToolOptions));
+
+static cl::opt<bool> Topdown(
+    "topdown",
+    cl::desc("count top-down analysis events and store the frontend bound, "
+             "bad speculation, retiring and backend bound breakdown of every "
+             "block, requires --counters=rdpmc and, on cores without "
+             "PERF_METRICS, 4 --event-slots"),
+    cl::init(false), cl::cat(ToolOptions));
+
+static cl::opt<bool> PortPressure(
+    "port-pressure",
+    cl::desc("count micro-ops dispatched to every execution port in extra "
+             "passes and store them per block iteration, skipped on CPUs "
+             "without such events"),
+    cl::init(false), cl::cat(ToolOptions));
+
+static cl::opt<unsigned> RegressionPoints(
+    "regression-points",
+    cl::desc("measure the block at this many repeat counts from "
+             "--num-repeat-noise to the workload one and fit cycles per "
+             "iteration with Theil-Sen regression, 0 subtracts noise from "
+             "workload"),
+    cl::init(0), cl::cat(ToolOptions));
+
+/// Blocks measured in addition to the block as written.
+enum class DependencyModes { None, Latency, Throughput, Both };
+
+static cl::opt<DependencyModes> Mode(
+    "mode",
+    cl::desc("also measure the block rewritten so that its copies form a "
+             "dependency chain, or so that they are independent"),
+    cl::values(clEnumValN(DependencyModes::None, "verbatim",
+                          "measure the block as written only"),
+               clEnumValN(DependencyModes::Latency, "latency",
+                          "chain every copy to a result of the previous one"),
+               clEnumValN(DependencyModes::Throughput, "throughput",
+                          "rename registers of unrolled copies, so that they "
+                          "do not wait for each other"),
+               clEnumValN(DependencyModes::Both, "both",
+                          "measure both latency and throughput variants")),
+    cl::init(DependencyModes::None), cl::cat(ToolOptions));
+
+static cl::list<unsigned> CodeAlignments(
+    "code-alignments", cl::CommaSeparated,
+    cl::desc("also measure the block with its first instruction at each of "
+             "these byte offsets from a 64-byte boundary, e.g. 0,16,32,48"),
+    cl::cat(ToolOptions));
+
+static cl::opt<std::string> CoRunnerSpec(
+    "co-runner",
+    cl::desc("assembly file of a block to run on the SMT sibling of every "
+             "measurement core while blocks are measured, or one of the "
+             "stress kernels @alu and @fp"),
+    cl::cat(ToolOptions));
+
+static cl::opt<int> CoRunnerCPU(
+    "co-runner-cpu",
+    cl::desc("CPU core to run --co-runner on instead of the SMT sibling "
+             "sysfs topology lists, only with a single measurement core"),
+    cl::init(-1), cl::cat(ToolOptions));
+
+static cl::opt<bool> Calibrate(
+    "calibrate",
+    cl::desc("subtract the harness overhead calibrated once per measurement "
+             "core instead of running a baseline for every block, overrides "
+             "--interleave"),
+    cl::init(false), cl::cat(ToolOptions));
+
+static cl::opt<std::string> CalibrationCachePath(
+    "calibration-cache",
+    cl::desc("file to keep calibrated overheads in between runs, defaults to "
+             "llvm-ml/calibration.json in the user cache directory"),
+    cl::cat(ToolOptions));
+
+static cl::opt<unsigned> CalibrationInterval(
+    "calibration-interval",
+    cl::desc("seconds after which the overhead of a core is calibrated again"),
+    cl::init(600), cl::cat(ToolOptions));
+
+static cl::opt<double> MaxFrequencyDrift(
+    "max-frequency-drift",
+    cl::desc("count reference cycles along with cycles and reject samples, "
+             "whose cycles per reference cycle differ by more than this "
+             "percent from the first block measured on the core, 0 disables "
+             "the check"),
+    cl::init(0.0), cl::cat(ToolOptions));
+
+static cl::list<std::string> Sentinels(
+    "sentinels", cl::CommaSeparated,
+    cl::desc("assembly files of blocks, that every measurement core measures "
+             "again every --sentinel-interval blocks in batch mode to detect "
+             "frequency drift"),
+    cl::cat(ToolOptions));
+
+static cl::opt<unsigned> SentinelInterval(
+    "sentinel-interval",
+    cl::desc("number of blocks a core measures between sentinel checks"),
+    cl::init(1000), cl::cat(ToolOptions));
+
+static cl::opt<double> MaxSentinelDrift(
+    "max-sentinel-drift",
+    cl::desc("percent, by which cycles of a sentinel may differ from its first "
+             "measurement, before the blocks measured since the last check "
+             "are listed in suspect.txt of the output directory"),
+    cl::init(2.0), cl::cat(ToolOptions));
+
 static cl::list<int>
     PinnedCPUs("c", cl::desc("IDs of the CPU cores to pin this process to"),
                cl::Required, cl::cat(ToolOptions));
 
+static cl::list<int> HousekeepingCPUs(
+    "housekeeping-cpus",
+    cl::desc("IDs of the CPU cores to generate and compile harnesses on, must "
+             "not overlap with the measurement cores"),
+    cl::CommaSeparated, cl::cat(ToolOptions));
+
+static cl::opt<bool>
+    UseJIT("jit",
+           cl::desc("materialize harnesses in-process with ORC JIT instead of "
+                    "linking a shared library with the system linker"),
+           cl::init(false), cl::cat(ToolOptions));
+
+static cl::opt<bool> UseWorkers(
+    "workers",
+    cl::desc("measure in persistent worker processes pinned to every CPU "
+             "instead of forking for each pass, implies --jit"),
+    cl::init(false), cl::cat(ToolOptions));
+
 static cl::opt<bool>
     ReadableJSON("readable-json",
                  cl::desc("export measurements to a JSON file"), cl::init(0),
@@ -121,6 +435,36 @@ static cl::opt<std::string>
     LogFile("log-file", cl::desc("Path to a file to log errors in batch mode"),
             cl::cat(ToolOptions));
 
+/// Events parsed from --events.
+static llvm::SmallVector<llvm_ml::EventSpec> Events;
+
+/// Overheads calibrated with --calibrate, shared by all measurement cores.
+static std::unique_ptr<llvm_ml::CalibrationCache> Calibrations;
+/// Calibrations only apply to the same host, harness and counters.
+static std::string CalibrationKey;
+
+/// Cycles per reference cycle of every measurement core, taken from the first
+/// block measured on it.
+static std::map<int, double> FrequencyRatios;
+static std::mutex FrequencyRatiosMutex;
+
+/// Harness of --co-runner, compiled once and shared by all measurement cores.
+static std::unique_ptr<llvm_ml::CompiledHarness> CoRunnerHarness;
+static llvm_ml::BenchmarkFn CoRunnerFn = nullptr;
+static std::string CoRunnerSource;
+static int CoRunnerNumRepeat = 0;
+/// CPU the co-runner of every measurement core runs on.
+static std::map<int, int> CoRunnerCPUs;
+
+/// Number of compiled harnesses, that may wait in the queue of every
+/// measurement core.
+constexpr size_t kPreparedBlocksPerCore = 4;
+
+/// Time drifted sentinels are given to get back to their cycles before they
+/// are measured again, and the number of times they are.
+constexpr std::chrono::seconds kSentinelPause{5};
+constexpr unsigned kSentinelRetries = 3;
+
 static void clearTerminalColors() {
   indicators::show_console_cursor(true);
   std::cout << termcolor::reset;
@@ -149,11 +493,321 @@ static const Target *getTarget() {
   return target;
 }
 
-llvm::Error runSingleFile(fs::path input, fs::path output,
-                          const llvm::Target *target, int numRepeat,
-                          int numNoiseRepeat, int pinnedCPU) {
+/// A basic block with a harness compiled ahead of measurement.
+struct PreparedVariant;
+
+struct PreparedBlock {
+  fs::path input;
+  fs::path output;
+  std::string source;
+  /// Repeat count of the workload, 0 if the harness is only meant to estimate
+  /// it.
+  int numRepeat;
+  std::unique_ptr<llvm_ml::CompiledHarness> harness;
+  /// Data addresses predicted from the code of the block.
+  std::vector<void *> dataAddresses;
+  /// Encoded bytes of one copy of the block, 0 if it could not be encoded.
+  uint64_t codeSize = 0;
+  /// Offset of the first instruction from a code alignment boundary, not set
+  /// if the block is placed wherever the harness puts it.
+  std::optional<unsigned> startOffset;
+  /// Rewritten blocks requested with --mode.
+  std::vector<PreparedVariant> variants;
+  /// The same block placed at --code-alignments.
+  std::vector<PreparedBlock> alignments;
+};
+
+/// Block rewritten for a dependency mode, measured along with the original.
+struct PreparedVariant {
+  llvm_ml::DependencyMode mode;
+  unsigned numCopies;
+  PreparedBlock block;
+};
+
+/// MC layer objects needed to parse basic blocks.
+struct MCEnvironment {
+  Triple triple;
+  MCTargetOptions options;
+  std::unique_ptr<MCRegisterInfo> mcri;
+  std::unique_ptr<MCAsmInfo> mcai;
+  std::unique_ptr<MCSubtargetInfo> msti;
+  std::unique_ptr<MCInstrInfo> mcii;
+  std::unique_ptr<MCContext> context;
+  std::unique_ptr<MCObjectFileInfo> mcofi;
+
+  explicit MCEnvironment(const llvm::Target *target)
+      : triple(TripleName), options(mc::InitMCTargetOptionsFromFlags()) {
+    mcri.reset(target->createMCRegInfo(TripleName));
+    mcai.reset(target->createMCAsmInfo(*mcri, TripleName, options));
+    msti.reset(target->createMCSubtargetInfo(TripleName, "", ""));
+    mcii.reset(target->createMCInstrInfo());
+    context = std::make_unique<MCContext>(triple, mcai.get(), mcri.get(),
+                                          msti.get());
+    mcofi.reset(target->createMCObjectFileInfo(*context, /*PIC=*/false));
+    context->setObjectFileInfo(mcofi.get());
+  }
+
+  Expected<std::vector<MCInst>> parse(const llvm::Target *target,
+                                      StringRef source) {
+    SourceMgr srcMgr;
+    srcMgr.AddNewSourceBuffer(MemoryBuffer::getMemBuffer(source), SMLoc());
+
+    return llvm_ml::parseAssembly(srcMgr, *mcii, *mcri, *mcai, *msti,
+                                  *context, target, triple, options);
+  }
+};
+
+static llvm::Expected<std::unique_ptr<llvm_ml::CompiledHarness>>
+encodeHarness(const llvm::Target *target, llvm_ml::HarnessCompiler &compiler,
+              StringRef microbenchAsm, int numNoiseRepeat, int numRepeat,
+              std::optional<unsigned> startOffset) {
+  MCEnvironment env(target);
+
+  auto block = env.parse(target, microbenchAsm);
+  if (!block)
+    return block.takeError();
+
+  auto mlTarget = llvm_ml::createMLTarget(env.triple, env.mcii.get());
+  auto encoder = mlTarget->createHarnessEncoder(target, *env.context,
+                                                *env.msti, env.options);
+  if (!encoder)
+    return encoder.takeError();
+
+  auto harness = llvm_ml::encodeCPUTestHarness(
+      *block, numNoiseRepeat, numRepeat, UnrollFactor, **encoder, startOffset);
+  if (!harness)
+    return harness.takeError();
+
+  return compiler.load(*harness);
+}
+
+static llvm::Expected<std::unique_ptr<llvm_ml::CompiledHarness>>
+compileHarness(const llvm::Target *target, llvm_ml::HarnessCompiler &compiler,
+               StringRef microbenchAsm, int numNoiseRepeat, int numRepeat,
+               std::optional<unsigned> startOffset = std::nullopt) {
+  if (EncodeMC)
+    return encodeHarness(target, compiler, microbenchAsm, numNoiseRepeat,
+                         numRepeat, startOffset);
+
   Triple triple(TripleName);
+  std::unique_ptr<MCInstrInfo> mcii(target->createMCInstrInfo());
+
+  auto mlTarget = llvm_ml::createMLTarget(triple, mcii.get());
+
+  auto llvmContext = std::make_unique<LLVMContext>();
+  auto inlineAsm = mlTarget->createInlineAsmBuilder();
+
+  auto module =
+      UnrollFactor == 0
+          ? llvm_ml::createCPUTestHarness(*llvmContext, microbenchAsm.str(),
+                                          numNoiseRepeat, numRepeat, *inlineAsm,
+                                          startOffset)
+          : llvm_ml::createCPULoopTestHarness(*llvmContext,
+                                              microbenchAsm.str(), UnrollFactor,
+                                              *inlineAsm, startOffset);
+
+  if (!module) {
+    return llvm::createStringError(std::errc::invalid_argument,
+                                   "Failed to generate test harness");
+  }
+
+  return compiler.compile(std::move(module));
+}
+
+/// Predicts the data addresses \p microbenchAsm accesses. Blocks that can not
+/// be parsed get no prediction, their pages are found by running them.
+static std::vector<void *> predictDataAddresses(const llvm::Target *target,
+                                                StringRef microbenchAsm) {
+  MCEnvironment env(target);
+
+  auto block = env.parse(target, microbenchAsm);
+  if (!block) {
+    consumeError(block.takeError());
+    return {};
+  }
+
+  auto mlTarget = llvm_ml::createMLTarget(env.triple, env.mcii.get());
+
+  std::vector<void *> addresses;
+  for (uint64_t addr : mlTarget->predictDataAddresses(*block))
+    addresses.push_back(reinterpret_cast<void *>(addr));
+
+  return addresses;
+}
+
+/// Returns the encoded size of \p microbenchAsm in bytes, 0 if it can not be
+/// parsed or encoded.
+static uint64_t getCodeSize(const llvm::Target *target,
+                            StringRef microbenchAsm) {
+  MCEnvironment env(target);
+
+  auto block = env.parse(target, microbenchAsm);
+  if (!block) {
+    consumeError(block.takeError());
+    return 0;
+  }
+
+  auto mlTarget = llvm_ml::createMLTarget(env.triple, env.mcii.get());
+  auto encoder = mlTarget->createHarnessEncoder(target, *env.context,
+                                                *env.msti, env.options);
+  if (!encoder) {
+    consumeError(encoder.takeError());
+    return 0;
+  }
+
+  auto size = (*encoder)->getCodeSize(*block);
+  if (!size) {
+    consumeError(size.takeError());
+    return 0;
+  }
+  return *size;
+}
+
+/// Returns the assembly of the stress kernel --co-runner names, if it does.
+/// Independent chains keep the execution ports of the sibling busy.
+static std::optional<StringRef> getStressKernel(StringRef name) {
+  return llvm::StringSwitch<std::optional<StringRef>>(name)
+      .Case("@alu", "addq %rax, %rax\n"
+                    "addq %rbx, %rbx\n"
+                    "addq %rcx, %rcx\n"
+                    "addq %rdx, %rdx\n")
+      .Case("@fp", "mulpd %xmm0, %xmm0\n"
+                   "mulpd %xmm1, %xmm1\n"
+                   "mulpd %xmm2, %xmm2\n"
+                   "mulpd %xmm3, %xmm3\n")
+      .Default(std::nullopt);
+}
+
+/// Compiles the harness of --co-runner, if it is given.
+static llvm::Error prepareCoRunner(const llvm::Target *target,
+                                   llvm_ml::HarnessCompiler &compiler) {
+  if (CoRunnerSpec.empty())
+    return llvm::Error::success();
+
+  if (std::optional<StringRef> kernel = getStressKernel(CoRunnerSpec)) {
+    CoRunnerSource = kernel->str();
+  } else {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buffer =
+        MemoryBuffer::getFile(CoRunnerSpec, /*IsText=*/true);
+    if (std::error_code ec = buffer.getError())
+      return llvm::createStringError(ec, "Failed to open co-runner %s",
+                                     CoRunnerSpec.c_str());
+    CoRunnerSource = (*buffer)->getBuffer().str();
+  }
+
+  // Short runs let the co-runner stop soon after the harness does.
+  CoRunnerNumRepeat = UnrollFactor != 0
+                          ? alignTo(MaxNumRepeat, UnrollFactor)
+                          : static_cast<int>(MaxNumRepeat);
+  auto harness =
+      compileHarness(target, compiler, CoRunnerSource, 0, CoRunnerNumRepeat);
+  if (!harness)
+    return harness.takeError();
+
+  auto fn = (*harness)->lookup(llvm_ml::kWorkloadName);
+  if (!fn)
+    return fn.takeError();
+
+  CoRunnerHarness = std::move(*harness);
+  CoRunnerFn = *fn;
+  return llvm::Error::success();
+}
 
+/// Rewrites \p block into the variants --mode asks for and compiles their
+/// harnesses. Blocks, that can not be rewritten, are measured as written
+/// only.
+static void prepareVariants(PreparedBlock &block, const llvm::Target *target,
+                            llvm_ml::HarnessCompiler &compiler, int numRepeat,
+                            int numNoiseRepeat) {
+  llvm::SmallVector<llvm_ml::DependencyMode, 2> modes;
+  if (Mode == DependencyModes::Latency || Mode == DependencyModes::Both)
+    modes.push_back(llvm_ml::DependencyMode::Latency);
+  if (Mode == DependencyModes::Throughput || Mode == DependencyModes::Both)
+    modes.push_back(llvm_ml::DependencyMode::Throughput);
+  if (modes.empty())
+    return;
+
+  MCEnvironment env(target);
+
+  auto instructions = env.parse(target, block.source);
+  if (!instructions) {
+    consumeError(instructions.takeError());
+    return;
+  }
+
+  auto mlTarget = llvm_ml::createMLTarget(env.triple, env.mcii.get());
+  std::unique_ptr<MCInstPrinter> printer(target->createMCInstPrinter(
+      env.triple, /*SyntaxVariant=*/0, *env.mcai, *env.mcii, *env.mcri));
+  if (!printer)
+    return;
+
+  for (llvm_ml::DependencyMode mode : modes) {
+    auto variant =
+        mlTarget->createDependencyVariant(*instructions, mode, *env.mcri);
+    if (!variant) {
+      consumeError(variant.takeError());
+      continue;
+    }
+
+    std::string source;
+    raw_string_ostream os(source);
+    for (const MCInst &inst : variant->instructions) {
+      printer->printInst(&inst, /*Address=*/0, "", *env.msti, os);
+      os << "\n";
+    }
+    os.flush();
+
+    auto harness =
+        compileHarness(target, compiler, source, numNoiseRepeat, numRepeat);
+    if (!harness) {
+      consumeError(harness.takeError());
+      continue;
+    }
+
+    // Renaming registers leaves memory operands as they are.
+    const uint64_t codeSize = getCodeSize(target, source);
+    PreparedBlock variantBlock{.input = block.input,
+                               .source = std::move(source),
+                               .numRepeat = numRepeat,
+                               .harness = std::move(*harness),
+                               .dataAddresses = block.dataAddresses,
+                               .codeSize = codeSize};
+    block.variants.push_back(PreparedVariant{
+        mode, variant->numCopies, std::move(variantBlock)});
+  }
+}
+
+/// Compiles harnesses, that place \p block at each of --code-alignments.
+static llvm::Error prepareAlignments(PreparedBlock &block,
+                                     const llvm::Target *target,
+                                     llvm_ml::HarnessCompiler &compiler,
+                                     int numRepeat, int numNoiseRepeat) {
+  for (unsigned offset : CodeAlignments) {
+    auto harness = compileHarness(target, compiler, block.source,
+                                  numNoiseRepeat, numRepeat, offset);
+    if (!harness)
+      return harness.takeError();
+
+    block.alignments.push_back(
+        PreparedBlock{.input = block.input,
+                      .source = block.source,
+                      .numRepeat = numRepeat,
+                      .harness = std::move(*harness),
+                      .dataAddresses = block.dataAddresses,
+                      .codeSize = block.codeSize,
+                      .startOffset = offset});
+  }
+
+  return llvm::Error::success();
+}
+
+/// Reads the basic block from \p input and compiles its harness, along with
+/// the ones of its --mode variants and --code-alignments. Does not touch the
+/// measurement cores.
+llvm::Expected<PreparedBlock> prepareBlock(fs::path input, fs::path output,
+                                           const llvm::Target *target,
+                                           llvm_ml::HarnessCompiler &compiler,
+                                           int numRepeat, int numNoiseRepeat) {
   ErrorOr<std::unique_ptr<MemoryBuffer>> buffer =
       MemoryBuffer::getFileOrSTDIN(input.c_str(), /*IsText=*/true);
   if (std::error_code ec = buffer.getError()) {
@@ -161,55 +815,310 @@ llvm::Error runSingleFile(fs::path input, fs::path output,
                                    input.c_str());
   }
 
-  const MCTargetOptions options = mc::InitMCTargetOptionsFromFlags();
-  std::unique_ptr<MCRegisterInfo> mcri(target->createMCRegInfo(TripleName));
-  std::unique_ptr<MCAsmInfo> mcai(
-      target->createMCAsmInfo(*mcri, TripleName, options));
-  std::unique_ptr<MCSubtargetInfo> msti(
-      target->createMCSubtargetInfo(TripleName, "", ""));
-  std::unique_ptr<MCInstrInfo> mcii(target->createMCInstrInfo());
+  PreparedBlock block{.input = std::move(input),
+                      .output = std::move(output),
+                      .source = (*buffer)->getBuffer().str(),
+                      .numRepeat = numRepeat};
 
-  MCContext context(triple, mcai.get(), mcri.get(), msti.get());
-  std::unique_ptr<MCObjectFileInfo> mcofi(
-      target->createMCObjectFileInfo(context, /*PIC=*/false));
-  context.setObjectFileInfo(mcofi.get());
+  auto harness = compileHarness(target, compiler, block.source,
+                                numNoiseRepeat, numRepeat);
+  if (!harness)
+    return harness.takeError();
+  block.harness = std::move(*harness);
 
-  std::string microbenchAsm = (*buffer)->getBuffer().str();
+  if (PredictPages)
+    block.dataAddresses = predictDataAddresses(target, block.source);
 
-  auto mlTarget = llvm_ml::createMLTarget(triple, mcii.get());
+  block.codeSize = getCodeSize(target, block.source);
 
-  auto llvmContext = std::make_unique<LLVMContext>();
-  auto inlineAsm = mlTarget->createInlineAsmBuilder();
+  prepareVariants(block, target, compiler, numRepeat, numNoiseRepeat);
 
-  auto runner = llvm_ml::createCPUBenchmarkRunner(target, TripleName, pinnedCPU,
-                                                  NumMaxRuns);
+  if (auto err =
+          prepareAlignments(block, target, compiler, numRepeat, numNoiseRepeat))
+    return std::move(err);
 
-  if (numRepeat == 0) {
-    auto testModule = llvm_ml::createCPUTestHarness(
-        *llvmContext, microbenchAsm, numNoiseRepeat, 0, *inlineAsm);
+  return block;
+}
+
+/// Cold data pages miss L1 on purpose, so that the limit only applies to them
+/// if it is given explicitly.
+static uint64_t getMaxCacheMisses() {
+  if (CacheStateOpt != llvm_ml::CacheState::L1 &&
+      MaxCacheMisses.getNumOccurrences() == 0)
+    return std::numeric_limits<uint64_t>::max();
+  return MaxCacheMisses;
+}
+
+static llvm_ml::SampleFilter getSampleFilter(int pinnedCPU) {
+  double frequencyRatio = 0.0;
+  {
+    std::lock_guard lock(FrequencyRatiosMutex);
+    auto it = FrequencyRatios.find(pinnedCPU);
+    if (it != FrequencyRatios.end())
+      frequencyRatio = it->second;
+  }
+
+  return llvm_ml::SampleFilter{
+      .maxCacheMisses = getMaxCacheMisses(),
+      .maxContextSwitches = static_cast<uint64_t>(MaxContextSwitches),
+      .outliers = Outliers,
+      .outlierThreshold = OutlierThreshold,
+      .maxInstructionDeviation = MaxInstructionDeviation / 100.0,
+      .expectedFrequencyRatio = frequencyRatio,
+      .maxFrequencyDrift = MaxFrequencyDrift / 100.0};
+}
+
+static llvm_ml::CPUBenchmarkOptions getBenchmarkOptions(int pinnedCPU) {
+  llvm_ml::CPUBenchmarkOptions options{
+      .pinnedCPU = pinnedCPU,
+      .numRuns = NumMaxRuns,
+      .useJIT = UseJIT,
+      .useWorkers = UseWorkers,
+      .stoppingRule = llvm_ml::StoppingRule{
+          .minRuns = static_cast<size_t>(MinRuns),
+          .maxRelativeError = TargetPrecision / 100.0,
+          .maxCoV = MaxCoV == 100 ? 0.0 : MaxCoV / 100.0,
+          .maxCacheMisses = getMaxCacheMisses(),
+          .maxContextSwitches = static_cast<uint64_t>(MaxContextSwitches)},
+      .counters = Counters,
+      .events = Events,
+      .numEventSlots = EventSlots,
+      .eventFilter = getSampleFilter(pinnedCPU),
+      .interleave = Interleave,
+      .memory = llvm_ml::MemoryMode{.cacheState = CacheStateOpt,
+                                    .placement = PagePlacementOpt}};
+
+  if (CoRunnerHarness)
+    options.coRunner = llvm_ml::CoRunner{
+        .fn = CoRunnerFn,
+        .args = {.numRepeat = static_cast<uint64_t>(CoRunnerNumRepeat)},
+        .cpu = CoRunnerCPUs.at(pinnedCPU)};
+  return options;
+}
+
+static llvm_ml::Estimator getEstimator() {
+  return llvm_ml::Estimator{.kind = EstimatorOpt,
+                            .trimFraction = Trim / 100.0,
+                            .k = MinOfK};
+}
+
+/// Measures the fixed overhead of a harness on \p pinnedCPU: the fastest run
+/// of the harness of an empty block.
+static llvm::Expected<llvm_ml::BenchmarkResult>
+calibrateOverhead(const llvm::Target *target,
+                  llvm_ml::HarnessCompiler &compiler, int pinnedCPU) {
+  auto harness = compileHarness(target, compiler, "", 0, 0);
+  if (!harness)
+    return harness.takeError();
+
+  // There is nothing to subtract from the empty block.
+  llvm_ml::CPUBenchmarkOptions options = getBenchmarkOptions(pinnedCPU);
+  options.overhead = llvm_ml::BenchmarkResult{};
+  auto runner = llvm_ml::createCPUBenchmarkRunner(target, TripleName, options);
+  if (auto err = runner->run(**harness, 0, 0))
+    return std::move(err);
+
+  std::optional<llvm_ml::BenchmarkResult> overhead;
+  for (const llvm_ml::BenchmarkResult &res : runner->getWorkloadResults()) {
+    if (res.hasFailed || !options.stoppingRule.accepts(res))
+      continue;
+    if (!overhead || res.numCycles < overhead->numCycles)
+      overhead = res;
+  }
+
+  if (!overhead)
+    return llvm::createStringError(std::errc::invalid_argument,
+                                   "Failed to calibrate overhead on CPU #%d",
+                                   pinnedCPU);
 
-    if (!testModule) {
-      return llvm::createStringError(std::errc::invalid_argument,
-                                     "Failed to generate test harness");
+  overhead->numRuns = 0;
+  return *overhead;
+}
+
+/// Returns the overhead to subtract on \p pinnedCPU instead of running the
+/// baseline, std::nullopt without --calibrate. Calibrations older than
+/// --calibration-interval are made again, as are all of them if
+/// \p recalibrate is set.
+static llvm::Expected<std::optional<llvm_ml::BenchmarkResult>>
+getOverhead(const llvm::Target *target, llvm_ml::HarnessCompiler &compiler,
+            int pinnedCPU, bool recalibrate = false) {
+  if (!Calibrations)
+    return std::nullopt;
+
+  if (!recalibrate) {
+    if (auto cached =
+            Calibrations->lookup(CalibrationKey, pinnedCPU,
+                                 std::chrono::seconds(CalibrationInterval)))
+      return cached;
+  }
+
+  auto overhead = calibrateOverhead(target, compiler, pinnedCPU);
+  if (!overhead)
+    return overhead.takeError();
+
+  // The calibration is still good for this run.
+  if (auto err = Calibrations->store(CalibrationKey, pinnedCPU, *overhead))
+    llvm::errs() << "Failed to save calibration: " << toString(std::move(err))
+                 << "\n";
+
+  return *overhead;
+}
+
+/// Measures the workload of \p block at repeat counts, that split the range
+/// from \p numNoiseRepeat to \p numRepeat into --regression-points - 1 steps.
+/// The ends are left out, the baseline and the workload measure them. Appends
+/// samples, that pass the filters, to \p samples.
+static llvm::Error
+measureRepeatCounts(const PreparedBlock &block, const llvm::Target *target,
+                    llvm_ml::HarnessCompiler &compiler,
+                    llvm_ml::CompiledHarness &harness,
+                    llvm::ArrayRef<void *> mappedAddresses, int numNoiseRepeat,
+                    int numRepeat, int pinnedCPU,
+                    llvm::SmallVectorImpl<llvm_ml::BenchmarkResult> &samples) {
+  for (unsigned i = 1; i + 1 < RegressionPoints; i++) {
+    int point = numNoiseRepeat +
+                (numRepeat - numNoiseRepeat) * i / (RegressionPoints - 1);
+
+    // Loop harnesses take the repeat count at run time.
+    std::unique_ptr<llvm_ml::CompiledHarness> pointHarness;
+    if (UnrollFactor != 0) {
+      point = alignTo(point, UnrollFactor);
+    } else {
+      auto compiled = compileHarness(target, compiler, block.source, 0, point,
+                                     block.startOffset);
+      if (!compiled)
+        return compiled.takeError();
+      pointHarness = std::move(*compiled);
     }
 
-    llvm::Expected<int> suggested =
-        runner->check(std::move(testModule), numNoiseRepeat);
+    // Every sample is a point of the fit, there is no baseline to subtract.
+    llvm_ml::CPUBenchmarkOptions options = getBenchmarkOptions(pinnedCPU);
+    options.overhead = llvm_ml::BenchmarkResult{};
+    auto runner =
+        llvm_ml::createCPUBenchmarkRunner(target, TripleName, options);
+    runner->addMappedAddresses(mappedAddresses);
+
+    llvm_ml::CompiledHarness &runHarness =
+        pointHarness ? *pointHarness : harness;
+    if (auto err = runner->run(runHarness, 0, point))
+      return err;
+
+    // Outliers are told apart among the samples of the same repeat count.
+    llvm::ArrayRef<llvm_ml::BenchmarkResult> results =
+        runner->getWorkloadResults();
+    for (size_t index : getSampleFilter(pinnedCPU).apply(results))
+      samples.push_back(results[index]);
+  }
+
+  return llvm::Error::success();
+}
+
+/// Adjusts \p numRepeat picked from run time, so that the unrolled workload
+/// of \p block runs from the frontend path --frontend asks for.
+static llvm::Expected<int> applyCodeBudget(const PreparedBlock &block,
+                                           int numNoiseRepeat, int numRepeat) {
+  if (Frontend == FrontendTarget::Any)
+    return numRepeat;
+  if (block.codeSize == 0)
+    return llvm::createStringError(
+        std::errc::invalid_argument,
+        "--frontend needs the block encoded to tell its size");
+
+  const int numFitting = CodeBudget / block.codeSize;
+  if (Frontend == FrontendTarget::Decoders)
+    return std::max(numRepeat, numFitting + 1);
+
+  if (numFitting <= numNoiseRepeat)
+    return llvm::createStringError(
+        std::errc::invalid_argument,
+        "%d copies of the block of %d bytes exceed --code-budget",
+        numNoiseRepeat + 1, static_cast<int>(block.codeSize));
+  return std::min(numRepeat, numFitting);
+}
+
+/// Returns the frontend path of \p numCopies copies of a block of
+/// \p codeSize bytes in straight-line code.
+static llvm_ml::FrontendRegime getFrontendRegime(uint64_t codeSize,
+                                                 int numCopies) {
+  if (codeSize == 0)
+    return llvm_ml::FrontendRegime::Unknown;
+  return codeSize * numCopies <= CodeBudget
+             ? llvm_ml::FrontendRegime::UopCache
+             : llvm_ml::FrontendRegime::Decoders;
+}
+
+/// Measurement of a block along with the runner, that holds its samples.
+struct BlockMeasurement {
+  llvm_ml::Measurement measurement;
+  std::unique_ptr<llvm_ml::BenchmarkRunner> runner;
+};
+
+/// Measures a prepared block on \p pinnedCPU. The block keeps its harness
+/// and the final repeat count, so that it may be measured again.
+static llvm::Expected<BlockMeasurement>
+measurePreparedBlock(PreparedBlock &block, const llvm::Target *target,
+                     llvm_ml::HarnessCompiler &compiler, int numNoiseRepeat,
+                     int pinnedCPU) {
+  llvm_ml::CPUBenchmarkOptions options = getBenchmarkOptions(pinnedCPU);
+  auto overhead = getOverhead(target, compiler, pinnedCPU);
+  if (!overhead)
+    return overhead.takeError();
+  options.overhead = *overhead;
+
+  auto runner = llvm_ml::createCPUBenchmarkRunner(target, TripleName, options);
+
+  int numRepeat = block.numRepeat;
+  std::unique_ptr<llvm_ml::CompiledHarness> harness = std::move(block.harness);
+  auto restoreHarness =
+      llvm::make_scope_exit([&]() { block.harness = std::move(harness); });
+
+  if (UnrollFactor != 0) {
+    // Loop harnesses only run whole loop iterations, and at least one of
+    // them, even at a repeat count of 0.
+    numNoiseRepeat =
+        std::max<int>(alignTo(numNoiseRepeat, UnrollFactor), UnrollFactor);
+    numRepeat = alignTo(numRepeat, UnrollFactor);
+  }
+
+  // Pages found by a previous measurement of this block, or predicted from
+  // its code, are mapped before the first run.
+  if (!ReadableJSON)
+    runner->addMappedAddresses(
+        llvm_ml::importMappedAddresses(block.output, block.source));
+  runner->addMappedAddresses(block.dataAddresses);
+
+  if (numRepeat == 0) {
+    llvm::Expected<int> suggested = runner->check(*harness, numNoiseRepeat);
     if (!suggested)
       return suggested.takeError();
 
     numRepeat = std::min(*suggested, static_cast<int>(MaxNumRepeat));
-  }
 
-  auto module = llvm_ml::createCPUTestHarness(
-      *llvmContext, microbenchAsm, numNoiseRepeat, numRepeat, *inlineAsm);
+    // Loop harnesses keep the same code at any trip count.
+    if (UnrollFactor == 0) {
+      auto budgeted = applyCodeBudget(block, numNoiseRepeat, numRepeat);
+      if (!budgeted)
+        return budgeted.takeError();
+      numRepeat = *budgeted;
+    }
+  }
 
-  if (!module) {
-    return llvm::createStringError(std::errc::invalid_argument,
-                                   "Failed to generate test harness");
+  // The loop harness takes the repeat count at run time, the unrolled one has
+  // to be compiled again. The calling thread never runs on a measurement
+  // core, so codegen does not disturb it.
+  if (UnrollFactor != 0) {
+    numRepeat = std::max<int>(alignDown(numRepeat, UnrollFactor), UnrollFactor);
+  } else if (block.numRepeat == 0) {
+    auto finalHarness = compileHarness(target, compiler, block.source,
+                                       numNoiseRepeat, numRepeat,
+                                       block.startOffset);
+    if (!finalHarness)
+      return finalHarness.takeError();
+    harness = std::move(*finalHarness);
   }
+  block.numRepeat = numRepeat;
 
-  auto err = runner->run(std::move(module), numNoiseRepeat, numRepeat);
+  auto err = runner->run(*harness, numNoiseRepeat, numRepeat);
   if (err)
     return err;
 
@@ -218,31 +1127,27 @@ llvm::Error runSingleFile(fs::path input, fs::path output,
   llvm::ArrayRef<llvm_ml::BenchmarkResult> workloadResults =
       runner->getWorkloadResults();
 
-  const auto minEltPred = [](const auto &lhs, const auto &rhs) {
-    return lhs.numCycles < rhs.numCycles;
-  };
+  llvm_ml::SampleFilter filter = getSampleFilter(pinnedCPU);
+  llvm::SmallVector<size_t> acceptedNoise = filter.apply(noiseResults);
+  llvm::SmallVector<size_t> acceptedWorkload = filter.apply(workloadResults);
 
-  const auto filter = [](const llvm_ml::BenchmarkResult &res) {
-    return res.numCacheMisses <= MaxCacheMisses &&
-           res.numContextSwitches <= MaxContextSwitches;
-  };
-
-  auto filteredNoise = noiseResults | ranges::views::filter(filter);
-  auto filteredWorkload = workloadResults | ranges::views::filter(filter);
-
-  if (ranges::empty(filteredNoise))
+  if (acceptedNoise.empty())
     return llvm::createStringError(
         std::errc::invalid_argument,
         "Neither of noise samples is suitable for use");
-  if (ranges::empty(filteredWorkload))
+  if (acceptedWorkload.empty())
     return llvm::createStringError(
         std::errc::invalid_argument,
         "Neither of workload samples is suitable for use");
 
+  // Outliers are valid runs, only samples over the limits count as failed.
+  llvm_ml::SampleFilter limits = filter;
+  limits.outliers = llvm_ml::OutlierRule::None;
+
   float maxFailed = static_cast<float>(MaxFailed) / 100.f;
-  size_t failedNoise = noiseResults.size() - ranges::distance(filteredNoise);
+  size_t failedNoise = noiseResults.size() - limits.apply(noiseResults).size();
   size_t failedWorkload =
-      workloadResults.size() - ranges::distance(filteredWorkload);
+      workloadResults.size() - limits.apply(workloadResults).size();
   float failedNoiseRate = static_cast<float>(failedNoise) / noiseResults.size();
   float failedWorkloadRate =
       static_cast<float>(failedWorkload) / workloadResults.size();
@@ -256,20 +1161,285 @@ llvm::Error runSingleFile(fs::path input, fs::path output,
                                    "Too many failed workload samples: %d of %d",
                                    failedWorkload, workloadResults.size());
 
-  auto minNoise = ranges::min_element(filteredNoise, minEltPred);
-  auto minWorkload = ranges::min_element(filteredWorkload, minEltPred);
+  llvm_ml::Estimator estimator = getEstimator();
+  llvm_ml::Estimate estimate;
+
+  // Samples of a pair ran back to back, so that subtracting them cancels out
+  // any drift between them. Both samples of a pair must be accepted.
+  if (runner->hasPairedResults()) {
+    llvm::SmallVector<size_t> acceptedPairs;
+    std::set_intersection(acceptedNoise.begin(), acceptedNoise.end(),
+                          acceptedWorkload.begin(), acceptedWorkload.end(),
+                          std::back_inserter(acceptedPairs));
+    if (acceptedPairs.empty())
+      return llvm::createStringError(
+          std::errc::invalid_argument,
+          "Neither of sample pairs is suitable for use");
+
+    estimate =
+        estimator.estimatePaired(noiseResults, workloadResults, acceptedPairs);
+    acceptedNoise = acceptedPairs;
+    acceptedWorkload = std::move(acceptedPairs);
+  } else {
+    estimate = estimator.estimate(noiseResults, acceptedNoise, workloadResults,
+                                  acceptedWorkload);
+  }
+
+  const llvm_ml::BenchmarkResult &noise = estimate.noise;
+  const llvm_ml::BenchmarkResult &workload = estimate.workload;
+
+  llvm_ml::Measurement m = workload - noise;
+  m.memoryMode = options.memory;
+  m.codeSize = block.codeSize;
+  m.frontendRegime = getFrontendRegime(
+      block.codeSize, UnrollFactor != 0 ? UnrollFactor : numRepeat);
+  if (options.coRunner) {
+    llvm::ArrayRef<llvm_ml::BenchmarkResult> coRunnerResults =
+        runner->getCoRunnerResults();
+    m.coRunner = llvm_ml::CoRunnerCycles{
+        .cpu = options.coRunner->cpu,
+        .cyclesPerIteration = llvm_ml::getCyclesPerIteration(coRunnerResults),
+        .numSamples = coRunnerResults.size(),
+        .source = CoRunnerSource};
+  }
+  m.noiseStopReason = runner->getNoiseStopReason();
+  m.workloadStopReason = runner->getWorkloadStopReason();
+  for (const auto &event : Events)
+    m.eventNames.push_back(event.name);
+  if (Topdown)
+    m.topdown = llvm_ml::computeTopdown(workload, noise, m.eventNames);
+  if (PortPressure)
+    m.portPressure =
+        llvm_ml::computePortPressure(workload, noise, m.eventNames);
+
+  // A single sample has nothing to resample.
+  if (acceptedWorkload.size() > 1)
+    m.measuredCyclesInterval =
+        llvm_ml::Interval{.lower = std::max(estimate.lowerCycles, 0.0),
+                          .upper = std::max(estimate.upperCycles, 0.0),
+                          .confidence = estimator.confidence};
+
+  // The first block measured on a core tells the frequency it runs at.
+  m.frequencyRatio =
+      llvm_ml::getFrequencyRatio(workloadResults, acceptedWorkload);
+  if (m.frequencyRatio != 0.0) {
+    std::lock_guard lock(FrequencyRatiosMutex);
+    FrequencyRatios.try_emplace(pinnedCPU, m.frequencyRatio);
+  }
+
+  if (RegressionPoints >= 2) {
+    llvm::SmallVector<llvm_ml::BenchmarkResult> samples;
+    for (size_t index : acceptedNoise)
+      samples.push_back(noiseResults[index]);
+    for (size_t index : acceptedWorkload)
+      samples.push_back(workloadResults[index]);
+    if (auto err = measureRepeatCounts(
+            block, target, compiler, *harness, runner->getMappedAddresses(),
+            numNoiseRepeat, numRepeat, pinnedCPU, samples))
+      return err;
+
+    // The slope leaves out the fixed overhead of the harness exactly.
+    m.regression = llvm_ml::fitCycles(samples);
+    if (m.regression) {
+      m.measuredCycles = std::llround(std::max(m.regression->slope, 0.0) *
+                                      m.measuredNumRuns);
+      // The interval of the difference does not describe the slope.
+      m.measuredCyclesInterval = std::nullopt;
+    }
+  }
 
-  assert(minNoise != filteredNoise.end());
-  assert(minWorkload != filteredWorkload.end());
+  return BlockMeasurement{std::move(m), std::move(runner)};
+}
+
+/// Measures \p block at each of its --code-alignments and stores cycles per
+/// iteration of every placement along with their spread in \p m.
+static llvm::Error measureAlignments(PreparedBlock &block,
+                                     const llvm::Target *target,
+                                     llvm_ml::HarnessCompiler &compiler,
+                                     int numNoiseRepeat, int pinnedCPU,
+                                     llvm_ml::Measurement &m) {
+  for (PreparedBlock &aligned : block.alignments) {
+    auto res = measurePreparedBlock(aligned, target, compiler, numNoiseRepeat,
+                                    pinnedCPU);
+    if (!res)
+      return res.takeError();
+
+    // Repeat counts are picked for every placement separately.
+    const llvm_ml::Measurement &am = res->measurement;
+    if (am.measuredNumRuns == 0)
+      continue;
+    m.alignments.push_back(llvm_ml::CodeAlignmentCycles{
+        .offset = *aligned.startOffset,
+        .cyclesPerIteration =
+            static_cast<double>(am.measuredCycles) / am.measuredNumRuns});
+  }
 
-  llvm_ml::Measurement m = *minWorkload - *minNoise;
+  if (m.alignments.size() < 2)
+    return llvm::Error::success();
 
+  auto [min, max] = std::minmax_element(
+      m.alignments.begin(), m.alignments.end(),
+      [](const auto &lhs, const auto &rhs) {
+        return lhs.cyclesPerIteration < rhs.cyclesPerIteration;
+      });
+  if (min->cyclesPerIteration > 0.0)
+    m.alignmentSpread = (max->cyclesPerIteration - min->cyclesPerIteration) /
+                        min->cyclesPerIteration;
+
+  return llvm::Error::success();
+}
+
+/// Measures a prepared block, its variants and alignments on \p pinnedCPU and
+/// exports the results.
+llvm::Error measureBlock(PreparedBlock &block, const llvm::Target *target,
+                         llvm_ml::HarnessCompiler &compiler,
+                         int numNoiseRepeat, int pinnedCPU) {
+  auto res = measurePreparedBlock(block, target, compiler, numNoiseRepeat,
+                                  pinnedCPU);
+  if (!res)
+    return res.takeError();
+
+  llvm_ml::Measurement &m = res->measurement;
+  for (PreparedVariant &variant : block.variants) {
+    auto variantRes = measurePreparedBlock(variant.block, target, compiler,
+                                           numNoiseRepeat, pinnedCPU);
+    if (!variantRes)
+      return variantRes.takeError();
+
+    const llvm_ml::Measurement &vm = variantRes->measurement;
+    if (vm.measuredNumRuns == 0)
+      continue;
+
+    // A run of the variant executes every copy once.
+    llvm_ml::DependencyVariantCycles cycles{
+        .cyclesPerIteration = static_cast<double>(vm.measuredCycles) /
+                              (vm.measuredNumRuns * variant.numCopies),
+        .numCopies = variant.numCopies,
+        .source = variant.block.source};
+    if (variant.mode == llvm_ml::DependencyMode::Latency)
+      m.latency = std::move(cycles);
+    else
+      m.throughput = std::move(cycles);
+  }
+
+  if (auto err = measureAlignments(block, target, compiler, numNoiseRepeat,
+                                   pinnedCPU, m))
+    return err;
+
+  const llvm_ml::BenchmarkRunner &runner = *res->runner;
   if (ReadableJSON) {
-    return m.exportJSON(output, (*buffer)->getBuffer(), noiseResults,
-                        workloadResults);
+    return m.exportJSON(block.output, block.source, runner.getNoiseResults(),
+                        runner.getWorkloadResults(),
+                        runner.getMappedAddresses());
   }
-  return m.exportBinary(output, (*buffer)->getBuffer(), noiseResults,
-                        workloadResults);
+  return m.exportBinary(block.output, block.source, runner.getNoiseResults(),
+                        runner.getWorkloadResults(),
+                        runner.getMappedAddresses());
+}
+
+/// Restricts the calling thread to the housekeeping cores, if any were given.
+static void pinToHousekeepingCPUs() {
+#if defined(__linux__)
+  if (HousekeepingCPUs.empty())
+    return;
+
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  for (int cpu : HousekeepingCPUs)
+    CPU_SET(cpu, &cpuSet);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuSet) != 0)
+    llvm::errs() << "Failed to pin thread to housekeeping CPUs\n";
+#endif
+}
+
+llvm::Error runSingleFile(fs::path input, fs::path output,
+                          const llvm::Target *target,
+                          llvm_ml::HarnessCompiler &compiler, int numRepeat,
+                          int numNoiseRepeat, int pinnedCPU) {
+  auto block = prepareBlock(std::move(input), std::move(output), target,
+                            compiler, numRepeat, numNoiseRepeat);
+  if (!block)
+    return block.takeError();
+
+  return measureBlock(*block, target, compiler, numNoiseRepeat, pinnedCPU);
+}
+
+/// Sentinel block along with cycles per iteration of its first measurement.
+struct Sentinel {
+  PreparedBlock block;
+  double cyclesPerIteration;
+};
+
+using ErrorLogger = llvm::function_ref<void(const fs::path &, llvm::Error)>;
+
+/// Returns cycles per iteration of \p block measured on \p pinnedCPU.
+static llvm::Expected<double>
+measureCyclesPerIteration(PreparedBlock &block, const llvm::Target *target,
+                          llvm_ml::HarnessCompiler &compiler, int pinnedCPU) {
+  auto res = measurePreparedBlock(block, target, compiler, NumRepeatNoise,
+                                  pinnedCPU);
+  if (!res)
+    return res.takeError();
+
+  const llvm_ml::Measurement &m = res->measurement;
+  if (m.measuredNumRuns == 0)
+    return llvm::createStringError(std::errc::invalid_argument,
+                                   "Sentinel was measured with no iterations");
+  return static_cast<double>(m.measuredCycles) / m.measuredNumRuns;
+}
+
+/// Prepares --sentinels and measures them on \p pinnedCPU for the first
+/// time. Sentinels, that fail to measure, are logged and left out.
+static std::vector<Sentinel>
+prepareSentinels(const llvm::Target *target, llvm_ml::HarnessCompiler &compiler,
+                 int pinnedCPU, ErrorLogger logError) {
+  std::vector<Sentinel> sentinels;
+  for (const std::string &path : Sentinels) {
+    // Sentinels are never exported.
+    auto block =
+        prepareBlock(path, "", target, compiler, NumRepeat, NumRepeatNoise);
+    if (!block) {
+      logError(path, block.takeError());
+      continue;
+    }
+
+    auto cycles =
+        measureCyclesPerIteration(*block, target, compiler, pinnedCPU);
+    if (!cycles) {
+      logError(path, cycles.takeError());
+      continue;
+    }
+
+    // Drift of a sentinel, that takes no cycles, can not be told.
+    if (*cycles <= 0.0)
+      continue;
+
+    sentinels.push_back(Sentinel{std::move(*block), *cycles});
+  }
+
+  return sentinels;
+}
+
+/// Measures \p sentinels on \p pinnedCPU again and returns the largest
+/// relative difference of their cycles from the first measurement.
+static double measureSentinelDrift(llvm::MutableArrayRef<Sentinel> sentinels,
+                                   const llvm::Target *target,
+                                   llvm_ml::HarnessCompiler &compiler,
+                                   int pinnedCPU, ErrorLogger logError) {
+  double drift = 0.0;
+  for (Sentinel &sentinel : sentinels) {
+    auto cycles = measureCyclesPerIteration(sentinel.block, target, compiler,
+                                            pinnedCPU);
+    if (!cycles) {
+      logError(sentinel.block.input, cycles.takeError());
+      continue;
+    }
+
+    drift = std::max(drift,
+                     std::abs(*cycles / sentinel.cyclesPerIteration - 1.0));
+  }
+
+  return drift;
 }
 
 int runBatch(fs::path input, fs::path output, const Target *target) {
@@ -319,11 +1489,6 @@ int runBatch(fs::path input, fs::path output, const Target *target) {
   spinner.set_option(option::PrefixText{"✔"});
   spinner.set_option(option::PostfixText{"Complete!"});
 
-  std::vector<std::shared_future<llvm::Error>> dispatchedTasks;
-  dispatchedTasks.reserve(PinnedCPUs.size());
-
-  size_t cpuId = 0;
-
   std::unique_ptr<raw_fd_ostream> os;
   if (LogFile != "") {
     std::error_code ec;
@@ -335,37 +1500,192 @@ int runBatch(fs::path input, fs::path output, const Target *target) {
       option::FontStyles{std::vector<FontStyle>{FontStyle::bold}},
       option::MaxProgress{files.size()}};
 
-  for (const auto &inpFile : files) {
-    std::string newFilename = std::string{inpFile.filename().stem()} + ".cbuf";
-    fs::path outFile = output / fs::path{newFilename};
-    auto future = pool.async(
-        [outFile, pinnedCPU = PinnedCPUs[cpuId], inpFile, target, &bar]() {
-          auto err = runSingleFile(inpFile, outFile, target, NumRepeat,
-                                   NumRepeatNoise, pinnedCPU);
-          bar.tick();
-          return err;
-        });
+  const size_t numCores = PinnedCPUs.size();
+  const size_t numProducers = std::max<size_t>(HousekeepingCPUs.size(), 1);
+
+  auto compiler = llvm_ml::createHarnessCompiler(
+      target, TripleName,
+      llvm_ml::CPUBenchmarkOptions{.useJIT = UseJIT, .useWorkers = UseWorkers});
+  if (auto err = prepareCoRunner(target, *compiler)) {
+    indicators::show_console_cursor(true);
+    llvm::errs() << err << "\n";
+    return 1;
+  }
 
-    dispatchedTasks.push_back(std::move(future));
-    cpuId++;
+  // Compiled harnesses are ready to run, so that measurement cores never wait
+  // for codegen. The queue is bounded to keep the artifacts in memory low.
+  llvm_ml::WorkStealingQueue<PreparedBlock> queue(
+      numCores, kPreparedBlocksPerCore * numCores);
+
+  struct CoreStats {
+    size_t numBlocks = 0;
+    std::chrono::duration<double> busy{0};
+    /// Sentinel checks, along with the pauses and calibrations after a drift.
+    std::chrono::duration<double> sentinels{0};
+    std::chrono::duration<double> total{0};
+  };
+  std::vector<CoreStats> stats(numCores);
+
+  std::mutex logMutex;
+  const auto logError = [&](const fs::path &file, llvm::Error err) {
+    std::lock_guard lock(logMutex);
+    if (os)
+      *os << file.c_str() << ": " << toString(std::move(err)) << "\n";
+    else
+      consumeError(std::move(err));
+  };
+
+  // Outputs measured while a core was off its frequency.
+  std::unique_ptr<raw_fd_ostream> suspects;
+  const auto markSuspect = [&](int pinnedCPU, double drift,
+                               llvm::ArrayRef<fs::path> outputs) {
+    std::lock_guard lock(logMutex);
+    if (!suspects) {
+      std::error_code ec;
+      suspects = std::make_unique<raw_fd_ostream>(
+          (output / "suspect.txt").c_str(), ec, sys::fs::OF_Append);
+      if (ec) {
+        llvm::errs() << "Failed to open suspect.txt: " << ec.message() << "\n";
+        suspects.reset();
+        return;
+      }
+    }
+
+    const std::string reason =
+        formatv("sentinels drifted by {0:f1}% on CPU #{1}", 100.0 * drift,
+                pinnedCPU);
+    if (os)
+      *os << reason << ", " << outputs.size() << " blocks are suspect\n";
+    for (const fs::path &file : outputs)
+      *suspects << file.c_str() << ": " << reason << "\n";
+    suspects->flush();
+  };
+
+  const auto batchStart = std::chrono::steady_clock::now();
+
+  std::atomic<size_t> nextFile = 0;
+  std::vector<std::thread> producers;
+  producers.reserve(numProducers);
 
-    if (dispatchedTasks.size() == PinnedCPUs.size()) {
-      for (auto &f : dispatchedTasks) {
-        f.wait();
+  for (size_t producer = 0; producer < numProducers; producer++) {
+    producers.emplace_back([&]() {
+      pinToHousekeepingCPUs();
 
-        // TODO(Alex): this is definitely a UB
-        if (const_cast<llvm::Error &>(f.get()) && os)
-          *os << f.get() << "\n";
+      for (size_t i = nextFile++; i < files.size(); i = nextFile++) {
+        std::string newFilename =
+            std::string{files[i].filename().stem()} + ".cbuf";
+        fs::path outFile = output / fs::path{newFilename};
+
+        auto block = prepareBlock(files[i], outFile, target, *compiler,
+                                  NumRepeat, NumRepeatNoise);
+        if (!block) {
+          bar.tick();
+          logError(files[i], block.takeError());
+          continue;
+        }
+
+        queue.push(i % numCores, std::move(*block));
+      }
+    });
+  }
+
+  std::vector<std::thread> cores;
+  cores.reserve(numCores);
+
+  for (size_t core = 0; core < numCores; core++) {
+    cores.emplace_back([&, core]() {
+      // The measurement itself happens in child processes pinned to the
+      // measurement core, the orchestration stays on the housekeeping cores.
+      pinToHousekeepingCPUs();
+      const int pinnedCPU = PinnedCPUs[core];
+
+      // Every core compiles sentinels of its own, harnesses are not shared.
+      std::vector<Sentinel> sentinels =
+          SentinelInterval != 0
+              ? prepareSentinels(target, *compiler, pinnedCPU, logError)
+              : std::vector<Sentinel>{};
+      std::vector<fs::path> unchecked;
+      bool drifting = false;
+
+      // Blocks measured since the last check are suspect, if the sentinels
+      // drifted by now or had not recovered by then. A drifted core is given
+      // a pause and its overhead is calibrated again, as it drifts along.
+      const auto checkSentinels = [&]() {
+        const auto start = std::chrono::steady_clock::now();
+        const double maxDrift = MaxSentinelDrift / 100.0;
+        double drift = measureSentinelDrift(sentinels, target, *compiler,
+                                            pinnedCPU, logError);
+        if (drift > maxDrift || drifting)
+          markSuspect(pinnedCPU, drift, unchecked);
+        unchecked.clear();
+
+        for (unsigned retry = 0; retry < kSentinelRetries && drift > maxDrift;
+             retry++) {
+          std::this_thread::sleep_for(kSentinelPause);
+          auto overhead = getOverhead(target, *compiler, pinnedCPU,
+                                      /*recalibrate=*/true);
+          if (!overhead)
+            logError(input, overhead.takeError());
+          drift = measureSentinelDrift(sentinels, target, *compiler, pinnedCPU,
+                                       logError);
+        }
+        drifting = drift > maxDrift;
+        stats[core].sentinels += std::chrono::steady_clock::now() - start;
+      };
+
+      while (std::optional<PreparedBlock> block = queue.pop(core)) {
+        const auto start = std::chrono::steady_clock::now();
+        auto err = measureBlock(*block, target, *compiler, NumRepeatNoise,
+                                pinnedCPU);
+        stats[core].busy += std::chrono::steady_clock::now() - start;
+        stats[core].numBlocks++;
+        bar.tick();
+
+        if (err)
+          logError(block->input, std::move(err));
+        else
+          unchecked.push_back(block->output);
+
+        if (!sentinels.empty() && unchecked.size() >= SentinelInterval)
+          checkSentinels();
       }
 
-      dispatchedTasks.clear();
-      dispatchedTasks.reserve(PinnedCPUs.size());
-      cpuId = 0;
-    }
+      // The last blocks are checked as well.
+      if (!sentinels.empty() && !unchecked.empty())
+        checkSentinels();
+
+      stats[core].total = std::chrono::steady_clock::now() - batchStart;
+    });
   }
 
+  for (auto &producer : producers)
+    producer.join();
+  queue.close();
+
+  for (auto &core : cores)
+    core.join();
+
   indicators::show_console_cursor(true);
 
+  const auto reportUtilization = [&](raw_ostream &out) {
+    out << "Measurement core utilization:\n";
+    for (size_t core = 0; core < numCores; core++) {
+      const CoreStats &s = stats[core];
+      const double idle =
+          s.total.count() - s.busy.count() - s.sentinels.count();
+      const double idlePercent =
+          s.total.count() > 0 ? 100.0 * idle / s.total.count() : 0.0;
+      out << formatv("  CPU #{0}: {1} blocks, busy {2:f2}s, sentinels "
+                     "{3:f2}s, idle {4:f2}s ({5:f1}%)\n",
+                     PinnedCPUs[core], s.numBlocks, s.busy.count(),
+                     s.sentinels.count(), idle, idlePercent);
+    }
+  };
+
+  reportUtilization(llvm::outs());
+  if (os)
+    reportUtilization(*os);
+
   return 0;
 }
 
@@ -391,6 +1711,197 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (UnrollFactor < 0) {
+    errs() << "--unroll-factor must not be negative\n";
+    return 1;
+  }
+
+  if (MaxCoV < 1 || MaxCoV > 100) {
+    errs() << "--max-cov must be in range 1 to 100\n";
+    return 1;
+  }
+
+  if (TargetPrecision < 0) {
+    errs() << "--target-precision must not be negative\n";
+    return 1;
+  }
+
+  if (MaxFrequencyDrift < 0 || MaxSentinelDrift < 0) {
+    errs() << "--max-frequency-drift and --max-sentinel-drift must not be "
+              "negative\n";
+    return 1;
+  }
+
+  if (EventSlots < 1) {
+    errs() << "--event-slots must be positive\n";
+    return 1;
+  }
+
+  if (Frontend != FrontendTarget::Any && UnrollFactor != 0) {
+    errs() << "--frontend does not apply to loop harnesses, their code size "
+              "follows --unroll-factor\n";
+    return 1;
+  }
+
+  if (!CoRunnerSpec.empty()) {
+    if (UseWorkers) {
+      errs() << "--co-runner does not support --workers\n";
+      return 1;
+    }
+    if (CoRunnerCPU >= 0 && PinnedCPUs.size() != 1) {
+      errs() << "--co-runner-cpu needs a single measurement core\n";
+      return 1;
+    }
+
+    for (int cpu : PinnedCPUs) {
+      std::optional<int> sibling = CoRunnerCPU >= 0
+                                       ? std::optional<int>(CoRunnerCPU)
+                                       : llvm_ml::getSMTSibling(cpu);
+      if (!sibling) {
+        errs() << "CPU #" << cpu << " has no SMT sibling to run --co-runner "
+               << "on\n";
+        return 1;
+      }
+      if (llvm::is_contained(PinnedCPUs, *sibling) ||
+          llvm::is_contained(HousekeepingCPUs, *sibling)) {
+        errs() << "CPU #" << *sibling << " runs the co-runner of CPU #" << cpu
+               << ", it can not be a measurement or a housekeeping core\n";
+        return 1;
+      }
+      CoRunnerCPUs[cpu] = *sibling;
+    }
+  }
+
+#if !defined(__x86_64__)
+  // Lines are only flushed out of every cache level with clflush.
+  if (CacheStateOpt == llvm_ml::CacheState::DRAM) {
+    errs() << "--cache-state=dram is only supported on x86-64\n";
+    return 1;
+  }
+#endif
+
+  if (llvm::any_of(CodeAlignments, [](unsigned offset) {
+        return offset >= llvm_ml::kCodeAlignment;
+      })) {
+    errs() << "--code-alignments must be less than "
+           << llvm_ml::kCodeAlignment << "\n";
+    return 1;
+  }
+
+  // libpmu only counts the default events.
+#if defined(__linux__)
+  const bool supportsEvents = Counters == llvm_ml::CountersBackend::RDPMC;
+#else
+  const bool supportsEvents = false;
+#endif
+  if (supportsEvents) {
+    // Top-down events must go first, they share the first pass.
+    if (Topdown) {
+      Events = llvm_ml::getTopdownEvents();
+      if (Events.empty())
+        errs() << "No top-down events on this CPU, skipping --topdown\n";
+
+      // Level 1 events of cores without PERF_METRICS are plain events, the
+      // breakdown needs all of them from the same runs as the cycles.
+      const size_t numSlots = llvm::count_if(
+          Events, [](const auto &event) { return !event.event.isTopdown; });
+      if (numSlots > EventSlots) {
+        errs() << "Top-down events of this CPU take " << numSlots
+               << " event slots, --event-slots must be at least that\n";
+        return 1;
+      }
+    }
+
+    // Cycles per reference cycle are only meaningful if both come from the
+    // same run, so reference cycles take a slot of the first pass.
+    if (MaxFrequencyDrift != 0.0) {
+      auto refCycles = llvm_ml::parseEvents("ref_cycles");
+      if (!refCycles) {
+        errs() << refCycles.takeError() << "\n";
+        return 1;
+      }
+      Events.append(refCycles->begin(), refCycles->end());
+    }
+
+    auto events = llvm_ml::parseEvents(EventsSpec);
+    if (!events) {
+      errs() << events.takeError() << "\n";
+      return 1;
+    }
+    for (auto &event : *events) {
+      const auto sameName = [&](const llvm_ml::EventSpec &other) {
+        return other.name == event.name;
+      };
+      if (llvm::none_of(Events, sameName))
+        Events.push_back(std::move(event));
+    }
+
+    if (PortPressure) {
+      llvm::SmallVector<llvm_ml::EventSpec> portEvents =
+          llvm_ml::getPortEvents(PinnedCPUs);
+      if (portEvents.empty())
+        errs() << "No execution port events on this CPU, skipping "
+                  "--port-pressure\n";
+      Events.append(portEvents.begin(), portEvents.end());
+    }
+
+    if (Events.size() > MAX_EVENTS) {
+      errs() << "At most " << MAX_EVENTS << " events are supported\n";
+      return 1;
+    }
+  } else if (EventsSpec.getNumOccurrences() != 0 || Topdown ||
+             PortPressure || MaxFrequencyDrift != 0.0) {
+    errs() << "--events, --topdown, --port-pressure and --max-frequency-drift "
+              "require --counters=rdpmc on Linux\n";
+    return 1;
+  }
+
+  // Harness processes would fail to open the events one by one. The default
+  // --events are dropped rather than fail the run.
+  auto backend = llvm_ml::probeCounters(
+      Counters, llvm_ml::scheduleEvents(Events, EventSlots));
+  if (!backend && EventsSpec.getNumOccurrences() == 0 && !Topdown &&
+      !PortPressure && MaxFrequencyDrift == 0.0) {
+    llvm::consumeError(backend.takeError());
+    Events.clear();
+    backend = llvm_ml::probeCounters(Counters,
+                                     llvm_ml::scheduleEvents({}, EventSlots));
+  }
+  if (!backend) {
+    errs() << backend.takeError() << "\n";
+    return 1;
+  }
+  Counters = *backend;
+
+  if (Calibrate) {
+    llvm::SmallString<128> cachePath(CalibrationCachePath);
+    if (cachePath.empty() && llvm::sys::path::cache_directory(cachePath))
+      llvm::sys::path::append(cachePath, "llvm-ml", "calibration.json");
+    Calibrations = std::make_unique<llvm_ml::CalibrationCache>(
+        std::string(cachePath));
+
+    std::string eventNames;
+    for (const auto &event : Events)
+      eventNames += event.name + ",";
+    CalibrationKey =
+        formatv("{0}|counters={1}|unroll={2}|mc={3}|events={4}|"
+                "memory={5},{6}|co-runner={7}",
+                llvm_ml::getHostFingerprint(),
+                Counters == llvm_ml::CountersBackend::RDPMC ? "rdpmc" : "pmu",
+                UnrollFactor, EncodeMC, eventNames,
+                static_cast<int>(CacheStateOpt.getValue()),
+                static_cast<int>(PagePlacementOpt.getValue()),
+                CoRunnerSpec);
+  }
+
+  for (int cpu : HousekeepingCPUs) {
+    if (llvm::is_contained(PinnedCPUs, cpu)) {
+      errs() << "CPU #" << cpu
+             << " can not be both a measurement and a housekeeping core\n";
+      return 1;
+    }
+  }
+
   fs::path input{std::string{InputFilename}};
 
   if (fs::is_directory(input)) {
@@ -405,7 +1916,16 @@ int main(int argc, char **argv) {
     llvm::outs() << "Running in single mode\n";
     fs::path output{std::string{OutputFilename}};
     int pinnedCPU = PinnedCPUs[0];
-    if (auto err = runSingleFile(input, output, target, NumRepeat,
+    auto compiler = llvm_ml::createHarnessCompiler(
+        target, TripleName,
+        llvm_ml::CPUBenchmarkOptions{.useJIT = UseJIT,
+                                     .useWorkers = UseWorkers});
+    pinToHousekeepingCPUs();
+    if (auto err = prepareCoRunner(target, *compiler)) {
+      llvm::errs() << err << "\n";
+      return 1;
+    }
+    if (auto err = runSingleFile(input, output, target, *compiler, NumRepeat,
                                  NumRepeatNoise, pinnedCPU)) {
       llvm::errs() << err << "\n";
       return 1;
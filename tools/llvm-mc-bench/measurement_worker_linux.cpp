@@ -0,0 +1,376 @@
+//===--- measurement_worker_linux.cpp - Persistent measurement processes --===//
+//
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//===----------------------------------------------------------------------===//
+
+#include "MeasurementWorker.hpp"
+#include "counters.hpp"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <csignal>
+#include <new>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/// Size of the virtual region reserved for JIT-compiled harnesses. Pages are
+/// only backed by memory once they are touched.
+constexpr size_t kSharedCodeSize = 256 * 1024 * 1024;
+
+namespace llvm_ml {
+struct WorkerControl {
+  // Request
+  BenchmarkFn fn;
+  int numRuns;
+  HarnessArgs args;
+  Interleaving interleave;
+  StoppingRule rule;
+  EventGroup events;
+  MemoryMode memory;
+
+  // Request and response: pages mapped in advance, followed by the ones
+  // mapped on demand.
+  HarnessLog log;
+};
+
+SharedCodeMapper &SharedCodeMapper::get() {
+  static SharedCodeMapper mapper;
+  return mapper;
+}
+
+SharedCodeMapper::SharedCodeMapper() {
+  int fd = memfd_create("llvm-mc-bench-code", MFD_CLOEXEC);
+  if (fd == -1 || ftruncate(fd, kSharedCodeSize) != 0) {
+    llvm::errs() << "Failed to allocate shared code region: "
+                 << strerror(errno) << "\n";
+    abort();
+  }
+
+  void *base = mmap(nullptr, kSharedCodeSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    llvm::errs() << "Failed to map shared code region: " << strerror(errno)
+                 << "\n";
+    abort();
+  }
+
+  mBase = static_cast<char *>(base);
+  mSize = kSharedCodeSize;
+  mFreeChunks[0] = mSize;
+}
+
+llvm::sys::MemoryBlock SharedCodeMapper::allocateMappedMemory(
+    llvm::SectionMemoryManager::AllocationPurpose, size_t numBytes,
+    const llvm::sys::MemoryBlock *const, unsigned, std::error_code &ec) {
+  const size_t size = llvm::alignTo(numBytes, sysconf(_SC_PAGE_SIZE));
+
+  std::lock_guard lock(mMutex);
+  for (auto it = mFreeChunks.begin(); it != mFreeChunks.end(); ++it) {
+    if (it->second < size)
+      continue;
+
+    size_t offset = it->first;
+    size_t remaining = it->second - size;
+    mFreeChunks.erase(it);
+    if (remaining != 0)
+      mFreeChunks[offset + size] = remaining;
+
+    // Released chunks may have been protected as code.
+    mprotect(mBase + offset, size, PROT_READ | PROT_WRITE);
+    ec = std::error_code();
+    return llvm::sys::MemoryBlock(mBase + offset, size);
+  }
+
+  ec = std::make_error_code(std::errc::not_enough_memory);
+  return llvm::sys::MemoryBlock();
+}
+
+std::error_code
+SharedCodeMapper::protectMappedMemory(const llvm::sys::MemoryBlock &block,
+                                      unsigned flags) {
+  int prot = 0;
+  if (flags & llvm::sys::Memory::MF_READ)
+    prot |= PROT_READ;
+  if (flags & llvm::sys::Memory::MF_WRITE)
+    prot |= PROT_WRITE;
+  if (flags & llvm::sys::Memory::MF_EXEC)
+    prot |= PROT_EXEC;
+
+  if (mprotect(block.base(), block.allocatedSize(), prot) != 0)
+    return std::error_code(errno, std::generic_category());
+
+  return std::error_code();
+}
+
+std::error_code
+SharedCodeMapper::releaseMappedMemory(llvm::sys::MemoryBlock &block) {
+  if (block.base() == nullptr)
+    return std::error_code();
+
+  std::lock_guard lock(mMutex);
+
+  size_t offset = static_cast<char *>(block.base()) - mBase;
+  size_t size = block.allocatedSize();
+
+  auto next = mFreeChunks.lower_bound(offset);
+  if (next != mFreeChunks.end() && offset + size == next->first) {
+    size += next->second;
+    next = mFreeChunks.erase(next);
+  }
+  if (next != mFreeChunks.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      mFreeChunks.erase(prev);
+    }
+  }
+  mFreeChunks[offset] = size;
+
+  block = llvm::sys::MemoryBlock();
+  return std::error_code();
+}
+
+void SharedCodeMapper::makeExecutable() {
+  mprotect(mBase, mSize, PROT_READ | PROT_EXEC);
+}
+
+// State of the worker process, used by the crash handler.
+static WorkerControl *gWorkerControl = nullptr;
+static int gWorkerResponseFD = -1;
+
+static void workerCrashHandler(int, siginfo_t *info, void *ucontext) {
+  HarnessLog &log = gWorkerControl->log;
+  // Only SIGSEGV is a data page fault, see installFaultHandler.
+  log.reason = ExitReason::Unknown;
+  log.faultAddr = info->si_addr;
+  log.faultIP = getSignalIP(ucontext);
+
+  notifyEvent(gWorkerResponseFD);
+  _exit(1);
+}
+
+[[noreturn]] static void workerMain(int cpu, CountersBackend backend,
+                                    WorkerControl *control, SampleRing *ring,
+                                    int requestFD, int responseFD) {
+  // Do not outlive the parent.
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+  SharedCodeMapper::get().makeExecutable();
+
+  if (!setupHarnessProcess(cpu))
+    _exit(1);
+
+  gWorkerControl = control;
+  gWorkerResponseFD = responseFD;
+
+  MemoryMode memory = control->memory;
+  PhysicalPages pages = allocatePhysicalPages(memory.placement);
+  CacheWarmer cache(memory.cacheState, pages.pageSize);
+
+  // Also sets up the alternate stack the crash handler runs on.
+  installFaultHandler(pages, &control->log);
+
+  struct sigaction action = {};
+  action.sa_sigaction = workerCrashHandler;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  for (int signal : {SIGBUS, SIGILL, SIGFPE, SIGTRAP})
+    sigaction(signal, &action, nullptr);
+
+  EventGroup events = control->events;
+  auto counters = createCounters(backend, events);
+
+  while (waitForEvent(requestFD)) {
+    // Counters stay open between requests, unless the events change.
+    if (!(control->events == events)) {
+      events = control->events;
+      counters.reset();
+      counters = createCounters(backend, events);
+    }
+
+    // Nothing is mapped in between requests, so the memory file can change.
+    if (!(control->memory == memory)) {
+      if (control->memory.placement != memory.placement) {
+        close(pages.fd);
+        pages = allocatePhysicalPages(control->memory.placement);
+        installFaultHandler(pages, &control->log);
+      }
+      memory = control->memory;
+      cache = CacheWarmer(memory.cacheState, pages.pageSize);
+    }
+
+    mapHarnessPages(pages, &control->log);
+
+    HarnessArgs args = control->args;
+    if (control->interleave.order == InterleaveOrder::None)
+      measureHarness(control->fn, counters.get(), cache, ring,
+                     control->numRuns, &args, control->rule, &control->log);
+    else
+      measureInterleaved(control->fn, counters.get(), cache, ring,
+                         control->numRuns, &args, control->interleave,
+                         control->rule, &control->log);
+
+    unmapHarnessPages(pages.pageSize, control->log);
+
+    control->log.reason = ExitReason::Success;
+    notifyEvent(responseFD);
+  }
+
+  _exit(1);
+}
+
+MeasurementWorker &MeasurementWorker::get(int cpu, CountersBackend backend) {
+  static std::mutex registryMutex;
+  static std::map<int, std::unique_ptr<MeasurementWorker>> workers;
+
+  std::lock_guard lock(registryMutex);
+  auto &worker = workers[cpu];
+  if (!worker)
+    worker.reset(new MeasurementWorker(cpu, backend));
+
+  assert(worker->mBackend == backend && "workers must share counters");
+  return *worker;
+}
+
+MeasurementWorker::MeasurementWorker(int cpu, CountersBackend backend)
+    : mCPU(cpu), mBackend(backend) {
+  // The code region must exist before the first worker is forked.
+  (void)SharedCodeMapper::get();
+
+  const size_t pageSize = sysconf(_SC_PAGE_SIZE);
+  const size_t controlSize = llvm::alignTo(sizeof(WorkerControl), pageSize);
+  mSharedSize =
+      controlSize +
+      llvm::alignTo(SampleRing::getAllocationSize(kSampleRingCapacity),
+                    pageSize);
+
+  void *shared = mmap(nullptr, mSharedSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    llvm::errs() << "Failed to allocate worker memory: " << strerror(errno)
+                 << "\n";
+    abort();
+  }
+
+  mControl = new (shared) WorkerControl();
+  mRing = SampleRing::create(static_cast<char *>(shared) + controlSize,
+                             kSampleRingCapacity);
+}
+
+MeasurementWorker::~MeasurementWorker() {
+  reap();
+  munmap(mControl, mSharedSize);
+}
+
+bool MeasurementWorker::spawn() {
+  mRequestFD = eventfd(0, EFD_CLOEXEC);
+  mResponseFD = eventfd(0, EFD_CLOEXEC);
+  if (mRequestFD < 0 || mResponseFD < 0) {
+    reap();
+    return false;
+  }
+
+  mPid = fork();
+  if (mPid == 0)
+    workerMain(mCPU, mBackend, mControl, mRing, mRequestFD, mResponseFD);
+
+  if (mPid < 0) {
+    reap();
+    return false;
+  }
+
+  mPidFD = syscall(SYS_pidfd_open, mPid, 0);
+  if (mPidFD < 0) {
+    reap();
+    return false;
+  }
+
+  return true;
+}
+
+void MeasurementWorker::reap() {
+  if (mPid > 0) {
+    kill(mPid, SIGKILL);
+    waitpid(mPid, nullptr, 0);
+  }
+  for (int *fd : {&mPidFD, &mRequestFD, &mResponseFD}) {
+    if (*fd >= 0)
+      close(*fd);
+    *fd = -1;
+  }
+  mPid = -1;
+}
+
+const HarnessLog &MeasurementWorker::getLog() const { return mControl->log; }
+
+ExitStatus
+MeasurementWorker::run(BenchmarkFn fn, int numRuns, const HarnessArgs &args,
+                       const Interleaving &interleave,
+                       const StoppingRule &rule, const EventGroup &events,
+                       const MemoryMode &memory,
+                       llvm::ArrayRef<void *> addresses,
+                       llvm::SmallVectorImpl<BenchmarkResult> &samples) {
+  assert(addresses.size() <= MAX_FAULTS);
+
+  std::lock_guard lock(mMutex);
+
+  const ExitStatus failure{
+      .reason = ExitReason::Unknown, .memAddr = 0, .ip = 0};
+
+  if (mPid < 0 && !spawn())
+    return failure;
+
+  mControl->fn = fn;
+  mControl->numRuns = numRuns;
+  mControl->args = args;
+  mControl->interleave = interleave;
+  mControl->rule = rule;
+  mControl->events = events;
+  mControl->memory = memory;
+  mControl->log.reset(addresses);
+  mRing->reset();
+
+  notifyEvent(mRequestFD);
+
+  // Either the worker responds, or it dies without saying a word. Samples are
+  // drained meanwhile, so that the ring never stalls the worker for long.
+  struct pollfd fds[] = {{.fd = mResponseFD, .events = POLLIN, .revents = 0},
+                         {.fd = mPidFD, .events = POLLIN, .revents = 0}};
+  while (true) {
+    const int numReady = poll(fds, 2, kSampleRingDrainMS);
+    if (numReady < 0 && errno != EINTR) {
+      reap();
+      return failure;
+    }
+    mRing->drain(samples);
+    if (numReady > 0)
+      break;
+  }
+
+  if (fds[0].revents & POLLIN)
+    waitForEvent(mResponseFD);
+
+  const HarnessLog &log = mControl->log;
+  ExitStatus status{.reason = log.reason,
+                    .memAddr = log.faultAddr,
+                    .ip = log.faultIP};
+
+  // A crashed worker is replaced on the next request.
+  if (status.reason != ExitReason::Success)
+    reap();
+
+  return status;
+}
+} // namespace llvm_ml
@@ -28,6 +28,11 @@ static cl::opt<int> NumRepeatNoise(
     "num-repeat-noise",
     cl::desc("number of basic block repititions for noise measurement"),
     cl::init(10));
+static cl::opt<int> UnrollFactor(
+    "unroll-factor",
+    cl::desc("dump a loop harness with this many basic block copies in the "
+             "loop body"),
+    cl::init(0));
 
 static cl::opt<std::string>
     ArchName("arch", cl::desc("Target arch to assemble for, "
@@ -94,8 +99,12 @@ int main(int argc, char **argv) {
   auto llvmContext = std::make_unique<LLVMContext>();
   auto inlineAsm = mlTarget->createInlineAsmBuilder();
 
-  auto module = llvm_ml::createCPUTestHarness(
-      *llvmContext, microbenchAsm, NumRepeatNoise, NumRepeat, *inlineAsm);
+  auto module =
+      UnrollFactor == 0
+          ? llvm_ml::createCPUTestHarness(*llvmContext, microbenchAsm,
+                                          NumRepeatNoise, NumRepeat, *inlineAsm)
+          : llvm_ml::createCPULoopTestHarness(*llvmContext, microbenchAsm,
+                                              UnrollFactor, *inlineAsm);
 
   if (!module) {
     llvm::errs() << "Failed to generate test harness\n";